@@ -41,56 +41,52 @@ class aabb {
         // We consided the ray hit the bounding box, if the ranges from all interval that the ray
         // hits do overlap
         bool hit(const ray& r, interval ray_t) const {
-            const point3& ray_origin = r.origin();
-            const vec3& ray_dir = r.direction();
+            return hit(traversal_ray(r), ray_t);
+        }
+
+        // Slab test against a ray prepared by `traversal_ray`, which is what the BVHs use.
+        //
+        // Ray is defined by the formula P(t) = Q + t*d. For our interval x (for example), the ray
+        // crosses the planes x0 and x1 of the slab at
+        // t0 = (x0 - Qx) / d
+        // and
+        // t1 = (x1 - Qx) / d
+        // and the ray is inside the box where the ranges [t0, t1] of the 3 slabs overlap. The sign
+        // of the direction tells which of the 2 planes the ray enters through, so the ranges need
+        // no sorting, and the whole test is a chain of minimums and maximums, without branches.
+        //
+        // A ray parallel to a slab gets infinite distances: -infinity and +infinity when it lies
+        // between the planes, which leave the range as it was, or the same infinity twice when it
+        // lies outside, which empties it. A ray lying right on one of the planes gets 0 x infinity,
+        // a NaN. Every comparison with a NaN is false, so the selects below ignore it, and the ray
+        // counts as inside the slab.
+        bool hit(const traversal_ray& r, interval ray_t) const {
+            stats::count(stats::box_tests);
 
-            // Go through all the 3 dimensions
             for (int axis = 0; axis < 3; axis++) {
-                // Get the interval of the current axis
                 const interval& ax = axis_interval(axis);
-                // Ray is defined by the formula P(t) = Q + t*d.
-                // For our interval x (for example), this becomes:
-                // x0 = Qx + t0 * d
-                // and
-                // x1 = Qx + t1 * d
-                // Since we have to find the overlap between the intersection of the ray with all
-                // of the planes, we have to take out t0 and t1, effectively computing
-                // t0 = (x0 - Qx) / d
-                // and
-                // t1 = (x1 - Qx) / d
-
-                // Get the coordinate corresponding to the current axis from the ray direction and
-                // inverse it to compute the 2 `t`s
-                const double adinv = 1.0 / ray_dir[axis];
-
-                auto t0 = (ax.min - ray_origin[axis]) * adinv;
-                auto t1 = (ax.max - ray_origin[axis]) * adinv;
-
-                // Now we ensure that we make the next comparisons with the overlapping
-                // interval between the given `ray_t` and the hit over the current `axis`
-
-                // Test wheather the vector has a positive or a negative direction
-                if (t0 < t1) {
-                    // If t0 is inside the given interval, we make t0 the new interval minimum
-                    if (t0 > ray_t.min) ray_t.min = t0;
-                    // If t1 is inside the given interval, we make t1 the new interval maximum
-                    if (t1 < ray_t.max) ray_t.max = t1;
-                } else {
-                    // On this branch, the vector is negative (opposite direction)
-                    // If t0 is inside the given interval, we make t0 the new interval maximum
-                    if (t0 < ray_t.max) ray_t.max = t0;
-                    // If t1 is inside the given interval, we make t1 the new interval minimum
-                    if (t1 > ray_t.min) ray_t.min = t1;
-                }
-
-                // If the limits overrun one another, there is no overlap, because at least one
-                // of them have gotten outside the previous interval
-                if (ray_t.max <= ray_t.min)
-                    return false;
+                double enter = r.sign[axis] ? ax.max : ax.min;
+                double leave = r.sign[axis] ? ax.min : ax.max;
+                double t0 = (enter - r.origin[axis]) * r.inv_direction[axis];
+                double t1 = (leave - r.origin[axis]) * r.inv_direction[axis];
+
+                ray_t.min = t0 > ray_t.min ? t0 : ray_t.min;
+                ray_t.max = t1 < ray_t.max ? t1 : ray_t.max;
             }
 
-            // At this point we have overlap and as such, we have a hit
-            return true;
+            // Intervals only ever shrink, so checking for overlap once at the end gives the same
+            // answer as checking after every axis
+            bool overlap = ray_t.min < ray_t.max;
+            stats::count(stats::box_hits, overlap);
+            return overlap;
+        }
+
+        // Returns the area of the surface of the box. A ray crossing a box crosses a smaller box
+        // inside it with a probability proportional to the ratio of their surface areas, which is
+        // what the surface area heuristic of the BVH builder relies on.
+        double surface_area() const {
+            if (!(x.size() >= 0 && y.size() >= 0 && z.size() >= 0)) return 0;
+            return 2 * (x.size() * y.size() + y.size() * z.size() + z.size() * x.size());
         }
 
         // Returns the index of the longest axis of the bounding boxes.
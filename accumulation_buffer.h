@@ -0,0 +1,270 @@
+#ifndef ACCUMULATION_BUFFER_H
+#define ACCUMULATION_BUFFER_H
+
+// Header which defines the accumulation buffer: the running sum of all the samples taken for each
+// pixel, along with how many there are. The final image is the average of each pixel. Unlike the
+// finished image, the buffer can keep taking samples, so it is what gets saved to disk to resume
+// a render later.
+//
+// Sums are kept in 64 bit fixed point rather than floating point. Integer additions give the same
+// result in any order, so a pixel ends up with exactly the same value whether its samples were
+// taken in one go, over several resumed runs, or split between several processes.
+//
+// A buffer may cover only a region of the image (the part a distributed rendering job works on),
+// in which case it is still addressed with the coordinates of the whole image.
+
+#include "traceme.h"
+#include "framebuffer.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+class accumulation_buffer {
+    public:
+        accumulation_buffer() {}
+
+        accumulation_buffer(int width, int height) : accumulation_buffer(0, 0, width, height) {}
+
+        // Buffer for the `width` x `height` pixels starting at pixel (x0, y0) of the image
+        accumulation_buffer(int x0, int y0, int width, int height)
+            : origin_x(x0), origin_y(y0), image_width(width), image_height(height),
+              sums(size_t(width) * height * 3, 0), counts(size_t(width) * height, 0)
+        {}
+
+        int x0() const { return origin_x; }
+        int y0() const { return origin_y; }
+        int width() const { return image_width; }
+        int height() const { return image_height; }
+
+        // Adds one sample to pixel (i, j)
+        void add(int i, int j, const color& sample) {
+            size_t pixel = offset(i, j);
+            sums[pixel * 3 + 0] += to_fixed(sample.x());
+            sums[pixel * 3 + 1] += to_fixed(sample.y());
+            sums[pixel * 3 + 2] += to_fixed(sample.z());
+            counts[pixel]++;
+        }
+
+        // Number of samples taken for pixel (i, j)
+        uint32_t count(int i, int j) const {
+            return counts[offset(i, j)];
+        }
+
+        // Average of the samples of pixel (i, j), black if it has none
+        color average(int i, int j) const {
+            size_t pixel = offset(i, j);
+            if (counts[pixel] == 0) return color(0, 0, 0);
+            auto scale = 1.0 / counts[pixel];
+            return scale * color(from_fixed(sums[pixel * 3 + 0]), from_fixed(sums[pixel * 3 + 1]),
+                    from_fixed(sums[pixel * 3 + 2]));
+        }
+
+        // Adds all the samples of `other`, which has to lie within this buffer
+        void merge(const accumulation_buffer& other) {
+            for (int j = 0; j < other.image_height; j++) {
+                for (int i = 0; i < other.image_width; i++) {
+                    size_t from = size_t(j) * other.image_width + i;
+                    size_t to = offset(other.origin_x + i, other.origin_y + j);
+                    for (int c = 0; c < 3; c++) {
+                        sums[to * 3 + c] += other.sums[from * 3 + c];
+                    }
+                    counts[to] += other.counts[from];
+                }
+            }
+        }
+
+        // Returns the image made of the average of every pixel
+        framebuffer resolve() const {
+            framebuffer image(image_width, image_height);
+            for (int j = 0; j < image_height; j++) {
+                for (int i = 0; i < image_width; i++) {
+                    image.set(i, j, average(origin_x + i, origin_y + j));
+                }
+            }
+            return image;
+        }
+
+        // Raw access to the sums (3 per pixel, in the order of the framebuffer) and the counts, for
+        // saving and loading the buffer
+        std::vector<int64_t>& raw_sums() { return sums; }
+        const std::vector<int64_t>& raw_sums() const { return sums; }
+        std::vector<uint32_t>& raw_counts() { return counts; }
+        const std::vector<uint32_t>& raw_counts() const { return counts; }
+
+    private:
+        int origin_x = 0;
+        int origin_y = 0;
+        int image_width = 0;
+        int image_height = 0;
+        std::vector<int64_t> sums;
+        std::vector<uint32_t> counts;
+
+        // Fixed point values have 32 fractional bits, which is far more precision than the
+        // 24 bits of mantissa of the floats we output, and leaves 31 bits of integer part for
+        // the sum of all the samples of a pixel.
+        static constexpr double fixed_scale = 4294967296.0;
+        // Largest value of a single sample. Brighter samples are clamped, such that the sum of
+        // many of them cannot overflow.
+        static constexpr double max_sample = 65536.0;
+
+        static int64_t to_fixed(double value) {
+            // A NaN sample would poison the pixel forever, so it is dropped
+            if (!(value == value)) return 0;
+            value = value < -max_sample ? -max_sample : value > max_sample ? max_sample : value;
+            return int64_t(std::llround(value * fixed_scale));
+        }
+
+        static double from_fixed(int64_t value) {
+            return double(value) / fixed_scale;
+        }
+
+        size_t offset(int i, int j) const {
+            return size_t(j - origin_y) * image_width + (i - origin_x);
+        }
+};
+
+// Everything about a render needed to keep adding samples to its accumulation buffer later, such
+// that the resumed render is identical to one which would have never stopped.
+//
+// Every sample draws its random numbers from its own stream, derived from (seed, frame, pixel,
+// sample index), and the sampler only depends on its type, seed and expected sample count. So the
+// random state of the whole render comes down to these few values plus the number of samples
+// already taken.
+struct render_checkpoint {
+    int width = 0;
+    int height = 0;
+    uint64_t seed = 0;
+    uint64_t frame = 0;
+    // `sampler_type` and expected samples per pixel the sampler was made with
+    int sample_pattern = 0;
+    int sampler_samples = 0;
+    // Number of samples every pixel has received so far
+    int samples_completed = 0;
+};
+
+// Checkpoint file layout, all in the machine's byte order:
+// - magic "TRCK", version, and a byte order mark, as 3 x uint32
+// - the fields of `render_checkpoint`
+// - the region of the image the accumulation buffer covers, as x0, y0, width, height (int32)
+// - the sums of the accumulation buffer, as width x height x 3 x int64
+// - the sample counts, as width x height x uint32
+//
+// The same files carry the results of distributed rendering jobs.
+const uint32_t checkpoint_magic = 0x4b435254;
+const uint32_t checkpoint_version = 2;
+const uint32_t checkpoint_byte_order = 0x01020304;
+
+namespace checkpoint_io {
+
+template <typename T>
+void write(std::ostream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+bool read(std::istream& in, T& value) {
+    return bool(in.read(reinterpret_cast<char*>(&value), sizeof(T)));
+}
+
+}
+
+// Saves `buffer` and the state of its render to the file at `path`. The file is first written
+// next to its destination and then renamed over it, such that a render killed in the middle of
+// saving still leaves the previous checkpoint intact. Returns true on success.
+inline bool save_checkpoint(const std::string& path, const render_checkpoint& state,
+        const accumulation_buffer& buffer) {
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary);
+        if (!out) {
+            std::cerr << "ERROR: Could not open checkpoint file '" << temporary
+                << "' for writing.\n";
+            return false;
+        }
+
+        checkpoint_io::write(out, checkpoint_magic);
+        checkpoint_io::write(out, checkpoint_version);
+        checkpoint_io::write(out, checkpoint_byte_order);
+        checkpoint_io::write(out, int32_t(state.width));
+        checkpoint_io::write(out, int32_t(state.height));
+        checkpoint_io::write(out, state.seed);
+        checkpoint_io::write(out, state.frame);
+        checkpoint_io::write(out, int32_t(state.sample_pattern));
+        checkpoint_io::write(out, int32_t(state.sampler_samples));
+        checkpoint_io::write(out, int32_t(state.samples_completed));
+        checkpoint_io::write(out, int32_t(buffer.x0()));
+        checkpoint_io::write(out, int32_t(buffer.y0()));
+        checkpoint_io::write(out, int32_t(buffer.width()));
+        checkpoint_io::write(out, int32_t(buffer.height()));
+
+        const auto& sums = buffer.raw_sums();
+        const auto& counts = buffer.raw_counts();
+        out.write(reinterpret_cast<const char*>(sums.data()), sums.size() * sizeof(int64_t));
+        out.write(reinterpret_cast<const char*>(counts.data()), counts.size() * sizeof(uint32_t));
+
+        if (!out.flush()) {
+            std::cerr << "ERROR: Could not write checkpoint file '" << temporary << "'.\n";
+            return false;
+        }
+    }
+
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::cerr << "ERROR: Could not move checkpoint file '" << temporary << "' to '" << path
+            << "'.\n";
+        return false;
+    }
+    return true;
+}
+
+// Loads the checkpoint at `path` into `state` and `buffer`. Returns false, with an error on the
+// standard error, if the file cannot be read or is not a valid checkpoint.
+inline bool load_checkpoint(const std::string& path, render_checkpoint& state,
+        accumulation_buffer& buffer) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        std::cerr << "ERROR: Could not open checkpoint file '" << path << "'.\n";
+        return false;
+    }
+
+    uint32_t magic, version, byte_order;
+    int32_t width, height, sample_pattern, sampler_samples, samples_completed;
+    int32_t region_x0, region_y0, region_width, region_height;
+    bool valid = checkpoint_io::read(in, magic) && checkpoint_io::read(in, version)
+        && checkpoint_io::read(in, byte_order) && magic == checkpoint_magic
+        && version == checkpoint_version && byte_order == checkpoint_byte_order
+        && checkpoint_io::read(in, width) && checkpoint_io::read(in, height)
+        && checkpoint_io::read(in, state.seed) && checkpoint_io::read(in, state.frame)
+        && checkpoint_io::read(in, sample_pattern) && checkpoint_io::read(in, sampler_samples)
+        && checkpoint_io::read(in, samples_completed) && width > 0 && height > 0
+        && checkpoint_io::read(in, region_x0) && checkpoint_io::read(in, region_y0)
+        && checkpoint_io::read(in, region_width) && checkpoint_io::read(in, region_height)
+        && region_x0 >= 0 && region_y0 >= 0 && region_width > 0 && region_height > 0
+        && region_x0 + region_width <= width && region_y0 + region_height <= height;
+    if (!valid) {
+        std::cerr << "ERROR: '" << path << "' is not a checkpoint this renderer can read.\n";
+        return false;
+    }
+
+    state.width = width;
+    state.height = height;
+    state.sample_pattern = sample_pattern;
+    state.sampler_samples = sampler_samples;
+    state.samples_completed = samples_completed;
+
+    buffer = accumulation_buffer(region_x0, region_y0, region_width, region_height);
+    auto& sums = buffer.raw_sums();
+    auto& counts = buffer.raw_counts();
+    in.read(reinterpret_cast<char*>(sums.data()), sums.size() * sizeof(int64_t));
+    in.read(reinterpret_cast<char*>(counts.data()), counts.size() * sizeof(uint32_t));
+    if (!in) {
+        std::cerr << "ERROR: Checkpoint file '" << path << "' is truncated.\n";
+        return false;
+    }
+    return true;
+}
+
+#endif
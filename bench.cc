@@ -0,0 +1,742 @@
+// Scene level benchmarks: renders the scenes of `scenes.h` at fixed seeds and reports how long
+// they took, in JSON.
+//
+//     bench [--scene NAME]... [--width W] [--spp N] [--threads N] [--out FILE]
+//           [--reference DIR] [--write-reference DIR] [--no-fork]
+//           [--bvh tree|linear|bvh4|bvh8|none] [--builder sah|median|morton] [--build-threads N]
+//           [--ao N] [--ao-distance D] [--adaptive]
+//     bench --compare BASELINE.json CANDIDATE.json [--threshold PERCENT]
+//     bench --check-layouts [--scene NAME]... [--width W] [--spp N] [--ao N]
+//
+// For every scene we report the BVH build time, the expected cost of tracing a ray through the BVH
+// (which tells how good the tree is, whatever built it), the render's wall time, how many rays
+// were traced (rays/sec) and the peak memory of the process. Each scene is rendered in its own
+// child process, such that its peak memory is its own and not that of the largest scene rendered
+// before it.
+//
+// `--adaptive` renders with adaptive sampling, `--spp` then being the average budget per pixel.
+// A quarter of it goes to the first samples of every pixel, the rest to the noisy pixels.
+//
+// `--ao N` renders ambient occlusion instead of paths (see `render_ambient_occlusion`), with N
+// shadow rays per camera ray, which measures how fast visibility queries are answered. Shadow rays
+// reach `--ao-distance` away, 1 by default. With `--check-layouts`, it checks that every BVH layout
+// answers visibility queries the same.
+//
+// Given a directory of reference images (`<scene>.pfm`, rendered with many samples, for instance
+// through `--write-reference DIR --spp 4096`), the error of every render against its reference is
+// reported as well, along with the efficiency 1 / (error^2 x time). This is the measure of time to
+// quality: a change which makes rendering slower but converge faster is still an improvement if
+// the efficiency goes up.
+//
+// `--compare` reads two reports and prints, for each scene, how much faster or slower the second
+// one is. It exits with status 1 when any scene got slower by more than the threshold (5% by
+// default), such that it can gate a change.
+//
+// `--check-layouts` renders every scene without a BVH, then with every BVH layout built by every
+// builder, and checks the images are the same to the bit. A BVH only changes how fast the closest
+// hit is found, never which one it is, so any difference is a bug, such as boxes which miss the
+// primitives inside them or a split which drops objects. The quads scene covers planar primitives,
+// whose boxes are flat unless padded. It exits with status 1 when any image differs. Scenes too big
+// to render without a BVH are skipped, unless named with `--scene`.
+
+#include "scenes.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Settings shared by all the scenes of a run. Zero keeps the scene's own value.
+struct bench_options {
+    std::vector<std::string> scenes;
+    int width = 200;
+    int samples_per_pixel = 16;
+    unsigned int threads = 0;
+    std::string out_path;
+    std::string reference_directory;
+    std::string write_reference_directory;
+    bool fork = true;
+    // How the BVH of the scenes which have one is laid out and built
+    bvh_settings bvh;
+    // Shadow rays per camera ray in ambient occlusion mode (see `render_ambient_occlusion`), 0 to
+    // trace paths
+    int ao_samples = 0;
+    double ao_distance = 1;
+    bool adaptive = false;
+};
+
+// What we measured about one scene. Passed as is from the child process which rendered the scene
+// to its parent, so it only holds plain values.
+struct bench_result {
+    bool ok = false;
+    int width = 0;
+    int height = 0;
+    int samples_per_pixel = 0;
+    uint64_t objects = 0;
+    double bvh_build_seconds = 0;
+    double bvh_cost = 0;
+    double render_seconds = 0;
+    double wall_seconds = 0;
+    uint64_t samples = 0;
+    uint64_t rays = 0;
+    uint64_t peak_rss_bytes = 0;
+    // Negative when there is no reference to compare against
+    double rmse = -1;
+};
+
+// Reads a Portable Float Map, as written by `encode_pfm`. Returns false if the file is not one.
+bool read_pfm(const std::string& path, framebuffer& image) {
+    std::ifstream in(path, std::ios::binary);
+    std::string magic;
+    int width = 0, height = 0;
+    double scale = 0;
+    if (!(in >> magic >> width >> height >> scale) || magic != "PF" || width <= 0 || height <= 0) {
+        return false;
+    }
+    // A single whitespace separates the header from the pixels
+    in.get();
+
+    const uint16_t endian_probe = 1;
+    bool little_endian = *reinterpret_cast<const unsigned char*>(&endian_probe) == 1;
+    if ((scale < 0) != little_endian) return false;
+
+    image = framebuffer(width, height);
+    std::vector<float> row(size_t(width) * 3);
+    for (int j = height - 1; j >= 0; j--) {
+        if (!in.read(reinterpret_cast<char*>(row.data()), row.size() * sizeof(float))) return false;
+        for (int i = 0; i < width; i++) {
+            image.set(i, j, color(row[i * 3 + 0], row[i * 3 + 1], row[i * 3 + 2]));
+        }
+    }
+    return true;
+}
+
+// Root mean square error between two images of the same size, over all the color components
+double rmse(const framebuffer& a, const framebuffer& b) {
+    double sum = 0;
+    for (int j = 0; j < a.height(); j++) {
+        for (int i = 0; i < a.width(); i++) {
+            auto d = a.get(i, j) - b.get(i, j);
+            sum += d.length_squared();
+        }
+    }
+    return std::sqrt(sum / (3.0 * a.width() * a.height()));
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Applies the settings of the run to the camera of `s`
+void configure_camera(scene& s, const bench_options& options) {
+    auto& cam = s.cam;
+    if (options.width > 0) cam.image_width = options.width;
+    if (options.samples_per_pixel > 0) cam.samples_per_pixel = options.samples_per_pixel;
+    cam.thread_count = options.threads;
+    if (options.adaptive) {
+        cam.adaptive_sampling = true;
+        cam.min_samples_per_pixel = std::max(2, cam.samples_per_pixel / 4);
+    }
+    cam.log_progress = false;
+    // The benchmark renders a frame, whatever the environment says
+    cam.role = distributed_role::none;
+    cam.checkpoint_path.clear();
+}
+
+// Renders `s` with ambient occlusion instead of paths, to measure how fast visibility queries are
+// answered. Every pixel traces `samples_per_pixel` pinhole camera rays through random points of
+// its square, and the first surface each of them hits casts `shadow_rays` shadow rays over the
+// hemisphere around its normal. The pixel is as bright as the share of them which nothing blocks
+// within `distance`, which `hittable::occluded` answers without looking for the closest hit.
+// Shadow rays are cosine distributed, so that share is already the cosine weighted visibility.
+// Camera rays which hit nothing see the sky, unoccluded. Random numbers come from the camera's
+// per sample streams, so the image does not depend on the thread count. Returns the number of
+// rays traced.
+uint64_t render_ambient_occlusion(const scene& s, int shadow_rays, double distance,
+                                  framebuffer& image) {
+    const camera& cam = s.cam;
+    int width = cam.image_width;
+    int height = std::max(1, int(width / cam.aspect_ratio));
+    image = framebuffer(width, height);
+
+    // Same viewport as the camera's, without the defocus blur
+    auto w = unit_vector(cam.lookfrom - cam.lookat);
+    auto u = unit_vector(cross(cam.vup, w));
+    auto v = cross(w, u);
+    auto viewport_height = 2 * std::tan(degrees_to_radians(cam.vfov) / 2) * cam.focus_dist;
+    auto viewport_width = viewport_height * (double(width) / height);
+    auto pixel_delta_u = u * viewport_width / width;
+    auto pixel_delta_v = -v * viewport_height / height;
+    auto upper_left = cam.lookfrom - cam.focus_dist * w - width / 2.0 * pixel_delta_u
+        - height / 2.0 * pixel_delta_v;
+
+    std::atomic<uint64_t> rays{0};
+    tile_scheduler scheduler(make_tiles(width, height, cam.tile_size),
+                             resolve_thread_count(cam.thread_count));
+    scheduler.run([&](const tile& t) {
+        uint64_t tile_rays = 0;
+        for (int j = t.y0; j < t.y1; j++) {
+            for (int i = t.x0; i < t.x1; i++) {
+                double open = 0;
+                for (int k = 0; k < cam.samples_per_pixel; k++) {
+                    seed_sample_stream(cam.seed, cam.frame, uint64_t(j) * width + i, k);
+                    auto target = upper_left + (i + random_double()) * pixel_delta_u
+                        + (j + random_double()) * pixel_delta_v;
+                    ray r(cam.lookfrom, target - cam.lookfrom, random_double());
+
+                    hit_record hit;
+                    tile_rays++;
+                    if (!s.world.hit(r, interval(0.001, infinity), hit)) {
+                        open += 1;
+                        continue;
+                    }
+
+                    // Orthonormal basis around the normal, which faces the camera ray. `helper` is
+                    // any axis far enough from the normal for the cross product to be accurate.
+                    const vec3& n = hit.normal;
+                    vec3 helper = std::fabs(n.x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0);
+                    vec3 a = unit_vector(cross(helper, n));
+                    vec3 b = cross(n, a);
+
+                    int unblocked = 0;
+                    for (int m = 0; m < shadow_rays; m++) {
+                        auto d = sample_cosine_hemisphere(random_double(), random_double());
+                        ray shadow(hit.p, d.x() * a + d.y() * b + d.z() * n, r.time());
+                        if (!s.world.occluded(shadow, interval(0.001, distance))) unblocked++;
+                    }
+                    tile_rays += shadow_rays;
+                    open += double(unblocked) / shadow_rays;
+                }
+                image.set(i, j, color(1, 1, 1) * (open / cam.samples_per_pixel));
+            }
+        }
+        rays += tile_rays;
+    });
+    return rays;
+}
+
+// Renders the frame of `s` the way the run asks for, paths through the camera or ambient occlusion
+// with `--ao`, and reports how long it took and how many rays it traced in `stats`
+bool render_scene(scene& s, const bench_options& options, framebuffer& image,
+                  camera::render_statistics& stats) {
+    if (options.ao_samples <= 0) {
+        if (!s.cam.render_frame(s.world, image)) return false;
+        stats = s.cam.last_render;
+        return true;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    stats = camera::render_statistics();
+    stats.rays = render_ambient_occlusion(s, options.ao_samples, options.ao_distance, image);
+    stats.seconds = seconds_since(start);
+    stats.samples = uint64_t(image.width()) * image.height() * s.cam.samples_per_pixel;
+    return true;
+}
+
+// Builds and renders one scene, in the calling process
+bench_result run_scene(const scene_entry& entry, const bench_options& options) {
+    bench_result result;
+    auto start = std::chrono::steady_clock::now();
+
+    scene s = entry.make();
+    configure_camera(s, options);
+    auto& cam = s.cam;
+
+    framebuffer image;
+    camera::render_statistics stats;
+    if (!render_scene(s, options, image, stats)) return result;
+
+    result.ok = true;
+    result.width = image.width();
+    result.height = image.height();
+    result.samples_per_pixel = cam.samples_per_pixel;
+    result.objects = s.object_count;
+    result.bvh_build_seconds = s.bvh_build_seconds;
+    result.bvh_cost = s.bvh_cost;
+    result.render_seconds = stats.seconds;
+    result.samples = stats.samples;
+    result.rays = stats.rays;
+    result.wall_seconds = seconds_since(start);
+
+    if (!options.write_reference_directory.empty()) {
+        auto path = options.write_reference_directory + "/" + entry.name + ".pfm";
+        if (!write_image(path, image, image_format::pfm)) result.ok = false;
+    }
+
+    if (!options.reference_directory.empty()) {
+        framebuffer reference;
+        auto path = options.reference_directory + "/" + entry.name + ".pfm";
+        if (!read_pfm(path, reference)) {
+            std::cerr << "WARNING: No usable reference image '" << path << "'.\n";
+        } else if (reference.width() != image.width() || reference.height() != image.height()) {
+            std::cerr << "WARNING: Reference image '" << path << "' is " << reference.width()
+                << "x" << reference.height() << ", the render is " << image.width() << "x"
+                << image.height() << ".\n";
+        } else {
+            result.rmse = rmse(image, reference);
+        }
+    }
+
+    return result;
+}
+
+// Renders one scene in a child process, and measures the child's peak memory
+bench_result run_scene_isolated(const scene_entry& entry, const bench_options& options) {
+    bench_result result;
+    int channel[2];
+    if (pipe(channel) != 0) {
+        std::cerr << "ERROR: Could not create a pipe: " << std::strerror(errno) << '\n';
+        return result;
+    }
+
+    pid_t child = fork();
+    if (child < 0) {
+        std::cerr << "ERROR: Could not fork: " << std::strerror(errno) << '\n';
+        close(channel[0]);
+        close(channel[1]);
+        return result;
+    }
+
+    if (child == 0) {
+        close(channel[0]);
+        result = run_scene(entry, options);
+        bool sent = write(channel[1], &result, sizeof(result)) == ssize_t(sizeof(result));
+        close(channel[1]);
+        _exit(sent ? 0 : 1);
+    }
+
+    close(channel[1]);
+    bool received = read(channel[0], &result, sizeof(result)) == ssize_t(sizeof(result));
+    close(channel[0]);
+
+    int status = 0;
+    struct rusage usage;
+    if (wait4(child, &status, 0, &usage) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0
+            || !received) {
+        std::cerr << "ERROR: Scene '" << entry.name << "' did not complete.\n";
+        return bench_result();
+    }
+    // Linux reports kilobytes
+    result.peak_rss_bytes = uint64_t(usage.ru_maxrss) * 1024;
+    return result;
+}
+
+std::string json_string(const std::string& value) {
+    std::string quoted = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') quoted += '\\';
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+const char* layout_name(bvh_layout layout) {
+    switch (layout) {
+        case bvh_layout::linear: return "linear";
+        case bvh_layout::bvh4: return "bvh4";
+        case bvh_layout::bvh8: return "bvh8";
+        case bvh_layout::none: return "none";
+        default: return "tree";
+    }
+}
+
+const char* split_name(bvh_split split) {
+    return split == bvh_split::median ? "median" : split == bvh_split::morton ? "morton" : "sah";
+}
+
+void write_report(std::ostream& out, const bench_options& options,
+        const std::vector<std::pair<std::string, bench_result>>& results) {
+    out << std::setprecision(9);
+    out << "{\n"
+        << "  \"benchmark\": \"traceme\",\n"
+        << "  \"version\": 1,\n"
+        << "  \"threads\": " << resolve_thread_count(options.threads) << ",\n"
+        << "  \"bvh\": " << json_string(layout_name(options.bvh.layout)) << ",\n"
+        << "  \"builder\": " << json_string(split_name(options.bvh.build.split)) << ",\n"
+        << "  \"build_threads\": " << resolve_thread_count(options.bvh.build.threads) << ",\n"
+        << "  \"ao_samples\": " << options.ao_samples << ",\n"
+        << "  \"adaptive\": " << (options.adaptive ? "true" : "false") << ",\n"
+        << "  \"scenes\": [";
+    for (size_t n = 0; n < results.size(); n++) {
+        const auto& name = results[n].first;
+        const auto& r = results[n].second;
+        out << (n ? ",\n" : "\n")
+            << "    {\n"
+            << "      \"name\": " << json_string(name) << ",\n"
+            << "      \"width\": " << r.width << ",\n"
+            << "      \"height\": " << r.height << ",\n"
+            << "      \"samples_per_pixel\": " << r.samples_per_pixel << ",\n"
+            << "      \"objects\": " << r.objects << ",\n"
+            << "      \"bvh_build_seconds\": " << r.bvh_build_seconds << ",\n"
+            << "      \"bvh_cost\": " << r.bvh_cost << ",\n"
+            << "      \"render_seconds\": " << r.render_seconds << ",\n"
+            << "      \"wall_seconds\": " << r.wall_seconds << ",\n"
+            << "      \"rays\": " << r.rays << ",\n"
+            << "      \"rays_per_second\": " << r.rays / r.render_seconds << ",\n"
+            << "      \"samples_per_second\": " << r.samples / r.render_seconds << ",\n"
+            << "      \"peak_rss_bytes\": " << r.peak_rss_bytes;
+        if (r.rmse >= 0) {
+            out << ",\n"
+                << "      \"rmse\": " << r.rmse << ",\n"
+                << "      \"efficiency\": " << 1.0 / (r.rmse * r.rmse * r.render_seconds);
+        }
+        out << "\n    }";
+    }
+    out << "\n  ]\n}\n";
+}
+
+// Just enough of a JSON reader to load back the reports we write: objects, arrays, strings and
+// numbers.
+struct json_value {
+    enum class kind { null, number, string, array, object } type = kind::null;
+    double number = 0;
+    std::string string;
+    std::vector<json_value> array;
+    std::map<std::string, json_value> object;
+
+    const json_value& operator[](const std::string& key) const {
+        static const json_value null;
+        auto it = object.find(key);
+        return it == object.end() ? null : it->second;
+    }
+};
+
+class json_reader {
+    public:
+        json_reader(const std::string& text) : text(text) {}
+
+        bool parse(json_value& value) {
+            return parse_value(value) && (skip_space(), position == text.size());
+        }
+
+    private:
+        const std::string& text;
+        size_t position = 0;
+
+        void skip_space() {
+            while (position < text.size() && std::isspace((unsigned char)text[position])) {
+                position++;
+            }
+        }
+
+        bool consume(char c) {
+            skip_space();
+            if (position < text.size() && text[position] == c) {
+                position++;
+                return true;
+            }
+            return false;
+        }
+
+        bool parse_string(std::string& value) {
+            if (!consume('"')) return false;
+            while (position < text.size() && text[position] != '"') {
+                if (text[position] == '\\') position++;
+                if (position < text.size()) value += text[position++];
+            }
+            return consume('"');
+        }
+
+        bool parse_value(json_value& value) {
+            skip_space();
+            if (position >= text.size()) return false;
+            char c = text[position];
+
+            if (c == '{') {
+                value.type = json_value::kind::object;
+                position++;
+                if (consume('}')) return true;
+                do {
+                    std::string key;
+                    if (!parse_string(key) || !consume(':')) return false;
+                    if (!parse_value(value.object[key])) return false;
+                } while (consume(','));
+                return consume('}');
+            }
+            if (c == '[') {
+                value.type = json_value::kind::array;
+                position++;
+                if (consume(']')) return true;
+                do {
+                    value.array.emplace_back();
+                    if (!parse_value(value.array.back())) return false;
+                } while (consume(','));
+                return consume(']');
+            }
+            if (c == '"') {
+                value.type = json_value::kind::string;
+                return parse_string(value.string);
+            }
+
+            char* end = nullptr;
+            value.type = json_value::kind::number;
+            value.number = std::strtod(text.c_str() + position, &end);
+            if (end == text.c_str() + position) return false;
+            position = end - text.c_str();
+            return true;
+        }
+};
+
+bool load_report(const std::string& path, json_value& report) {
+    std::ifstream in(path);
+    std::stringstream text;
+    text << in.rdbuf();
+    if (!in || !json_reader(text.str()).parse(report) || report["benchmark"].string != "traceme"
+            || report["scenes"].type != json_value::kind::array) {
+        std::cerr << "ERROR: '" << path << "' is not a benchmark report.\n";
+        return false;
+    }
+    return true;
+}
+
+// Compares the scenes both reports have in common. Returns the process exit status: 0 if no scene
+// got slower by more than `threshold` percent, 1 otherwise.
+int compare_reports(const std::string& baseline_path, const std::string& candidate_path,
+        double threshold) {
+    json_value baseline, candidate;
+    if (!load_report(baseline_path, baseline) || !load_report(candidate_path, candidate)) return 2;
+
+    std::map<std::string, const json_value*> baseline_scenes;
+    for (const auto& s : baseline["scenes"].array) baseline_scenes[s["name"].string] = &s;
+
+    auto change = [](double before, double after) {
+        return before > 0 ? 100.0 * (after - before) / before : 0.0;
+    };
+
+    bool regressed = false;
+    std::cout << std::fixed << std::setprecision(1)
+        << std::left << std::setw(22) << "scene" << std::right
+        << std::setw(14) << "base Mrays/s" << std::setw(14) << "new Mrays/s"
+        << std::setw(10) << "rays/s"
+        << std::setw(10) << "build" << std::setw(10) << "bvh cost" << std::setw(10) << "memory"
+        << std::setw(12) << "efficiency"
+        << '\n';
+    for (const auto& after : candidate["scenes"].array) {
+        auto it = baseline_scenes.find(after["name"].string);
+        if (it == baseline_scenes.end()) continue;
+        const auto& before = *it->second;
+
+        // Throughput is what we gate on: it does not depend on the scene having the same sample
+        // count in both runs
+        auto speed = change(before["rays_per_second"].number, after["rays_per_second"].number);
+        bool slower = speed < -threshold;
+        regressed = regressed || slower;
+
+        std::cout << std::left << std::setw(22) << after["name"].string << std::right
+            << std::setw(14) << before["rays_per_second"].number / 1e6
+            << std::setw(14) << after["rays_per_second"].number / 1e6
+            << std::setw(9) << std::showpos << speed << '%'
+            << std::setw(9) << change(before["bvh_build_seconds"].number,
+                    after["bvh_build_seconds"].number) << '%'
+            << std::setw(9) << change(before["bvh_cost"].number, after["bvh_cost"].number) << '%'
+            << std::setw(9) << change(before["peak_rss_bytes"].number,
+                    after["peak_rss_bytes"].number) << '%';
+        if (before["efficiency"].type == json_value::kind::number
+                && after["efficiency"].type == json_value::kind::number) {
+            std::cout << std::setw(11)
+                << change(before["efficiency"].number, after["efficiency"].number) << '%';
+        }
+        std::cout << std::noshowpos << (slower ? "  REGRESSION" : "") << '\n';
+    }
+
+    return regressed ? 1 : 0;
+}
+
+// Number of pixels which differ between two images of the same size
+int count_different_pixels(const framebuffer& a, const framebuffer& b) {
+    int different = 0;
+    for (int j = 0; j < a.height(); j++) {
+        for (int i = 0; i < a.width(); i++) {
+            auto p = a.get(i, j);
+            auto q = b.get(i, j);
+            different += p[0] != q[0] || p[1] != q[1] || p[2] != q[2];
+        }
+    }
+    return different;
+}
+
+// Renders the scenes without a BVH and with every layout and builder, and compares the images.
+// Returns the process exit status: 0 if all the BVHs render every scene exactly like the plain
+// list, 1 otherwise.
+int check_layouts(const bench_options& options) {
+    const bvh_layout layouts[] = {
+        bvh_layout::tree, bvh_layout::linear, bvh_layout::bvh4, bvh_layout::bvh8
+    };
+    const bvh_split splits[] = { bvh_split::sah, bvh_split::median, bvh_split::morton };
+
+    // Most objects a scene may have to be checked by default, as every ray is tested against all
+    // of them without a BVH
+    const size_t max_default_objects = 100000;
+
+    // Builds scene `name` laid out with `layout`, split by `split`. The catalog is made again for
+    // every BVH, since its scenes capture the settings they are built with.
+    auto make = [&](const std::string& name, bvh_layout layout, bvh_split split) {
+        bvh_settings bvh = options.bvh;
+        bvh.layout = layout;
+        bvh.build.split = split;
+        for (const auto& entry : scene_catalog(bvh)) {
+            if (entry.name == name) {
+                scene s = entry.make();
+                configure_camera(s, options);
+                return s;
+            }
+        }
+        return scene();
+    };
+
+    bool all_same = true;
+    for (const auto& entry : scene_catalog()) {
+        if (!options.scenes.empty() && std::find(options.scenes.begin(), options.scenes.end(),
+                    entry.name) == options.scenes.end()) {
+            continue;
+        }
+
+        scene plain = make(entry.name, bvh_layout::none, bvh_split::sah);
+        if (options.scenes.empty() && plain.object_count > max_default_objects) {
+            std::cout << std::left << std::setw(22) << entry.name << "skipped, "
+                << plain.object_count << " objects are too many without a BVH" << std::endl;
+            continue;
+        }
+
+        framebuffer expected;
+        camera::render_statistics stats;
+        if (!render_scene(plain, options, expected, stats)) return 1;
+        for (auto layout : layouts) {
+            for (auto split : splits) {
+                scene s = make(entry.name, layout, split);
+                framebuffer image;
+                if (!render_scene(s, options, image, stats)) return 1;
+                int different = count_different_pixels(expected, image);
+                std::cout << std::left << std::setw(22) << entry.name << std::setw(8)
+                    << layout_name(layout) << std::setw(8) << split_name(split) << ": "
+                    << (different ? std::to_string(different) + " pixels differ" : "identical")
+                    << std::endl;
+                all_same = all_same && different == 0;
+            }
+        }
+    }
+    return all_same ? 0 : 1;
+}
+
+void usage() {
+    std::cerr << "usage: bench [--scene NAME]... [--width W] [--spp N] [--threads N] [--out FILE]\n"
+        << "             [--reference DIR] [--write-reference DIR] [--no-fork]\n"
+        << "             [--bvh tree|linear|bvh4|bvh8|none] [--builder sah|median|morton]\n"
+        << "             [--build-threads N] [--ao N] [--ao-distance D]\n"
+        << "             [--adaptive]\n"
+        << "       bench --compare BASELINE.json CANDIDATE.json [--threshold PERCENT]\n"
+        << "       bench --check-layouts [--scene NAME]... [--width W] [--spp N] [--ao N]\n"
+        << "scenes:";
+    for (const auto& entry : scene_catalog()) std::cerr << ' ' << entry.name;
+    std::cerr << '\n';
+}
+
+int main(int argc, char** argv) {
+    bench_options options;
+    std::string baseline, candidate;
+    double threshold = 5.0;
+    bool layout_check = false;
+
+    for (int n = 1; n < argc; n++) {
+        std::string arg = argv[n];
+        bool has_value = n + 1 < argc;
+        if (arg == "--scene" && has_value) options.scenes.push_back(argv[++n]);
+        else if (arg == "--width" && has_value) options.width = std::atoi(argv[++n]);
+        else if (arg == "--spp" && has_value) options.samples_per_pixel = std::atoi(argv[++n]);
+        else if (arg == "--threads" && has_value) options.threads = std::atoi(argv[++n]);
+        else if (arg == "--out" && has_value) options.out_path = argv[++n];
+        else if (arg == "--reference" && has_value) options.reference_directory = argv[++n];
+        else if (arg == "--write-reference" && has_value) {
+            options.write_reference_directory = argv[++n];
+        }
+        else if (arg == "--threshold" && has_value) threshold = std::atof(argv[++n]);
+        else if (arg == "--compare" && n + 2 < argc) {
+            baseline = argv[++n];
+            candidate = argv[++n];
+        }
+        else if (arg == "--no-fork") options.fork = false;
+        else if (arg == "--adaptive") options.adaptive = true;
+        else if (arg == "--check-layouts") layout_check = true;
+        else if (arg == "--bvh" && has_value) {
+            std::string value = argv[++n];
+            if (value == "tree") options.bvh.layout = bvh_layout::tree;
+            else if (value == "linear") options.bvh.layout = bvh_layout::linear;
+            else if (value == "bvh4") options.bvh.layout = bvh_layout::bvh4;
+            else if (value == "bvh8") options.bvh.layout = bvh_layout::bvh8;
+            else if (value == "none") options.bvh.layout = bvh_layout::none;
+            else {
+                usage();
+                return 2;
+            }
+        }
+        else if (arg == "--builder" && has_value) {
+            std::string value = argv[++n];
+            if (value == "sah") options.bvh.build.split = bvh_split::sah;
+            else if (value == "median") options.bvh.build.split = bvh_split::median;
+            else if (value == "morton") options.bvh.build.split = bvh_split::morton;
+            else {
+                usage();
+                return 2;
+            }
+        }
+        else if (arg == "--build-threads" && has_value) {
+            options.bvh.build.threads = std::atoi(argv[++n]);
+        }
+        else if (arg == "--ao" && has_value) options.ao_samples = std::atoi(argv[++n]);
+        else if (arg == "--ao-distance" && has_value) options.ao_distance = std::atof(argv[++n]);
+        else {
+            usage();
+            return 2;
+        }
+    }
+
+    if (!baseline.empty()) return compare_reports(baseline, candidate, threshold);
+    if (layout_check) return check_layouts(options);
+
+    std::vector<std::pair<std::string, bench_result>> results;
+    for (const auto& entry : scene_catalog(options.bvh)) {
+        if (!options.scenes.empty() && std::find(options.scenes.begin(), options.scenes.end(),
+                    entry.name) == options.scenes.end()) {
+            continue;
+        }
+
+        std::clog << "Rendering " << entry.name << "..." << std::flush;
+        auto result = options.fork ? run_scene_isolated(entry, options) : run_scene(entry, options);
+        if (!options.fork) {
+            // Without a child process, all we have is the peak of the whole run so far
+            struct rusage usage;
+            getrusage(RUSAGE_SELF, &usage);
+            result.peak_rss_bytes = uint64_t(usage.ru_maxrss) * 1024;
+        }
+        if (!result.ok) return 1;
+
+        std::clog << ' ' << std::fixed << std::setprecision(2) << result.render_seconds << "s, "
+            << result.rays / result.render_seconds / 1e6 << " Mrays/s\n";
+        results.emplace_back(entry.name, result);
+    }
+
+    if (options.out_path.empty()) {
+        write_report(std::cout, options, results);
+    } else {
+        std::ofstream out(options.out_path);
+        write_report(out, options, results);
+        if (!out.flush()) {
+            std::cerr << "ERROR: Could not write '" << options.out_path << "'.\n";
+            return 1;
+        }
+    }
+    return 0;
+}
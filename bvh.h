@@ -6,14 +6,411 @@
 #include "aabb.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "scheduler.h"
 
 #include <algorithm>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+// How the BVH builders decide where to split a set of objects in two
+enum class bvh_split {
+    // Binned surface area heuristic: among the splits along bin boundaries, on all 3 axes, pick
+    // the one with the lowest expected cost of tracing a ray through the two halves
+    sah,
+    // Sort the objects along the longest axis and split them in two equal halves. The original
+    // builder, kept for comparison.
+    median,
+    // Linear BVH: sort the objects once along a Morton curve through their centroids, then split
+    // every node where the highest bit of the Morton codes changes. The fastest build there is,
+    // with no cost estimate at all, for when the tree is thrown away after a few frames.
+    morton,
+};
+
+// Settings of the BVH builder
+struct bvh_build_options {
+    bvh_split split = bvh_split::sah;
+    // Number of bins the centroids are sorted into, on each axis, when looking for a SAH split
+    int bins = 16;
+    // Most objects a leaf may hold. Bigger nodes are always split. Up to this size, a node
+    // becomes a leaf when the SAH finds that testing all its objects is cheaper than splitting.
+    // The median and Morton splits only ever make leaves of 1 or 2 objects.
+    size_t max_leaf_size = 4;
+    // Relative costs of visiting a node (testing its box) and of intersecting an object. Only
+    // their ratio matters. A higher traversal cost makes for shallower trees with bigger leaves.
+    double traversal_cost = 1.0;
+    double intersection_cost = 1.0;
+    // Number of threads building the tree, zero to use every hardware thread. With more than one
+    // thread, big nodes are partitioned in another order, so the tree can come out slightly
+    // different, though the splits are the same.
+    unsigned int threads = 0;
+};
+
+// Nodes with fewer objects than this are built by a single thread. Below it, starting a thread
+// costs more than the work it would take over.
+const size_t bvh_parallel_span = 1 << 14;
+
+// What the BVH builders know about each object. The bounding box and centroid of every object are
+// computed once up front, rather than through a virtual call at every level of the tree.
+struct bvh_build_object {
+    shared_ptr<hittable> object;
+    aabb box;
+    point3 centroid;
+    // Position of the centroid along the Morton curve, only computed for `bvh_split::morton`
+    uint64_t morton = 0;
+};
+
+// Number of threads to spread the work on objects [start, end) over, given `threads` are available
+inline unsigned int bvh_thread_count(size_t start, size_t end, unsigned int threads) {
+    return end - start < bvh_parallel_span ? 1 : threads;
+}
+
+// Bounding box of objects [start, end) of `build`
+inline aabb bvh_bounds(const std::vector<bvh_build_object>& build, size_t start, size_t end,
+        unsigned int threads = 1) {
+    unsigned int chunks = bvh_thread_count(start, end, threads);
+    if (chunks == 1) {
+        aabb box = aabb::empty;
+        for (size_t n = start; n < end; n++) box = aabb(box, build[n].box);
+        return box;
+    }
+    std::vector<aabb> boxes(chunks, aabb::empty);
+    parallel_chunks(start, end, chunks, [&](unsigned int chunk, size_t begin, size_t finish) {
+        for (size_t n = begin; n < finish; n++) {
+            boxes[chunk] = aabb(boxes[chunk], build[n].box);
+        }
+    });
+
+    aabb box = aabb::empty;
+    for (const auto& b : boxes) box = aabb(box, b);
+    return box;
+}
+
+// Bounding box of the centroids of objects [start, end) of `build`
+inline aabb bvh_centroid_bounds(const std::vector<bvh_build_object>& build, size_t start,
+        size_t end, unsigned int threads = 1) {
+    unsigned int chunks = bvh_thread_count(start, end, threads);
+    if (chunks == 1) {
+        aabb box = aabb::empty;
+        for (size_t n = start; n < end; n++) {
+            box = aabb(box, aabb(build[n].centroid, build[n].centroid));
+        }
+        return box;
+    }
+    std::vector<aabb> boxes(chunks, aabb::empty);
+    parallel_chunks(start, end, chunks, [&](unsigned int chunk, size_t begin, size_t finish) {
+        for (size_t n = begin; n < finish; n++) {
+            boxes[chunk] = aabb(boxes[chunk], aabb(build[n].centroid, build[n].centroid));
+        }
+    });
+
+    aabb box = aabb::empty;
+    for (const auto& b : boxes) box = aabb(box, b);
+    return box;
+}
+
+// Spreads the low 21 bits of `x` out to every third bit, such that the codes of 3 coordinates can
+// be interleaved
+inline uint64_t bvh_spread_bits(uint64_t x) {
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffff;
+    x = (x | x << 16) & 0x1f0000ff0000ff;
+    x = (x | x << 8) & 0x100f00f00f00f00f;
+    x = (x | x << 4) & 0x10c30c30c30c30c3;
+    x = (x | x << 2) & 0x1249249249249249;
+    return x;
+}
+
+// Gives every object its Morton code, and sorts them along the Morton curve. The curve visits a
+// grid of 2^21 cells along each axis of the box of the centroids, one octant after the other, so
+// objects close along the curve are close in space.
+inline void bvh_sort_morton(std::vector<bvh_build_object>& build, unsigned int threads) {
+    aabb bounds = bvh_centroid_bounds(build, 0, build.size(), threads);
+    double scale[3];
+    for (int axis = 0; axis < 3; axis++) {
+        double size = bounds.axis_interval(axis).size();
+        scale[axis] = size > 0 ? double((1 << 21) - 1) / size : 0;
+    }
+
+    unsigned int chunks = bvh_thread_count(0, build.size(), threads);
+    parallel_chunks(0, build.size(), chunks, [&](unsigned int, size_t begin, size_t end) {
+        for (size_t n = begin; n < end; n++) {
+            uint64_t cell[3];
+            for (int axis = 0; axis < 3; axis++) {
+                double offset = build[n].centroid[axis] - bounds.axis_interval(axis).min;
+                cell[axis] = uint64_t(offset * scale[axis]);
+            }
+            // x takes the highest bit of each group of 3, then y, then z
+            build[n].morton = bvh_spread_bits(cell[0]) << 2 | bvh_spread_bits(cell[1]) << 1
+                | bvh_spread_bits(cell[2]);
+        }
+    });
+
+    // Each thread sorts its chunk, then the sorted chunks are merged two by two. The sort is
+    // stable, such that the order does not depend on how the objects were chunked.
+    auto by_code = [](const bvh_build_object& a, const bvh_build_object& b) {
+        return a.morton < b.morton;
+    };
+    std::vector<size_t> bounds_of_chunks;
+    parallel_chunks(0, build.size(), chunks, [&](unsigned int, size_t begin, size_t end) {
+        std::stable_sort(build.begin() + begin, build.begin() + end, by_code);
+    });
+    for (unsigned int chunk = 0; chunk <= chunks; chunk++) {
+        bounds_of_chunks.push_back(build.size() * chunk / chunks);
+    }
+    for (size_t width = 1; width < chunks; width *= 2) {
+        for (size_t chunk = 0; chunk + width < chunks; chunk += 2 * width) {
+            auto last = std::min<size_t>(chunk + 2 * width, chunks);
+            std::inplace_merge(build.begin() + bounds_of_chunks[chunk],
+                    build.begin() + bounds_of_chunks[chunk + width],
+                    build.begin() + bounds_of_chunks[last], by_code);
+        }
+    }
+}
+
+// Collects what the builders need to know about objects [start, end) of `objects`
+inline std::vector<bvh_build_object> make_bvh_build_objects(
+        const std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end,
+        const bvh_build_options& options = bvh_build_options()) {
+    unsigned int threads = resolve_thread_count(options.threads);
+    std::vector<bvh_build_object> build(end - start);
+    unsigned int chunks = bvh_thread_count(start, end, threads);
+    parallel_chunks(0, build.size(), chunks, [&](unsigned int, size_t begin, size_t finish) {
+        for (size_t n = begin; n < finish; n++) {
+            build[n].object = objects[start + n];
+            build[n].box = build[n].object->bounding_box();
+            for (int axis = 0; axis < 3; axis++) {
+                const auto& extent = build[n].box.axis_interval(axis);
+                build[n].centroid[axis] = 0.5 * (extent.min + extent.max);
+            }
+        }
+    });
+
+    if (options.split == bvh_split::morton) bvh_sort_morton(build, threads);
+    return build;
+}
+
+// Moves the objects of [start, end) of `build` which satisfy `goes_left` in front of the others,
+// and returns the index of the first of the others. With several threads, each one sorts a chunk
+// of the objects into a copy of them, at the offsets their counts give.
+template <typename Predicate>
+size_t bvh_partition_objects(std::vector<bvh_build_object>& build, size_t start, size_t end,
+        const Predicate& goes_left, unsigned int threads) {
+    unsigned int chunks = bvh_thread_count(start, end, threads);
+    if (chunks <= 1) {
+        auto middle = std::partition(build.begin() + start, build.begin() + end, goes_left);
+        return size_t(middle - build.begin());
+    }
+
+    std::vector<size_t> left_counts(chunks, 0);
+    parallel_chunks(start, end, chunks, [&](unsigned int chunk, size_t begin, size_t finish) {
+        for (size_t n = begin; n < finish; n++) {
+            if (goes_left(build[n])) left_counts[chunk]++;
+        }
+    });
+
+    size_t left_total = 0;
+    for (auto count : left_counts) left_total += count;
+
+    std::vector<bvh_build_object> sorted(end - start);
+    parallel_chunks(start, end, chunks, [&](unsigned int chunk, size_t begin, size_t finish) {
+        size_t left = 0;
+        for (unsigned int c = 0; c < chunk; c++) left += left_counts[c];
+        size_t right = left_total + (begin - start) - left;
+        for (size_t n = begin; n < finish; n++) {
+            auto& slot = goes_left(build[n]) ? sorted[left++] : sorted[right++];
+            slot = std::move(build[n]);
+        }
+    });
+    parallel_chunks(start, end, chunks, [&](unsigned int, size_t begin, size_t finish) {
+        for (size_t n = begin; n < finish; n++) build[n] = std::move(sorted[n - start]);
+    });
+
+    return start + left_total;
+}
+
+inline int bvh_bin_index(double value, double min, double scale, int bin_count) {
+    int index = int((value - min) * scale);
+    return index < 0 ? 0 : index >= bin_count ? bin_count - 1 : index;
+}
+
+// Sorts objects [start, end) of `build` along the longest axis of their `bounds`, by the minimum
+// of their boxes, and returns the middle
+inline size_t bvh_median_split(std::vector<bvh_build_object>& build, size_t start, size_t end,
+        const aabb& bounds, int& axis) {
+    // And we split based on the longest axis, to give us a better split
+    axis = bounds.longest_axis();
+    std::sort(build.begin() + start, build.begin() + end,
+            [axis](const bvh_build_object& a, const bvh_build_object& b) {
+                return a.box.axis_interval(axis).min < b.box.axis_interval(axis).min;
+            });
+    return start + (end - start) / 2;
+}
+
+// Splits objects [start, end) of `build`, which are sorted by Morton code, where the highest bit
+// which differs between their codes changes. Every code of the left half has the bit cleared, every
+// code of the right half has it set, so the halves lie on either side of a plane of the grid.
+inline size_t bvh_morton_split(std::vector<bvh_build_object>& build, size_t start, size_t end,
+        const aabb& bounds, int& axis) {
+    uint64_t first = build[start].morton;
+    uint64_t last = build[end - 1].morton;
+    // The objects share a cell of the grid
+    if (first == last) {
+        axis = bounds.longest_axis();
+        return start + (end - start) / 2;
+    }
+
+    int bit = 63 - __builtin_clzll(first ^ last);
+    // Bits go x, y, z from the highest of each group of 3
+    axis = 2 - bit % 3;
+    auto middle = std::partition_point(build.begin() + start, build.begin() + end,
+            [bit](const bvh_build_object& o) { return !((o.morton >> bit) & 1); });
+    return size_t(middle - build.begin());
+}
+
+// Finds the cheapest split of objects [start, end) of `build`, whose bounding box is `bounds`,
+// according to the surface area heuristic, and partitions them around it. Returns the index of the
+// first object of the right half, or `start` when the objects are best left in a single leaf.
+// `axis` is set to the axis the objects were split along.
+//
+// The SAH estimates the cost of a node as the cost of testing its box, plus the cost of each child
+// weighted by the chance that a ray through the node also goes through the child, which is the
+// ratio of their surface areas. Rather than trying every possible split, the centroids are sorted
+// into bins of equal width, and only the boundaries between bins are considered: one linear pass
+// per axis instead of a sort. On big nodes, each thread bins a chunk of the objects, and their
+// bins are added up.
+inline size_t bvh_sah_split(std::vector<bvh_build_object>& build, size_t start, size_t end,
+        const aabb& bounds, const bvh_build_options& options, int& axis,
+        unsigned int threads = 1) {
+    const int bin_count = options.bins < 2 ? 2 : options.bins;
+    auto object_span = end - start;
+
+    aabb centroid_bounds = bvh_centroid_bounds(build, start, end, threads);
+
+    struct bin {
+        aabb box = aabb::empty;
+        size_t count = 0;
+    };
+
+    double scales[3];
+    for (int a = 0; a < 3; a++) {
+        const auto& extent = centroid_bounds.axis_interval(a);
+        scales[a] = extent.size() > 0 ? bin_count / extent.size() : 0;
+    }
+
+    // Bins objects [begin, finish) into the bins of the 3 axes, one after the other
+    auto bin_objects = [&](std::vector<bin>& bins, size_t begin, size_t finish) {
+        for (int a = 0; a < 3; a++) {
+            // All the centroids are in the same spot along this axis
+            if (scales[a] == 0) continue;
+            double min = centroid_bounds.axis_interval(a).min;
+            bin* axis_bins = &bins[a * bin_count];
+            for (size_t n = begin; n < finish; n++) {
+                auto& b = axis_bins[bvh_bin_index(build[n].centroid[a], min, scales[a],
+                        bin_count)];
+                b.box = aabb(b.box, build[n].box);
+                b.count++;
+            }
+        }
+    };
+
+    std::vector<bin> bins(3 * bin_count);
+    unsigned int chunks = bvh_thread_count(start, end, threads);
+    if (chunks == 1) {
+        bin_objects(bins, start, end);
+    } else {
+        // Each thread bins a chunk of the objects into its own bins, which are then added up
+        std::vector<std::vector<bin>> chunk_bins(chunks, std::vector<bin>(3 * bin_count));
+        parallel_chunks(start, end, chunks, [&](unsigned int chunk, size_t begin, size_t finish) {
+            bin_objects(chunk_bins[chunk], begin, finish);
+        });
+        for (const auto& chunk : chunk_bins) {
+            for (int k = 0; k < 3 * bin_count; k++) {
+                bins[k].box = aabb(bins[k].box, chunk[k].box);
+                bins[k].count += chunk[k].count;
+            }
+        }
+    }
+
+    double best_cost = infinity;
+    int best_axis = -1;
+    int best_boundary = 0;
+    std::vector<double> right_area(bin_count);
+    std::vector<size_t> right_count(bin_count);
+
+    for (int a = 0; a < 3; a++) {
+        if (scales[a] == 0) continue;
+        const bin* axis_bins = &bins[a * bin_count];
+
+        // Sweep from the right, then from the left, to get the area and count on either side of
+        // every boundary. Boundary k lies between bins k - 1 and k.
+        aabb box = aabb::empty;
+        size_t count = 0;
+        for (int k = bin_count - 1; k > 0; k--) {
+            box = aabb(box, axis_bins[k].box);
+            count += axis_bins[k].count;
+            right_area[k] = box.surface_area();
+            right_count[k] = count;
+        }
+
+        box = aabb::empty;
+        count = 0;
+        for (int k = 1; k < bin_count; k++) {
+            box = aabb(box, axis_bins[k - 1].box);
+            count += axis_bins[k - 1].count;
+            if (count == 0 || right_count[k] == 0) continue;
+
+            double cost = box.surface_area() * count + right_area[k] * right_count[k];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = a;
+                best_boundary = k;
+            }
+        }
+    }
+
+    double area = bounds.surface_area();
+    best_cost = options.traversal_cost
+        + options.intersection_cost * (area > 0 ? best_cost / area : object_span);
+    double leaf_cost = options.intersection_cost * object_span;
+
+    axis = best_axis < 0 ? bounds.longest_axis() : best_axis;
+    if (object_span <= options.max_leaf_size && leaf_cost <= best_cost) return start;
+
+    // The centroids all lie in the same spot, no plane separates them. Split the objects in two
+    // halves, in whatever order they are.
+    if (best_axis < 0) return start + object_span / 2;
+
+    double min = centroid_bounds.axis_interval(best_axis).min;
+    double scale = scales[best_axis];
+    return bvh_partition_objects(build, start, end, [&](const bvh_build_object& o) {
+                return bvh_bin_index(o.centroid[best_axis], min, scale, bin_count)
+                    < best_boundary;
+            }, threads);
+}
+
+// Splits objects [start, end) of `build` as `options` say, using up to `threads` threads. Returns
+// the index of the first object of the right half, or `start` to make a leaf of them all.
+inline size_t bvh_partition(std::vector<bvh_build_object>& build, size_t start, size_t end,
+        const aabb& bounds, const bvh_build_options& options, int& axis,
+        unsigned int threads = 1) {
+    switch (options.split) {
+        case bvh_split::median:
+            return bvh_median_split(build, start, end, bounds, axis);
+        case bvh_split::morton:
+            return bvh_morton_split(build, start, end, bounds, axis);
+        default:
+            return bvh_sah_split(build, start, end, bounds, options, axis, threads);
+    }
+}
 
 // Node representing a tree of bounding volume hierarchies
 class bvh_node: public hittable {
     public:
         // Create a new node with a hittable list
-        bvh_node(hittable_list list): bvh_node(list.objects, 0, list.objects.size()) {
+        bvh_node(hittable_list list, const bvh_build_options& options = bvh_build_options())
+            : bvh_node(list.objects, 0, list.objects.size(), options)
+        {
             // This constructor creates a copy of the hittable list (not ideal), which we will
             // modify. The lifetime of the copied list only extends until this constructor exits.
             // That is OK, because we only need to persist the resulting bounding bolume hierarchy
@@ -22,89 +419,225 @@ class bvh_node: public hittable {
         // The most complicated part of any efficiency structure is building it. We construct a
         // new `bvh_node` from a given list of object within the span given by `start` and `end`
         // offsets
-        bvh_node(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end) {
-            // Build the bounding box from the span of the source objects
-            bbox = aabb::empty;
+        bvh_node(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end,
+                const bvh_build_options& options = bvh_build_options()) {
+            auto build = make_bvh_build_objects(objects, start, end, options);
+            build_node(build, 0, build.size(), options, resolve_thread_count(options.threads));
 
-            for (size_t object_index=start; object_index < end; object_index++) {
-                bbox = aabb(bbox, objects[object_index]->bounding_box());
+            // Callers may rely on the objects coming out sorted in the order of the leaves
+            for (size_t n = 0; n < build.size(); n++) {
+                objects[start + n] = build[n].object;
             }
+        }
 
-            // And we split based on the longest axis, to give us a better split
-            unsigned int axis = bbox.longest_axis();
-            // Comparator for the sorting function. Based on what axis we choose, we compare that
-            // axis
-            auto comparator  = (axis == 0) ? box_x_compare
-                            : (axis == 1) ? box_y_compare
-                            : box_z_compare;
+        // Computes whether the ray hits this node, by recursively checking its left and right
+        // children
+        bool hit(const ray& r, const interval& ray_t, hit_record& rec) const override {
+            return hit_and_finish(r, ray_t, rec);
+        }
 
-            auto object_span = end - start;
+        // The descent only records where the primitives were hit, the closest of them fills in
+        // the rest of the record once it is over
+        bool hit_deferred(const ray& r, const interval& ray_t, hit_record& rec) const override {
+            // The inverse of the direction is computed once for the whole descent
+            return hit_deferred(r, traversal_ray(r), ray_t, rec);
+        }
 
-            // If we have a single object, we put it in both trees to avoid treating null pointer
-            // conditions
-            if (object_span == 1) {
-                left = right = objects[start];
-            } else if (object_span == 2) {
-                // If we have 2 objects, we put one in the left tree and one in the right tree
-                left = objects[start];
-                right = objects[start+1];
-            } else {
-                // We sort the objects with the chosen comparison function
-                std::sort(objects.begin() + start, objects.begin() + end, comparator);
+        // Stops at the first primitive in the way. The child with the bigger box, the likelier to
+        // be hit, is visited first (see `linear_bvh::occluded`).
+        bool occluded(const ray& r, const interval& ray_t) const override {
+            return occluded(r, traversal_ray(r), ray_t);
+        }
 
-                // Chose  mid point
-                auto mid = start + object_span / 2;
+        // Batched traversal. We filter the batch down to the rays that hit this node's box and
+        // hand only those to the children, so every node is visited once per batch instead of
+        // once per ray.
+        void hit_batch(const ray* rays, const uint32_t* indices, size_t count, double t_min,
+                hit_record* recs, bool* hits) const override {
+            // The filtered list lives on the stack for small batches, which are the common case
+            // deep in the tree
+            uint32_t local[min_batch_size];
+            std::vector<uint32_t> heap;
+            uint32_t* active = local;
+            if (count > min_batch_size) {
+                heap.resize(count);
+                active = heap.data();
+            }
+            size_t active_count = 0;
+            stats::count(stats::bvh_node_visits, count);
 
-                left = make_shared<bvh_node>(objects, start, mid);
-                right = make_shared<bvh_node>(objects, mid + 1, end);
-            };
-        }
+            for (size_t n = 0; n < count; n++) {
+                auto k = indices[n];
+                if (bbox.hit(rays[k], interval(t_min, hits[k] ? recs[k].t : infinity))) {
+                    active[active_count++] = k;
+                }
+            }
 
-        // Computes whether the ray hits this node, by recursively checking its left and right
-        // children
-        bool hit(const ray& r, const interval& ray_t, hit_record& rec) const override {
-            // If the box that represents this object is not hit, there is no need to check the
-            // children
-            if (!bbox.hit(r, ray_t))
-                return false;
+            if (active_count == 0) return;
 
-            // Check if we hit the left tree
-            bool hit_left = left->hit(r, ray_t, rec);
-            // If we already hit the left tree, we have to update the interval we check for
-            bool hit_right = right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
+            // Deep in the tree only a handful of rays reach each node, and walking them node by
+            // node costs more than it saves. Those rays finish the subtree one at a time.
+            if (active_count < min_batch_size) {
+                for (size_t n = 0; n < active_count; n++) {
+                    auto k = active[n];
+                    interval ray_t(t_min, hits[k] ? recs[k].t : infinity);
+                    if (left->hit(rays[k], ray_t, recs[k])) {
+                        hits[k] = true;
+                        ray_t.max = recs[k].t;
+                    }
+                    if (right != left && right->hit(rays[k], ray_t, recs[k])) {
+                        hits[k] = true;
+                    }
+                }
+                return;
+            }
 
-            return hit_left || hit_right;
+            left->hit_batch(rays, active, active_count, t_min, recs, hits);
+            // A single object is stored in both children, no need to test it twice
+            if (right != left) {
+                right->hit_batch(rays, active, active_count, t_min, recs, hits);
+            }
+        }
+
+        // Packet traversal. All the lanes of the packet test this node's box at once, and only
+        // the lanes which hit it carry on to the children.
+        void hit_packet(ray_packet& packet, uint32_t active, hit_record* recs,
+                uint32_t& hit_mask) const override {
+            stats::count(stats::bvh_node_visits, __builtin_popcount(active));
+            stats::count(stats::box_tests, __builtin_popcount(active));
+            active = packet_kernels().hit_aabb(packet, active, bbox);
+            stats::count(stats::box_hits, __builtin_popcount(active));
+            if (!active) return;
+
+            left->hit_packet(packet, active, recs, hit_mask);
+            // A single object is stored in both children, no need to test it twice
+            if (right != left) {
+                right->hit_packet(packet, active, recs, hit_mask);
+            }
         }
 
         aabb bounding_box() const override { return bbox; }
 
     private:
+        // Below this many rays, `hit_batch` finishes the subtree ray by ray
+        static const size_t min_batch_size = 64;
+
         // Left tree of this node
         shared_ptr<hittable> left;
         // Right tree of this node
         shared_ptr<hittable> right;
+        // The children again, when they are nodes themselves, so the descent can go on with the
+        // traversal ray without a virtual call. Null for a primitive or a leaf list.
+        const bvh_node* left_node = nullptr;
+        const bvh_node* right_node = nullptr;
+        // Whether the right child has the bigger box, which occlusion queries visit first
+        bool right_bigger = false;
         // Bounding box for this node
         aabb bbox;
 
-        // Compares the 2 objects `a` and `b` based on the minimum value over the `axis_index`
-        static bool box_compare(
-            const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis_index
-        ) {
-            auto a_axis_interval = a->bounding_box().axis_interval(axis_index);
-            auto b_axis_interval = b->bounding_box().axis_interval(axis_index);
-            return a_axis_interval.min < b_axis_interval.min;
+        bool hit_deferred(const ray& r, const traversal_ray& tr, const interval& ray_t,
+                hit_record& rec) const {
+            stats::count(stats::bvh_node_visits);
+            // If the box that represents this object is not hit, there is no need to check the
+            // children
+            if (!bbox.hit(tr, ray_t))
+                return false;
+
+            // Check if we hit the left tree
+            bool hit_left = hit_child(left, left_node, r, tr, ray_t, rec);
+            // A single object is stored in both children, no need to test it twice
+            if (right == left) return hit_left;
+            // If we already hit the left tree, we have to update the interval we check for
+            interval right_t(ray_t.min, hit_left ? rec.t : ray_t.max);
+            bool hit_right = hit_child(right, right_node, r, tr, right_t, rec);
+
+            return hit_left || hit_right;
         }
 
-        static bool box_x_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-            return box_compare(a, b, 0);
+        static bool hit_child(const shared_ptr<hittable>& child, const bvh_node* node,
+                const ray& r, const traversal_ray& tr, const interval& ray_t, hit_record& rec) {
+            if (node) return node->hit_deferred(r, tr, ray_t, rec);
+            return child->hit_deferred(r, ray_t, rec);
         }
 
-        static bool box_y_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-            return box_compare(a, b, 1);
+        bool occluded(const ray& r, const traversal_ray& tr, const interval& ray_t) const {
+            stats::count(stats::bvh_node_visits);
+            if (!bbox.hit(tr, ray_t))
+                return false;
+
+            if (right == left) return occluded_child(left, left_node, r, tr, ray_t);
+            if (right_bigger) {
+                return occluded_child(right, right_node, r, tr, ray_t)
+                    || occluded_child(left, left_node, r, tr, ray_t);
+            }
+            return occluded_child(left, left_node, r, tr, ray_t)
+                || occluded_child(right, right_node, r, tr, ray_t);
+        }
+
+        static bool occluded_child(const shared_ptr<hittable>& child, const bvh_node* node,
+                const ray& r, const traversal_ray& tr, const interval& ray_t) {
+            if (node) return node->occluded(r, tr, ray_t);
+            return child->occluded(r, ray_t);
+        }
+
+        // Builds the subtree of objects [start, end) of `build`, with up to `threads` threads
+        bvh_node(std::vector<bvh_build_object>& build, size_t start, size_t end,
+                const bvh_build_options& options, unsigned int threads) {
+            build_node(build, start, end, options, threads);
         }
 
-        static bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-            return box_compare(a, b, 2);
+        void build_node(std::vector<bvh_build_object>& build, size_t start, size_t end,
+                const bvh_build_options& options, unsigned int threads) {
+            // Build the bounding box from the span of the source objects
+            bbox = bvh_bounds(build, start, end, threads);
+
+            auto object_span = end - start;
+
+            // If we have a single object, we put it in both trees to avoid treating null pointer
+            // conditions
+            if (object_span == 1) {
+                left = right = build[start].object;
+                return;
+            }
+            if (object_span == 2) {
+                // If we have 2 objects, we put one in the left tree and one in the right tree
+                left = build[start].object;
+                right = build[start + 1].object;
+                right_bigger =
+                    build[start + 1].box.surface_area() > build[start].box.surface_area();
+                return;
+            }
+
+            int axis;
+            size_t mid = bvh_partition(build, start, end, bbox, options, axis, threads);
+
+            // The SAH found that testing all the objects beats splitting them
+            if (mid == start) {
+                hittable_list leaf;
+                for (size_t n = start; n < end; n++) leaf.add(build[n].object);
+                left = right = make_shared<hittable_list>(leaf);
+                return;
+            }
+
+            // The two halves are independent, a big one is built by another thread while this one
+            // builds the other. `make_shared` cannot reach the private constructor.
+            if (threads > 1 && object_span >= bvh_parallel_span) {
+                unsigned int left_threads = threads / 2;
+                std::thread worker([&]() {
+                    left = shared_ptr<bvh_node>(
+                            new bvh_node(build, start, mid, options, left_threads));
+                });
+                right = shared_ptr<bvh_node>(
+                        new bvh_node(build, mid, end, options, threads - left_threads));
+                worker.join();
+            } else {
+                left = shared_ptr<bvh_node>(new bvh_node(build, start, mid, options, 1));
+                right = shared_ptr<bvh_node>(new bvh_node(build, mid, end, options, 1));
+            }
+            left_node = static_cast<const bvh_node*>(left.get());
+            right_node = static_cast<const bvh_node*>(right.get());
+            right_bigger =
+                right->bounding_box().surface_area() > left->bounding_box().surface_area();
         }
 };
 
@@ -5,6 +5,23 @@
 #include "hittable.h"
 #include "hittable_list.h"
 #include "material.h"
+#include "scheduler.h"
+#include "framebuffer.h"
+#include "image_writer.h"
+#include "sampler.h"
+#include "accumulation_buffer.h"
+#include "distributed.h"
+#include "heatmap.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 /*
  * The camera class is responsible for 2 impoartan jobs
@@ -19,9 +36,12 @@ class camera {
         int image_width = 100;
         // Count of random samples to be generated per pixel for anti-aliasing effect.
         int samples_per_pixel = 10;
-        // Limits the number of times a casted ray reflects on surfaces of the world, such that we
-        // do not blow the stack
+        // Limits the number of times a casted ray reflects on surfaces of the world
         unsigned int max_depth = 10;
+        // Russian roulette randomly stops paths which carry little light, starting with bounce
+        // number `russian_roulette_depth`. It does not bias the image, it only skips work.
+        bool russian_roulette = true;
+        unsigned int russian_roulette_depth = 3;
 
         // Vertical view angle (field of view). This is the visual angle from edge to edge of the
         // rendered image. Since our image is not square, the fov is different horizontally and
@@ -49,50 +69,423 @@ class camera {
         // Distance from the camera lookfrom point to plane of perfect focus
         double focus_dist = 10;
 
+        // Number of threads used to render the image. The image is split into tiles of
+        // `tile_size` x `tile_size` pixels which are distributed over the threads. A value of 0
+        // uses every hardware thread of the machine.
+        unsigned int thread_count = 0;
+        int tile_size = 16;
+
+        // Seed for all the random numbers drawn while rendering. Each sample of each pixel gets
+        // its own random stream derived from (seed, frame, pixel, sample), so the same seed
+        // always produces the same image, no matter how many threads render it. `frame` lets an
+        // animation use a different noise pattern for each frame.
+        uint64_t seed = 0;
+        uint64_t frame = 0;
+
+        // Adaptive sampling. Instead of giving every pixel `samples_per_pixel` samples, each pixel
+        // first gets `min_samples_per_pixel` samples, after which we keep sampling only the pixels
+        // whose estimate is still noisy, up to `max_samples_per_pixel`. A pixel counts as
+        // converged once the standard error of its mean brightness (in the gamma corrected space
+        // we output) drops below `noise_threshold`. `samples_per_pixel` then acts as the average
+        // budget of a tile: the samples converged pixels do not need go to the noisy ones. The
+        // first samples come out of that budget too, so `min_samples_per_pixel` is cut down to
+        // `samples_per_pixel`, and should be well below it to leave samples to refine with.
+        bool adaptive_sampling = false;
+        int min_samples_per_pixel = 16;
+        int max_samples_per_pixel = 1024;
+        double noise_threshold = 0.005;
+
+        // Where the samples of a pixel go inside the pixel, on the lens and in time. The samplers
+        // other than `independent` spread the samples evenly over each of these, which gives a
+        // less noisy image for the same number of samples (see `sampler.h`). Bounces off
+        // surfaces always use independent random numbers.
+        sampler_type sample_pattern = sampler_type::sobol;
+
+        // Wavefront mode. Instead of tracing each sample's path from start to end, all the paths
+        // of a tile (up to `wavefront_batch_size` at a time) advance together, one stage at a
+        // time: intersect the whole batch, group the hits by material type, scatter each group,
+        // then drop the finished paths. Each stage runs the same code over many paths, which is
+        // much kinder to the instruction cache and branch predictors than alternating between
+        // intersection and several different materials for every ray. Having all the camera rays
+        // of the batch at hand also lets the first intersection trace them in packets (see
+        // `packet_tracing`). The image is identical to the one traced path by path. Adaptive
+        // sampling takes precedence over this mode.
+        bool wavefront = false;
+        int wavefront_batch_size = 1024;
+
+        // Packet tracing. The camera rays of small blocks of neighbouring pixels (2x2, 4x2 or 4x4,
+        // depending on how many rays the CPU's SIMD registers fit, see `packet.h`) are traced
+        // through the scene together, testing all of them against each box and shape at once.
+        // Camera rays are very coherent, so the rays of a block mostly visit the same BVH nodes.
+        // Only the first hit is traced in packets, the bounces after it are traced ray by ray.
+        // The image is identical to the one traced ray by ray. Adaptive sampling and wavefront
+        // mode take precedence over this mode.
+        bool packet_tracing = false;
+
+        // Format of the rendered image, and where it goes. The image is written to the standard
+        // output when `output_path` is empty.
+        image_format output_format = image_format::ppm;
+        std::string output_path;
+
+        // Checkpointing, for long renders which may get interrupted. When `checkpoint_path` is
+        // set, the render proceeds in passes of `samples_per_pass` samples per pixel, and every
+        // `checkpoint_interval` seconds (as well as at the end) the samples accumulated so far
+        // are saved to that file. With `resume`, a render whose checkpoint file already exists
+        // continues from there instead of starting over, up to `samples_per_pixel`. Raising
+        // `samples_per_pixel` and resuming a finished render adds more samples to it. The
+        // resumed image is identical to the one of an uninterrupted render.
+        //
+        // Adaptive sampling decides on its own how many samples each pixel gets, so its renders
+        // are not checkpointed.
+        std::string checkpoint_path;
+        double checkpoint_interval = 600;
+        bool resume = false;
+        int samples_per_pass = 16;
+
+        // Progressive rendering, for when a frame has to be delivered within a given time at
+        // whatever quality that allows. The image is rendered in passes over the whole frame: a
+        // first pass of a single sample per pixel, then passes of `samples_per_pass` samples. The
+        // render stops at `samples_per_pixel`, or earlier once it runs out of `time_budget`
+        // seconds or `ray_budget` rays (0 for no limit). Passes are shortened to fit the budget
+        // from what the previous ones cost, and a pass running over is cut short between tiles.
+        // The image is always complete and correctly averaged, some pixels merely having one pass
+        // of samples fewer than others. Checkpoints need every pixel at the same sample count, so
+        // passes are never cut short when checkpointing. When `progress_image_path` is set, the
+        // image so far is written there (in `output_format`) after every pass. Adaptive sampling
+        // has its own budget and takes precedence over this mode.
+        bool progressive = false;
+        double time_budget = 0;
+        uint64_t ray_budget = 0;
+        std::string progress_image_path;
+
+        // Distributed rendering, over several processes sharing the `spool_directory` (see
+        // `distributed.h`). The coordinator splits the frame into jobs of `job_region_size` x
+        // `job_region_size` pixels (0 for the whole image) and `job_samples` samples per pixel
+        // (0 for all of them), renders jobs alongside the workers, and writes out the merged
+        // image. Workers render jobs until the coordinator is done, and write out nothing. They
+        // may start before or after the coordinator, but a worker started once the render is
+        // complete waits for the next one (see `render_spool::ignore_finished_render`). Jobs
+        // claimed for more than `job_timeout` seconds are handed out again. The role and spool
+        // default to the `TRACEME_ROLE` and `TRACEME_SPOOL` environment variables, such that the
+        // same program can be started once as the coordinator and several times as a worker.
+        distributed_role role = environment_distributed_role();
+        std::string spool_directory = environment_spool_directory();
+        int job_region_size = 0;
+        int job_samples = 0;
+        double job_timeout = 3600;
+
+        // Cost heatmaps. When `heatmap_path` is set, the time spent on every pixel is recorded and
+        // written as a false colour image to `<heatmap_path>_time` (with the extension of
+        // `output_format`) next to the rendered image. Builds with `TRACEME_STATS` also record
+        // the BVH nodes visited by every pixel, written to `<heatmap_path>_nodes`. With the PFM
+        // format, the images hold the raw values (cycles, visits) instead of colours. Costs are
+        // only measured pixel by pixel, so wavefront and packet tracing are turned off meanwhile.
+        // Distributed renders, whose pixels are spread over several processes, write no heatmaps.
+        std::string heatmap_path;
+
+        // Whether to print the progress of the render on the standard error
+        bool log_progress = true;
+
+        // Figures about the last call to `render` or `render_frame`
+        struct render_statistics {
+            // Wall clock time spent rendering
+            double seconds = 0;
+            // Camera samples taken
+            uint64_t samples = 0;
+            // Rays traced through the scene, camera rays and bounces alike
+            uint64_t rays = 0;
+            // Traversal and shading counters, all zero unless built with `TRACEME_STATS`
+            stats::counters counters;
+            // Whether a progressive render stopped before `samples_per_pixel`, out of budget
+            bool out_of_budget = false;
+        };
+        render_statistics last_render;
+
         /* Camera Parameters */
         void render(const hittable& world) {
+            if (role != distributed_role::none) {
+                initialize();
+                render_distributed(world);
+                return;
+            }
+
+            framebuffer image;
+            if (!render_frame(world, image)) return;
+            if (!write_output(image)) return;
+            if (!heatmap_path.empty()) write_heatmaps();
+
+            // Additional whitespaces are to make sure we cover the writing above
+            if (log_progress) {
+                std::clog << "\rDone.                                             \n"
+                    << std::flush;
+            }
+            if (adaptive_sampling || last_render.out_of_budget) {
+                std::clog << "Average samples per pixel: "
+                    << double(last_render.samples) / (image_width * image_height) << '\n';
+            }
+            if (stats::enabled) {
+                stats::print_summary(std::clog, last_render.counters, last_render.rays);
+            }
+        }
+
+        // Renders the image of `world` into `image`, without writing it anywhere. Returns false if
+        // the render could not be done (e.g. the checkpoint to resume from is invalid).
+        bool render_frame(const hittable& world, framebuffer& image) {
             initialize();
             // Rendering
+            auto start = std::chrono::steady_clock::now();
+            last_render = render_statistics();
+            stats::reset();
+            pixel_costs = heatmap_path.empty() ? cost_buffer()
+                : cost_buffer(image_width, image_height);
 
-            // Write the header: Magic Width Height and on the next line we have the maximum value
-            // for each
-            // color: 255
-            // P3
-            // W H
-            // 255
-            std::cout << "P3\n" << image_width << " " << image_height << "\n255\n";
+            // Every sample is added to this shared accumulation buffer, whose averages are emitted
+            // once all the samples are in. Each pixel belongs to exactly one tile, so threads never
+            // write to the same element.
+            accumulation_buffer accumulated(image_width, image_height);
+            // Number of samples every pixel already has
+            int samples_done = 0;
 
-            for (int j = 0; j < image_height; j++) {
-                // Log progress
-                // \r just moves to the beginning of the line. And `flush` makes sure we print the
-                // `clong`
-                // to the stderr handle
-                std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
-                for (int i = 0; i < image_width; i++) {
-                    // Initialize the pixel color
-                    color pixel_color(0,0,0);
-                    // Cast the desired number of rays for each pixel
-                    for (int s = 0; s < samples_per_pixel; s++) {
-                        // Get a new random ray in the pixel's region square
-                        ray r = get_ray(i, j);
-                        // Add that color to our end result
-                        pixel_color += ray_color(r, max_depth, world);
+            bool checkpointing = !checkpoint_path.empty();
+            if (checkpointing && adaptive_sampling) {
+                std::clog << "Checkpoints are not supported with adaptive sampling.\n";
+                checkpointing = false;
+            }
+            if (checkpointing && resume && std::ifstream(checkpoint_path).good()) {
+                if (!resume_checkpoint(accumulated, samples_done)) return false;
+            }
+
+            auto tiles = make_tiles(image_width, image_height, tile_size);
+            auto last_checkpoint = std::chrono::steady_clock::now();
+
+            if (adaptive_sampling) {
+                if (min_samples_per_pixel > samples_per_pixel) {
+                    std::clog << "The minimum of " << min_samples_per_pixel << " samples per pixel"
+                        << " is over the budget of " << samples_per_pixel << ", no pixel will be"
+                        << " refined.\n";
+                }
+                render_pass(world, tiles, 0, samples_per_pixel, accumulated);
+            }
+
+            bool budgeted = progressive && !adaptive_sampling;
+            render_deadline = start + std::chrono::duration_cast<
+                std::chrono::steady_clock::duration>(std::chrono::duration<double>(time_budget));
+            // What one sample per pixel costs, measured over the passes so far
+            double pass_seconds = 0;
+            uint64_t pass_rays = 0;
+            int pass_samples = 0;
+
+            // Without checkpoints or progressive rendering, everything is rendered in a single
+            // pass
+            while (!adaptive_sampling && samples_done < samples_per_pixel) {
+                int pass_size = samples_per_pixel - samples_done;
+                if ((checkpointing || progressive) && samples_per_pass > 0
+                        && pass_size > samples_per_pass)
+                    pass_size = samples_per_pass;
+                // A complete image, however noisy, as early as possible
+                if (progressive && samples_done == 0) pass_size = 1;
+
+                if (budgeted && pass_samples > 0) {
+                    pass_size = fit_budget(pass_size, pass_seconds / pass_samples,
+                            double(pass_rays) / pass_samples, start);
+                    if (pass_size == 0) {
+                        last_render.out_of_budget = true;
+                        break;
                     }
-                    // Write the color, minding the fact that it has to be scaled.
-                    write_color(std::cout, pixel_samples_scale * pixel_color);
+                }
+
+                // Once every pixel has a sample, a pass running out of budget can stop between
+                // tiles. Checkpoints need all the pixels to have the same number of samples.
+                enforce_budget = budgeted && samples_done > 0 && !checkpointing;
+                auto pass_start = std::chrono::steady_clock::now();
+                uint64_t rays_before = last_render.rays;
+                int pass_end = samples_done + pass_size;
+                bool complete = render_pass(world, tiles, samples_done, pass_end, accumulated);
+                enforce_budget = false;
+                samples_done = pass_end;
+
+                pass_seconds += std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - pass_start).count();
+                pass_rays += last_render.rays - rays_before;
+                pass_samples += pass_size;
+
+                if (!progress_image_path.empty()) {
+                    write_progress_image(accumulated);
+                }
+                if (!complete) {
+                    last_render.out_of_budget = true;
+                    break;
+                }
+
+                auto now = std::chrono::steady_clock::now();
+                double elapsed = std::chrono::duration<double>(now - last_checkpoint).count();
+                if (checkpointing && (elapsed >= checkpoint_interval
+                            || samples_done == samples_per_pixel)) {
+                    save_checkpoint(checkpoint_path, checkpoint_state(samples_done), accumulated);
+                    last_checkpoint = now;
                 }
             }
-            // Additional whitespaces are to make sure we cover the writing above
-            std::clog << "\rDone.                            \n" << std::flush;
+
+            // A render stopped by its budget can be resumed later, with another budget
+            if (checkpointing && last_render.out_of_budget) {
+                save_checkpoint(checkpoint_path, checkpoint_state(samples_done), accumulated);
+            }
+
+            image = accumulated.resolve();
+            last_render.seconds = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start).count();
+            last_render.counters = stats::total();
+            return true;
         }
 
     private:
+        // Latest time a progressive render may run until, and whether the current pass has to stop
+        // there (or at the ray budget)
+        std::chrono::steady_clock::time_point render_deadline;
+        bool enforce_budget = false;
+
+        // Returns how many samples per pixel, up to `pass_size`, the next pass of a progressive
+        // render can take without running out of budget, given what a sample per pixel costs
+        int fit_budget(int pass_size, double seconds_per_sample, double rays_per_sample,
+                std::chrono::steady_clock::time_point start) const {
+            double fits = pass_size;
+            if (time_budget > 0) {
+                double left = time_budget - std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start).count();
+                if (seconds_per_sample > 0) fits = std::min(fits, left / seconds_per_sample);
+                if (left <= 0) fits = 0;
+            }
+            if (ray_budget > 0) {
+                double left = double(ray_budget) - double(last_render.rays);
+                if (rays_per_sample > 0) fits = std::min(fits, left / rays_per_sample);
+                if (left <= 0) fits = 0;
+            }
+            return int(fits);
+        }
+
+        // Returns whether a progressive render ran out of budget, `rays` being the rays traced in
+        // the current pass so far
+        bool over_budget(uint64_t rays) const {
+            return (time_budget > 0 && std::chrono::steady_clock::now() >= render_deadline)
+                || (ray_budget > 0 && last_render.rays + rays >= ray_budget);
+        }
+
+        // Writes the image rendered so far to `progress_image_path`. It is written under a
+        // temporary name and then renamed, such that readers never see half an image.
+        void write_progress_image(const accumulation_buffer& accumulated) const {
+            std::string temporary = progress_image_path + ".tmp";
+            if (!write_image(temporary, accumulated.resolve(), output_format)) return;
+            if (std::rename(temporary.c_str(), progress_image_path.c_str()) != 0) {
+                std::cerr << "ERROR: Could not move '" << temporary << "' to '"
+                    << progress_image_path << "'.\n";
+            }
+        }
+
+        // Hands the finished image to the encoder. Returns false, after saying why, if it could not
+        // be written.
+        bool write_output(const framebuffer& image) const {
+            if (!output_path.empty()) return write_image(output_path, image, output_format);
+            if (!write_image(std::cout, image, output_format)) {
+                std::cerr << "ERROR: Could not write the image to the standard output.\n";
+                return false;
+            }
+            return true;
+        }
+
+        // Takes part in a distributed render, as the coordinator or a worker
+        void render_distributed(const hittable& world) {
+            if (spool_directory.empty()) {
+                std::cerr << "ERROR: Distributed rendering needs a spool directory.\n";
+                return;
+            }
+            if (adaptive_sampling) {
+                std::cerr << "ERROR: Adaptive sampling is not supported in distributed renders.\n";
+                return;
+            }
+            if (!heatmap_path.empty()) {
+                std::clog << "Heatmaps are not supported in distributed renders, none is written.\n";
+            }
+
+            bool coordinator = role == distributed_role::coordinator;
+            render_spool spool(spool_directory);
+            std::vector<render_job> jobs;
+
+            if (coordinator) {
+                if (!spool.reset()) return;
+                jobs = make_jobs(checkpoint_state(0), samples_per_pixel, job_region_size,
+                        job_samples);
+                for (const auto& job : jobs) {
+                    if (!spool.post(job)) return;
+                }
+            } else {
+                spool.ignore_finished_render();
+            }
+
+            while (true) {
+                render_job job;
+                if (spool.claim(job)) {
+                    if (!same_render(job.render)) {
+                        std::cerr << "ERROR: Job '" << job.name
+                            << "' belongs to a different render (image size, seed, frame or"
+                            << " sampler).\n";
+                        // Leave the job to a process of the right render, rather than to the
+                        // coordinator's timeout
+                        spool.release(job);
+                        return;
+                    }
+
+                    auto tiles = make_tiles(job.region, tile_size);
+                    accumulation_buffer result(job.region.x0, job.region.y0,
+                            job.region.x1 - job.region.x0, job.region.y1 - job.region.y0);
+                    render_pass(world, tiles, job.s0, job.s1, result);
+                    if (!spool.complete(job, result)) return;
+                    continue;
+                }
+
+                if (coordinator) {
+                    if (spool.results().size() >= jobs.size()) break;
+                    spool.requeue_stale(job_timeout);
+                    // A job dropped as malformed would never have a result
+                    for (const auto& job : spool.lost(jobs)) {
+                        std::clog << "Posting lost job '" << job.name << "' again.\n";
+                        if (!spool.post(job)) return;
+                    }
+                } else if (spool.finished()) {
+                    std::clog << "\rDone.                                             \n";
+                    return;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+
+            // Merge the results of all the jobs
+            accumulation_buffer accumulated(image_width, image_height);
+            for (const auto& name : spool.results()) {
+                render_checkpoint state;
+                accumulation_buffer result;
+                if (!load_checkpoint(spool.result_path(name), state, result)) return;
+                if (!same_render(state)) {
+                    std::cerr << "ERROR: Result '" << name << "' belongs to a different render.\n";
+                    return;
+                }
+                accumulated.merge(result);
+            }
+            spool.finish();
+
+            if (!write_output(accumulated.resolve())) return;
+            std::clog << "\rDone.                                             \n" << std::flush;
+        }
+
+        // Returns whether `state` describes this render, such that samples from it can be
+        // combined with ours
+        bool same_render(const render_checkpoint& state) const {
+            return state.width == image_width && state.height == image_height
+                && state.seed == seed && state.frame == frame
+                && state.sample_pattern == int(sample_pattern)
+                && state.sampler_samples == sampler_samples;
+        }
+
         // Rendered image height
         int image_height;
-        // In the end result, we will still have a single value for coloring that region. We will
-        // get that color value by summing up the results we get from each random ray cast.
-        // As such, we need to scale down each value, based on the number of pixels that we compute
-        double pixel_samples_scale;
         // Camera center
         point3 center;
         // Location of pixel 0,0 (first pixel of the vieport
@@ -112,14 +505,23 @@ class camera {
         // Defocus disk vertical radius
         vec3 defocus_disk_v;
 
+        // Sampler for the camera's own dimensions, and the dimension of each of them. The sampler
+        // is made for `sampler_samples` samples per pixel.
+        shared_ptr<sampler> pixel_sampler;
+        int sampler_samples;
+        static const int pixel_dimension = 0;
+        static const int lens_dimension = 1;
+        static const int time_dimension = 2;
+
+        // Cost of every pixel of the current render, when recording heatmaps
+        cost_buffer pixel_costs;
+
         // Configures the camera for rendering
         void initialize() {
             // Calculate the image height and make sure that it's at least 1.
             image_height = int(image_width / aspect_ratio);
             image_height = (image_height < 1) ? 1 : image_height;
 
-            pixel_samples_scale = 1.0 / samples_per_pixel;
-
             // Focal length is the distance from the camera to the viewport. This is different from
             // the `z` coordinate of the object that we are viewing.
             //
@@ -192,75 +594,655 @@ class camera {
             auto defocus_radius = focus_dist * tan(degrees_to_radians(defocus_angle / 2));
             defocus_disk_u = u * defocus_radius;
             defocus_disk_v = v * defocus_radius;
+
+            sampler_samples = samples_per_pixel;
+            pixel_sampler = make_sampler(sample_pattern, sampler_samples,
+                    hash_combine(seed, frame));
         }
 
-        // Returns the color for a given scene ray.
-        // This function will linearly blend white and blue depending on the height of the
-        // 𝑦 coordinate
-        // after scaling the ray direction to unit length (so −1.0<𝑦<1.0).
-        // Because we're looking at the 𝑦 height after normalizing the vector, you'll notice a
-        // horizontal
-        // gradient to the color in addition to the vertical gradient.
+        // Renders samples [s0, s1) of every pixel of `tiles`, spread over all the threads, into
+        // `accumulated`. In adaptive mode, each tile decides how many samples its pixels get
+        // instead. The samples and rays go into `last_render`. Returns false if the pass ran out of
+        // budget (see `enforce_budget`) before rendering all the tiles.
+        bool render_pass(const hittable& world, const std::vector<tile>& tiles, int s0, int s1,
+                accumulation_buffer& accumulated) {
+            tile_scheduler scheduler(tiles, resolve_thread_count(thread_count));
 
-        // When 𝑎=1.0, we want blue. When 𝑎=0.0, we want white. In between, we want a blend.
-        // This forms a “linear blend”, or “linear interpolation”.
-        // This is commonly referred to as a lerp between two values.
-        color ray_color(const ray& r, unsigned int depth, const hittable& world) const {
-            // Check if we still want to reflect
-            if (depth <= 0) {
-                return color(0, 0, 0);
+            // Log progress
+            std::atomic<size_t> tiles_remaining(tiles.size());
+            std::atomic<uint64_t> samples_taken(0);
+            std::atomic<uint64_t> rays_traced(0);
+            std::atomic<bool> stopped(false);
+            std::mutex log_lock;
+
+            // Costs are measured pixel by pixel, which the batched modes do not render. Distributed
+            // renders never size `pixel_costs`, as they write no heatmaps.
+            bool measure_costs = !heatmap_path.empty() && role == distributed_role::none;
+            cost_buffer* costs = measure_costs ? &pixel_costs : nullptr;
+
+            scheduler.run([&](const tile& t) {
+                if (enforce_budget && (stopped || over_budget(rays_traced))) {
+                    stopped = true;
+                    return;
+                }
+                uint64_t rays_before = thread_ray_count();
+                samples_taken += adaptive_sampling
+                    ? render_tile_adaptive(world, t, accumulated, costs)
+                    : wavefront && !costs ? render_tile_wavefront(world, t, s0, s1, accumulated)
+                    : packet_tracing && !costs
+                        ? render_tile_packets(world, t, s0, s1, accumulated)
+                    : render_tile(world, t, s0, s1, accumulated, costs);
+                rays_traced += thread_ray_count() - rays_before;
+
+                // \r just moves to the beginning of the line. And `flush` makes sure we print the
+                // `clog` to the stderr handle
+                auto remaining = --tiles_remaining;
+                if (!log_progress) return;
+                std::lock_guard<std::mutex> guard(log_lock);
+                std::clog << "\rSamples " << s1 << '/' << samples_per_pixel
+                    << ", tiles remaining: " << remaining << ' ' << std::flush;
+            });
+
+            last_render.samples += samples_taken;
+            last_render.rays += rays_traced;
+            return !stopped;
+        }
+
+        // Measures the cost of rendering some samples of one pixel, from its creation until
+        // `finish`, when it adds it to the cost buffer. Does nothing without a buffer.
+        class pixel_cost {
+            public:
+                pixel_cost(cost_buffer* costs) : costs(costs) {
+                    if (!costs) return;
+                    visits = stats::thread_value(stats::bvh_node_visits);
+                    cycles = read_cycle_counter();
+                }
+
+                void finish(int i, int j) {
+                    if (!costs) return;
+                    auto now = read_cycle_counter();
+                    costs->add(i, j, now - cycles,
+                            stats::thread_value(stats::bvh_node_visits) - visits);
+                }
+
+            private:
+                cost_buffer* costs;
+                uint64_t cycles = 0;
+                uint64_t visits = 0;
+        };
+
+        // Writes the cost heatmaps of the last render next to the image
+        void write_heatmaps() const {
+            auto extension = image_extension(output_format);
+            auto write = [&](const char* name, const std::vector<uint64_t>& values) {
+                auto image = output_format == image_format::pfm
+                    ? raw_cost_image(values, image_width, image_height)
+                    : heatmap_image(values, image_width, image_height);
+                write_image(heatmap_path + name + extension, image, output_format);
+            };
+
+            write("_time", pixel_costs.time());
+            if (stats::enabled) {
+                write("_nodes", pixel_costs.visits());
+            } else {
+                std::clog << "Node visit heatmaps need a build with TRACEME_STATS.\n";
             }
+        }
 
+        // Number of rays the calling thread traced through the scene so far
+        static uint64_t& thread_ray_count() {
+            thread_local uint64_t count = 0;
+            return count;
+        }
+
+        // Describes the render, with `samples_done` samples in every pixel, for its checkpoint
+        render_checkpoint checkpoint_state(int samples_done) const {
+            render_checkpoint state;
+            state.width = image_width;
+            state.height = image_height;
+            state.seed = seed;
+            state.frame = frame;
+            state.sample_pattern = int(sample_pattern);
+            state.sampler_samples = sampler_samples;
+            state.samples_completed = samples_done;
+            return state;
+        }
+
+        // Loads the checkpoint of this render into `accumulated`, and sets `samples_done` to the
+        // number of samples it holds. Returns false if the checkpoint cannot be used.
+        bool resume_checkpoint(accumulation_buffer& accumulated, int& samples_done) {
+            render_checkpoint state;
+            if (!load_checkpoint(checkpoint_path, state, accumulated)) return false;
+
+            // The samples to come have to continue the exact same random sequences
+            if (state.width != image_width || state.height != image_height || state.seed != seed
+                    || state.frame != frame || state.sample_pattern != int(sample_pattern)
+                    || accumulated.x0() != 0 || accumulated.y0() != 0
+                    || accumulated.width() != image_width
+                    || accumulated.height() != image_height) {
+                std::cerr << "ERROR: Checkpoint '" << checkpoint_path
+                    << "' belongs to a different render (image size, seed, frame or sampler).\n";
+                return false;
+            }
+
+            // The sampler has to be the one the checkpoint's samples came from, even if we now
+            // aim for a different number of samples
+            if (state.sampler_samples != sampler_samples) {
+                sampler_samples = state.sampler_samples;
+                pixel_sampler = make_sampler(sample_pattern, sampler_samples,
+                        hash_combine(seed, frame));
+            }
+
+            samples_done = state.samples_completed;
+            std::clog << "Resuming from " << samples_done << " samples per pixel.\n";
+            return true;
+        }
+
+        // Renders samples [s0, s1) of all the pixels of tile `t`, adding what each pixel cost to
+        // `costs` if given. Returns the number of samples taken.
+        uint64_t render_tile(const hittable& world, const tile& t, int s0, int s1,
+                accumulation_buffer& accumulated, cost_buffer* costs) const {
+            for (int j = t.y0; j < t.y1; j++) {
+                for (int i = t.x0; i < t.x1; i++) {
+                    pixel_cost cost(costs);
+                    // Cast the desired number of rays for each pixel
+                    for (int s = s0; s < s1; s++) {
+                        // Add that color to our end result
+                        accumulated.add(i, j, sample_pixel(world, i, j, s));
+                    }
+                    cost.finish(i, j);
+                }
+            }
+            return uint64_t(s1 - s0) * (t.x1 - t.x0) * (t.y1 - t.y0);
+        }
+
+        // Renders samples [s0, s1) of tile `t` with packet tracing. Returns the number of samples
+        // taken.
+        uint64_t render_tile_packets(const hittable& world, const tile& t, int s0, int s1,
+                accumulation_buffer& accumulated) const {
+            const auto& isa = packet_kernels();
+            // Shape of the pixel block making up a packet, as square as the width allows
+            int block_width = isa.width >= 8 ? 4 : 2;
+            int block_height = isa.width / block_width;
+
+            ray_packet packet;
+            packet.size = isa.width;
+            packet.t_min = 0.001;
+
+            hit_record recs[max_packet_size];
+            // Random stream of each lane, kept aside while the packet is being traced
+            rng streams[max_packet_size];
+
+            for (int by = t.y0; by < t.y1; by += block_height) {
+                for (int bx = t.x0; bx < t.x1; bx += block_width) {
+                    // Blocks on the edges of the tile may not fill all the lanes
+                    uint32_t lanes = 0;
+                    for (int k = 0; k < isa.width; k++) {
+                        int i = bx + k % block_width;
+                        int j = by + k / block_width;
+                        if (i < t.x1 && j < t.y1) lanes |= 1u << k;
+                        // Unused lanes still go through the kernels, give them a harmless ray
+                        packet.set(k, ray(point3(0, 0, 0), vec3(1, 1, 1), 0));
+                    }
+
+                    for (int s = s0; s < s1; s++) {
+                        for (int k = 0; k < isa.width; k++) {
+                            packet.t_max[k] = infinity;
+                            if (!(lanes & (1u << k))) continue;
+
+                            int i = bx + k % block_width;
+                            int j = by + k / block_width;
+                            seed_sample_stream(seed, frame, uint64_t(j) * image_width + i, s);
+                            packet.set(k, get_ray(i, j, s));
+                            streams[k] = thread_rng();
+                            thread_ray_count()++;
+                        }
+
+                        uint32_t hit_mask = 0;
+                        world.hit_packet(packet, lanes, recs, hit_mask);
+
+                        // Follow each path on its own from the first hit onwards
+                        for (int k = 0; k < isa.width; k++) {
+                            if (!(lanes & (1u << k))) continue;
+                            thread_rng() = streams[k];
+                            accumulated.add(bx + k % block_width, by + k / block_width,
+                                    continue_path(packet.get(k), (hit_mask & (1u << k)) != 0,
+                                        recs[k], max_depth, world));
+                        }
+                    }
+                }
+            }
+
+            return uint64_t(s1 - s0) * (t.x1 - t.x0) * (t.y1 - t.y0);
+        }
+
+        // Running estimate of a single pixel, used by adaptive sampling
+        struct pixel_estimate {
+            // Number of samples taken so far
+            int count = 0;
+            // Mean and sum of squared differences from the mean of the samples' brightness,
+            // updated with Welford's algorithm, which stays accurate for many samples.
+            double mean = 0;
+            double m2 = 0;
+
+            void add(const color& sample) {
+                count++;
+
+                // Brightness as the eye perceives it in the image we write out. Samples are
+                // clamped the same way the output is, so pixels that saturate converge too.
+                auto luminance = 0.2126 * sample.x() + 0.7152 * sample.y() + 0.0722 * sample.z();
+                auto value = linear_to_gamma(interval(0, 1).clamp(luminance));
+
+                auto delta = value - mean;
+                mean += delta / count;
+                m2 += delta * (value - mean);
+            }
+
+            // Standard error of the mean, or how far off we expect the pixel to still be
+            double error() const {
+                if (count < 2) return infinity;
+                return sqrt(m2 / (count - 1) / count);
+            }
+        };
+
+        // Renders tile `t` with adaptive sampling. The tile has a budget of `samples_per_pixel`
+        // samples per pixel on average. Every pixel first gets `min_samples_per_pixel` samples.
+        // Then we go over the pixels which have not converged yet, in small batches, until they
+        // all converge, reach `max_samples_per_pixel`, or the tile runs out of budget. Returns the
+        // number of samples taken.
+        uint64_t render_tile_adaptive(const hittable& world, const tile& t,
+                accumulation_buffer& accumulated, cost_buffer* costs) const {
+            // Samples added to a noisy pixel on each refinement round
+            const int batch_size = 8;
+
+            int tile_width = t.x1 - t.x0;
+            int pixel_count = tile_width * (t.y1 - t.y0);
+            std::vector<pixel_estimate> estimates(pixel_count);
+
+            int64_t budget = int64_t(samples_per_pixel) * pixel_count;
+            int64_t taken = 0;
+
+            auto add_samples = [&](int index, int count) {
+                auto& estimate = estimates[index];
+                int i = t.x0 + index % tile_width;
+                int j = t.y0 + index / tile_width;
+                pixel_cost cost(costs);
+                // The sample index keeps increasing, so each new sample uses a fresh random stream
+                for (int n = 0; n < count; n++) {
+                    auto sample = sample_pixel(world, i, j, estimate.count);
+                    estimate.add(sample);
+                    accumulated.add(i, j, sample);
+                }
+                cost.finish(i, j);
+                taken += count;
+            };
+
+            // Every pixel gets the minimum amount of samples, to have a usable noise estimate, as
+            // long as the tile's budget allows
+            int initial_samples = std::min({min_samples_per_pixel, max_samples_per_pixel,
+                    samples_per_pixel});
+            initial_samples = initial_samples < 1 ? 1 : initial_samples;
+            for (int index = 0; index < pixel_count; index++) {
+                add_samples(index, initial_samples);
+            }
+
+            // Keep refining the noisy pixels
+            bool refined = true;
+            while (refined && taken < budget) {
+                refined = false;
+                for (int index = 0; index < pixel_count && taken < budget; index++) {
+                    const auto& estimate = estimates[index];
+                    if (estimate.count >= max_samples_per_pixel) continue;
+                    if (estimate.error() <= noise_threshold) continue;
+
+                    int count = batch_size;
+                    if (count > max_samples_per_pixel - estimate.count)
+                        count = max_samples_per_pixel - estimate.count;
+                    if (count > budget - taken)
+                        count = int(budget - taken);
+
+                    add_samples(index, count);
+                    refined = true;
+                }
+            }
+
+            return uint64_t(taken);
+        }
+
+        // State of all the paths in flight in wavefront mode, stored as one array per field, such
+        // that every stage only streams through the fields it needs. Each thread keeps one and
+        // reuses it for all its batches: allocating and faulting in fresh arrays for every batch
+        // cost more than the stages saved, while reused arrays of the default batch size are
+        // still in cache from the previous batch.
+        struct wavefront_paths {
+            // Ray each path continues with
+            std::vector<ray> rays;
+            // Fraction of the light along the ray which reaches the camera
+            std::vector<color> throughput;
+            // Random stream of each path. A path gets the numbers it would get when traced on
+            // its own, which keeps wavefront renders identical to the regular ones.
+            std::vector<rng> random;
+            // Color each path brings back, pixel by pixel, in sample order
+            std::vector<color> contribution;
+            // Closest hit of each path's current ray, and the type of its material
+            std::vector<hit_record> recs;
+            std::vector<material_kind> kinds;
+            // `bool` is avoided on purpose, `std::vector<bool>` packs bits and has no `data()`
+            std::unique_ptr<bool[]> hits;
+            std::unique_ptr<bool[]> alive;
+            size_t flag_capacity = 0;
+            // Paths sorted by material type, and the paths still in flight
+            std::vector<uint32_t> order;
+            std::vector<uint32_t> active;
+
+            // Drops the paths of the previous batch and makes room for `count` new ones
+            void reset(size_t count) {
+                rays.clear();
+                throughput.clear();
+                random.clear();
+                rays.reserve(count);
+                throughput.reserve(count);
+                random.reserve(count);
+                contribution.assign(count, color(0, 0, 0));
+                recs.resize(count);
+                kinds.resize(count);
+                order.resize(count);
+                active.resize(count);
+                if (count > flag_capacity) {
+                    hits.reset(new bool[count]);
+                    alive.reset(new bool[count]);
+                    flag_capacity = count;
+                }
+            }
+
+            void push_back(const ray& r, const rng& stream) {
+                rays.push_back(r);
+                throughput.push_back(color(1, 1, 1));
+                random.push_back(stream);
+            }
+        };
+
+        // Renders samples [s0, s1) of tile `t` in wavefront mode. Returns the number of samples
+        // taken.
+        uint64_t render_tile_wavefront(const hittable& world, const tile& t, int s0, int s1,
+                accumulation_buffer& accumulated) const {
+            int tile_width = t.x1 - t.x0;
+            int pixel_count = tile_width * (t.y1 - t.y0);
+
+            // Split the samples of the tile into batches of roughly `wavefront_batch_size` paths
+            int samples_per_batch = wavefront_batch_size / pixel_count;
+            samples_per_batch = samples_per_batch < 1 ? 1 : samples_per_batch;
+
+            thread_local wavefront_paths paths;
+            for (int batch_start = s0; batch_start < s1; batch_start += samples_per_batch) {
+                int batch_end = batch_start + samples_per_batch < s1
+                    ? batch_start + samples_per_batch : s1;
+                int batch_samples = batch_end - batch_start;
+
+                trace_wavefront(world, t, batch_start, batch_end, paths);
+
+                for (int index = 0; index < pixel_count; index++) {
+                    for (int s = 0; s < batch_samples; s++) {
+                        accumulated.add(t.x0 + index % tile_width, t.y0 + index / tile_width,
+                                paths.contribution[size_t(index) * batch_samples + s]);
+                    }
+                }
+            }
+
+            return uint64_t(s1 - s0) * pixel_count;
+        }
+
+        // Traces samples [s0, s1) of all the pixels of tile `t` as a single wavefront, in `paths`,
+        // which ends up with the color of each path in `paths.contribution`
+        void trace_wavefront(const hittable& world, const tile& t, int s0, int s1,
+                wavefront_paths& paths) const {
+            int tile_width = t.x1 - t.x0;
+            int pixel_count = tile_width * (t.y1 - t.y0);
+            int batch_samples = s1 - s0;
+
+            // The thread's own stream is restored once we are done borrowing it for the paths
+            rng& thread_random = thread_rng();
+            rng saved_random = thread_random;
+
+            // Stage 1: generate the camera rays
+            size_t live = size_t(pixel_count) * batch_samples;
+            paths.reset(live);
+            for (int index = 0; index < pixel_count; index++) {
+                int i = t.x0 + index % tile_width;
+                int j = t.y0 + index / tile_width;
+                for (int s = s0; s < s1; s++) {
+                    seed_sample_stream(seed, frame, uint64_t(j) * image_width + i, s);
+                    paths.push_back(get_ray(i, j, s), thread_random);
+                }
+            }
+
+            auto& recs = paths.recs;
+            auto& kinds = paths.kinds;
+            auto& order = paths.order;
+            bool* hits = paths.hits.get();
+            bool* alive = paths.alive.get();
+
+            // The paths still in flight. Path data stays where it is, only this list of indices
+            // shrinks as paths finish. It is kept in increasing order, such that neighbouring
+            // paths (which started in neighbouring pixels) stay together in the batch.
+            auto& active = paths.active;
+            for (size_t k = 0; k < live; k++) {
+                active[k] = uint32_t(k);
+            }
+
+            for (unsigned int bounce = 0; bounce < max_depth && live > 0; bounce++) {
+                // Stage 2: intersect the whole batch with the world. The camera rays of a pixel's
+                // samples and of neighbouring pixels start together and head the same way, so the
+                // first bounce traces them in packets. The bounced rays scatter in all directions
+                // and go through `hit_batch` instead.
+                for (size_t n = 0; n < live; n++) {
+                    hits[active[n]] = false;
+                }
+                thread_ray_count() += live;
+                if (bounce == 0) {
+                    hit_camera_rays(world, paths.rays.data(), live, recs.data(), hits);
+                } else {
+                    world.hit_batch(paths.rays.data(), active.data(), live, 0.001, recs.data(),
+                            hits);
+                }
+
+                // Stage 3: bucket the hits by material type (a counting sort, which keeps the
+                // paths in order inside each bucket). Rays which missed reach the sky.
+                int bucket_start[material_kind_count + 1] = {0};
+                for (size_t n = 0; n < live; n++) {
+                    auto k = active[n];
+                    alive[k] = false;
+                    if (hits[k]) {
+                        kinds[k] = recs[k].mat->kind();
+                        bucket_start[int(kinds[k]) + 1]++;
+                    } else {
+                        paths.contribution[k] = paths.throughput[k] * sky_color(paths.rays[k]);
+                    }
+                }
+                for (int kind = 0; kind < material_kind_count; kind++) {
+                    bucket_start[kind + 1] += bucket_start[kind];
+                }
+                int hit_count = bucket_start[material_kind_count];
+                for (size_t n = 0; n < live; n++) {
+                    auto k = active[n];
+                    if (hits[k]) {
+                        order[bucket_start[int(kinds[k])]++] = k;
+                    }
+                }
+
+                // Stage 4: scatter every bucket, one material type after the other
+                for (int n = 0; n < hit_count; n++) {
+                    auto k = order[n];
+                    thread_random = paths.random[k];
+                    if (scatter_path(paths.rays[k], paths.throughput[k], recs[k], bounce)) {
+                        paths.random[k] = thread_random;
+                        alive[k] = true;
+                    }
+                }
+
+                // Stage 5: compact the list of paths which keep going
+                size_t survivors = 0;
+                for (size_t n = 0; n < live; n++) {
+                    if (alive[active[n]]) {
+                        active[survivors++] = active[n];
+                    }
+                }
+                live = survivors;
+            }
+
+            thread_random = saved_random;
+        }
+
+        // Intersects the camera rays `rays[0]` ... `rays[count - 1]` of a wavefront with the world,
+        // a packet of consecutive rays at a time (see `packet_tracing`). Like `hit_batch`, stores
+        // the hit of ray k in `recs[k]` and sets `hits[k]` when there is one.
+        void hit_camera_rays(const hittable& world, const ray* rays, size_t count,
+                hit_record* recs, bool* hits) const {
+            const auto& isa = packet_kernels();
+            ray_packet packet;
+            packet.size = isa.width;
+            packet.t_min = 0.001;
+
+            for (size_t start = 0; start < count; start += isa.width) {
+                // The last packet may not fill all the lanes
+                uint32_t lanes = 0;
+                for (int k = 0; k < isa.width; k++) {
+                    packet.t_max[k] = infinity;
+                    if (start + k < count) {
+                        packet.set(k, rays[start + k]);
+                        lanes |= 1u << k;
+                    } else {
+                        // Unused lanes still go through the kernels, give them a harmless ray
+                        packet.set(k, ray(point3(0, 0, 0), vec3(1, 1, 1), 0));
+                    }
+                }
+
+                uint32_t hit_mask = 0;
+                world.hit_packet(packet, lanes, recs + start, hit_mask);
+                for (int k = 0; k < isa.width && start + k < count; k++) {
+                    hits[start + k] = (hit_mask & (1u << k)) != 0;
+                }
+            }
+        }
+
+        // Scatters a path, currently following `current` with `throughput`, off the surface it hit
+        // on bounce number `bounce`. Returns false when the path is finished (absorbed, black, or
+        // killed by Russian roulette) in which case it brings back no light.
+        bool scatter_path(ray& current, color& throughput, const hit_record& hit,
+                unsigned int bounce) const {
+            // Prepare parameters for a reflected ray from the surface that is goind to be hit
+            // by our ray casts
+            ray scattered;
+            color attenuation;
+
+            // If the surface absorbs the ray, we just return black
+            if (!hit.mat->scatter(current, hit, attenuation, scattered)) {
+                return false;
+            }
+
+            throughput = throughput * attenuation;
+
+            // A black path cannot carry any light anymore, no need to trace it further
+            auto max_throughput = fmax(throughput.x(), fmax(throughput.y(), throughput.z()));
+            if (max_throughput <= 0) {
+                return false;
+            }
+
+            // Russian roulette. Paths which carry little light are killed with probability
+            // 1 - p, and the survivors are boosted by 1 / p. On average this returns the same
+            // color (the estimate stays unbiased), while we stop wasting bounces on dark paths.
+            // The first few bounces are always traced, since they carry most of the image.
+            if (russian_roulette && bounce + 1 >= russian_roulette_depth) {
+                auto survive = fmin(max_throughput, 0.95);
+                if (random_double() >= survive) {
+                    return false;
+                }
+                throughput /= survive;
+            }
+
+            // Continue with the reflected ray
+            current = scattered;
+            return true;
+        }
+
+        // Traces sample `s` of pixel (i, j) and returns the color it sees
+        color sample_pixel(const hittable& world, int i, int j, int s) const {
+            // Switch to the random stream of this sample
+            seed_sample_stream(seed, frame, uint64_t(j) * image_width + i, s);
+            // Get a new random ray in the pixel's region square
+            ray r = get_ray(i, j, s);
+            return ray_color(r, max_depth, world);
+        }
+
+        // Returns the color for a given scene ray.
+        color ray_color(const ray& r, unsigned int depth, const hittable& world) const {
             hit_record hit;
 
-            // Compute the points where we hit objects from the world, if any
-            //
-            // Material science
-            // If a ray bounces off of a material and keeps 100% of its color, then we say that the
-            // material is white. If a ray bounces off of a material and keeps 0% of its color,
-            // then we say that the material is black.
-            //
             // Fixing shadow Acne
             //
             // Start of the interval is 0.001, because a ray intersection with a surface is
-            // susceptible to floating point rounding errors, meaning the intersection point might
-            // not always be on the surface. If it is below the surface, there is a high change
-            // that it will intersect that surface again
-            if (world.hit(r, interval(0.001, infinity), hit) == true) {
-                // Prepare parameters for a reflected ray from the surface that is goind to be hit
-                // by our ray casts
-                ray scattered;
-                color attenuation;
-
-                // If we hit and reflect
-                if (hit.mat->scatter(r, hit, attenuation, scattered)) {
-                    // We cast the reflected ray recursively
-                    return attenuation * ray_color(scattered, depth - 1, world);
-                }
-                // Otherwise, we just return black
-                return color(0, 0, 0);
-
-                // Rest of these comments apply when we do not have materials
-                /* 
-                // We get a random new reflection direction, using rejection method.
-                // vec3 reflect_direction = random_on_hemisphere(hit.normal);
-                // Create a ray relfection direction from the Lambertian distribution. This can
-                // be easily understood with the vector addition triangle rule and the explanation
-                // from 9.4 True Lambertian Reflection from:
-                // https://raytracing.github.io/books/RayTracingInOneWeekend.html#overview
-                //vec3 reflect_direction = hit.normal + random_unit_vector();
-                // Now we map each component to interval from 0 to 1 and at the same time, we map
-                // it to (r,
-                // g, b). We add plus 1 to ensure that we cover the entire [0, 1] interval
-                // As a first demo of our new diffuse materail we'll set the ray_color function to
-                // return 50% of the color from a bounce.
-                // We construct a new ray that reflects back with the above direction
-                //ray reflect_ray(hit.p, reflect_direction);
-                // Now we recursively reflect that in the world
-                //return 0.5 * ray_color(reflect_ray, depth - 1, world);
-                // Alternatively, we can write hit.normal + color(1,1,1)
-                */
+            // susceptible to floating point rounding errors, meaning the intersection point
+            // might not always be on the surface. If it is below the surface, there is a high
+            // change that it will intersect that surface again
+            bool found = false;
+            if (depth > 0) {
+                thread_ray_count()++;
+                found = world.hit(r, interval(0.001, infinity), hit);
+            }
+            return continue_path(r, found, hit, depth, world);
+        }
+
+        // Returns the color seen along the camera ray `r`, whose first hit (if `found`) is `first`.
+        //
+        // The path is followed iteratively: every bounce multiplies the `throughput` (how much of
+        // the light arriving along the current ray still reaches the camera) by the attenuation of
+        // the surface, until the ray escapes to the sky, gets absorbed, or we run out of bounces.
+        // This used to be recursive, returning `attenuation * ray_color(scattered)`, which is the
+        // same product, just built on the way back up the stack, one frame per bounce.
+        //
+        // Material science
+        // If a ray bounces off of a material and keeps 100% of its color, then we say that the
+        // material is white. If a ray bounces off of a material and keeps 0% of its color,
+        // then we say that the material is black.
+        color continue_path(const ray& r, bool found, const hit_record& first, unsigned int depth,
+                const hittable& world) const {
+            ray current = r;
+            color throughput(1, 1, 1);
+            const hit_record* hit = &first;
+            hit_record next;
+
+            // Check if we still want to reflect
+            for (unsigned int bounce = 0; bounce < depth; bounce++) {
+                if (bounce > 0) {
+                    thread_ray_count()++;
+                    found = world.hit(current, interval(0.001, infinity), next);
+                    hit = &next;
+                }
+
+                if (!found) {
+                    // Nothing was hit, the ray reaches the sky
+                    return throughput * sky_color(current);
+                }
+
+                if (!scatter_path(current, throughput, *hit, bounce)) {
+                    return color(0, 0, 0);
+                }
             }
+
+            // We ran out of bounces
+            return color(0, 0, 0);
+        }
+
+        // Returns the color of the sky seen along the ray `r`, which did not hit anything.
+        // This function will linearly blend white and blue depending on the height of the
+        // 𝑦 coordinate after scaling the ray direction to unit length (so −1.0<𝑦<1.0).
+        // Because we're looking at the 𝑦 height after normalizing the vector, you'll notice a
+        // horizontal gradient to the color in addition to the vertical gradient.
+        //
+        // When 𝑎=1.0, we want blue. When 𝑎=0.0, we want white. In between, we want a blend.
+        // This forms a “linear blend”, or “linear interpolation”.
+        // This is commonly referred to as a lerp between two values.
+        static color sky_color(const ray& r) {
             // Get the unit vector from out ray.
             vec3 unit_direction = unit_vector(r.direction());
             // We are blending linearly, based on the y height (top to bottom). So we compute a as
@@ -280,12 +1262,13 @@ class camera {
         }
 
         // Construct a camera ray cast from the origin and directed at a randomly sampled point
-        // in the square region that has pixel (i,j) as the center.
-        ray get_ray(int i, int j) const {
+        // in the square region that has pixel (i,j) as the center. `s` is the index of the sample
+        // among the samples of the pixel.
+        ray get_ray(int i, int j, int s) const {
             // Construct a camera ray originating from the defocus disk and directed at a randomly
             // samples point around the pixel location i, j.
             // Get the random offset
-            auto rand_offset= sample_square();
+            auto rand_offset= sample_square(i, j, s);
 
             // Go to that pixel point in the viewport pixel grid, which is relative to the current
             // pixel
@@ -297,11 +1280,11 @@ class camera {
             //auto ray_origin = center;
             // However we are now using a focus disk, so we choose a random point from the focus
             // disk to be the origin of the ray.
-            auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();
+            auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample(i, j, s);
             // Ray direction is towards the above random pixel
             auto ray_direction = rand_pixel - ray_origin;
             // Time when the ray has been casted
-            auto ray_time = random_double();
+            auto ray_time = pixel_sampler->get_1d(i, j, s, time_dimension);
 
             // Return the new ray
             return ray(ray_origin, ray_direction, ray_time);
@@ -323,16 +1306,18 @@ class camera {
         // |--p--+--p--+--p--+--p--|
         // |  |  |  |  |  |  |  |  |
         // +-----------------------+
-        vec3 sample_square() const {
+        vec3 sample_square(int i, int j, int s) const {
             // Return a vector sampled in an unit square, ignoring the z coordinate, which is
             // non-existent in a 2D plane
-            return vec3(random_double() - 0.5, random_double() - 0.5, 0);
+            auto p = pixel_sampler->get_2d(i, j, s, pixel_dimension);
+            return vec3(p.x() - 0.5, p.y() - 0.5, 0);
         }
 
         // Returns a random point in the camera defocus disk.
-        point3 defocus_disk_sample() const {
+        point3 defocus_disk_sample(int i, int j, int s) const {
             // Get a random unit disk point
-            auto p = random_in_unit_disk();
+            auto lens = pixel_sampler->get_2d(i, j, s, lens_dimension);
+            auto p = sample_unit_disk(lens.x(), lens.y());
 
             // Get the pixel on the disk for that point. 3 simple rule here. One unit in the unit
             // disk corresponds to the entire disk length.
@@ -18,8 +18,9 @@ inline double linear_to_gamma(double linear_component) {
     return 0;
 }
 
-// Utility function that writes a single pixel's color out to the standard output stream.
-void write_color(std::ostream& out, const color& pixel_color) {
+// Converts a linear pixel color into the 3 byte (red, green, blue) components we store in 8-bit
+// image formats.
+inline void color_to_bytes(const color& pixel_color, unsigned char bytes[3]) {
     auto r = pixel_color.x();
     auto g = pixel_color.y();
     auto b = pixel_color.z();
@@ -33,12 +34,18 @@ void write_color(std::ostream& out, const color& pixel_color) {
     static const interval intensity(0.000, 0.999);
 
     // What we do here is basically trying to blend out the values
-    int rbyte = int(256 * intensity.clamp(r));
-    int gbyte = int(256 * intensity.clamp(g));
-    int bbyte = int(256 * intensity.clamp(b));
+    bytes[0] = static_cast<unsigned char>(256 * intensity.clamp(r));
+    bytes[1] = static_cast<unsigned char>(256 * intensity.clamp(g));
+    bytes[2] = static_cast<unsigned char>(256 * intensity.clamp(b));
+}
+
+// Utility function that writes a single pixel's color out to the standard output stream.
+inline void write_color(std::ostream& out, const color& pixel_color) {
+    unsigned char bytes[3];
+    color_to_bytes(pixel_color, bytes);
 
     // Write out the pixel color components
-    out << rbyte << ' ' << gbyte << ' ' << bbyte << '\n';
+    out << int(bytes[0]) << ' ' << int(bytes[1]) << ' ' << int(bytes[2]) << '\n';
 }
 
 #endif
@@ -0,0 +1,304 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+// Header which defines distributed rendering: splitting one frame over several processes, which
+// may run on different machines as long as they share a directory.
+//
+// Every process runs the same program, so every process builds the same scene and camera. One of
+// them is the coordinator, the others are workers. The coordinator splits the frame into jobs,
+// each one a region of the image and a range of sample indices, and posts them in a spool
+// directory:
+//
+//     <spool>/jobs/      jobs waiting for a process to render them
+//     <spool>/claimed/   jobs some process is rendering
+//     <spool>/results/   finished jobs: the accumulation buffer of the job's region
+//     <spool>/done       created by the coordinator once the frame is complete, holding a token
+//                        unique to the render
+//
+// Every step is a file rename, which is atomic. A process claims a job by moving it from `jobs` to
+// `claimed`, and exactly one process wins the rename. Results are written under a temporary name
+// and renamed into `results` once complete. The coordinator renders jobs too, then merges all the
+// results into the final image. A job claimed for longer than the timeout (its worker probably
+// died) goes back to `jobs`, and a job which went missing (dropped as malformed) is posted again.
+// Renders are deterministic, so if the first worker finishes after all, both results are
+// identical and either one can be kept.
+//
+// Workers may be started before the coordinator, while the `done` of the previous render is still
+// there. They remember its token and only stop on a `done` with a different one.
+//
+// Samples are summed in fixed point (see `accumulation_buffer.h`), so the merged image is exactly
+// the one a single process would render, however the frame was split.
+
+#include "scheduler.h"
+#include "accumulation_buffer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <set>
+#include <string>
+#include <system_error>
+#include <vector>
+
+// Part a process plays in a distributed render
+enum class distributed_role {
+    // Renders the whole frame on its own
+    none,
+    coordinator,
+    worker,
+};
+
+// Returns the role requested by the `TRACEME_ROLE` environment variable (`coordinator` or
+// `worker`). This is how every process of a distributed render gets the same program, and scene,
+// but a different part to play.
+inline distributed_role environment_distributed_role() {
+    auto role = getenv("TRACEME_ROLE");
+    if (role && std::strcmp(role, "coordinator") == 0) return distributed_role::coordinator;
+    if (role && std::strcmp(role, "worker") == 0) return distributed_role::worker;
+    return distributed_role::none;
+}
+
+// Returns the spool directory given by the `TRACEME_SPOOL` environment variable, if any
+inline std::string environment_spool_directory() {
+    auto spool = getenv("TRACEME_SPOOL");
+    return spool ? std::string(spool) : std::string();
+}
+
+// A unit of work: samples [s0, s1) of every pixel of `region`
+struct render_job {
+    std::string name;
+    // Identifies the render the job belongs to, the same way as checkpoints do
+    render_checkpoint render;
+    tile region;
+    int s0 = 0;
+    int s1 = 0;
+};
+
+// Splits a render into jobs of `region_size` x `region_size` pixels (0 for the whole image) and
+// `job_samples` samples (0 for all of them)
+inline std::vector<render_job> make_jobs(const render_checkpoint& render, int samples_per_pixel,
+        int region_size, int job_samples) {
+    std::vector<tile> regions = region_size > 0
+        ? make_tiles(render.width, render.height, region_size)
+        : std::vector<tile>{tile{0, 0, render.width, render.height}};
+    if (job_samples <= 0) job_samples = samples_per_pixel;
+
+    std::vector<render_job> jobs;
+    for (int s0 = 0; s0 < samples_per_pixel; s0 += job_samples) {
+        for (const auto& region : regions) {
+            render_job job;
+            job.name = "job_" + std::to_string(jobs.size());
+            job.render = render;
+            job.region = region;
+            job.s0 = s0;
+            job.s1 = std::min(s0 + job_samples, samples_per_pixel);
+            jobs.push_back(job);
+        }
+    }
+    return jobs;
+}
+
+// The spool directory shared by all the processes of a distributed render
+class render_spool {
+    public:
+        render_spool(const std::string& directory) : root(directory) {}
+
+        // Empties the spool and creates its directories. Done by the coordinator, before posting
+        // any job. Also picks the token `finish` marks this render complete with.
+        bool reset() {
+            render_token = std::to_string(
+                    std::chrono::system_clock::now().time_since_epoch().count())
+                + '-' + std::to_string(std::random_device()());
+            std::error_code error;
+            for (auto name : {"jobs", "claimed", "results", "done"}) {
+                std::filesystem::remove_all(root / name, error);
+            }
+            for (auto name : {"jobs", "claimed", "results"}) {
+                std::filesystem::create_directories(root / name, error);
+                if (error) {
+                    std::cerr << "ERROR: Could not create spool directory '"
+                        << (root / name).string() << "': " << error.message() << '\n';
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // Makes `job` available to the workers
+        bool post(const render_job& job) {
+            auto temporary = root / (job.name + ".tmp");
+            {
+                std::ofstream out(temporary);
+                out << "traceme-job 1\n"
+                    << "image " << job.render.width << ' ' << job.render.height << '\n'
+                    << "seed " << job.render.seed << '\n'
+                    << "frame " << job.render.frame << '\n'
+                    << "sampler " << job.render.sample_pattern << ' '
+                    << job.render.sampler_samples << '\n'
+                    << "region " << job.region.x0 << ' ' << job.region.y0 << ' '
+                    << job.region.x1 << ' ' << job.region.y1 << '\n'
+                    << "samples " << job.s0 << ' ' << job.s1 << '\n';
+                if (!out.flush()) {
+                    std::cerr << "ERROR: Could not write job file '" << temporary.string()
+                        << "'.\n";
+                    return false;
+                }
+            }
+            return move(temporary, root / "jobs" / job.name);
+        }
+
+        // Claims the first waiting job, if any. Returns false when there is none.
+        bool claim(render_job& job) {
+            for (const auto& name : list("jobs")) {
+                auto claimed = root / "claimed" / name;
+                std::error_code error;
+                std::filesystem::rename(root / "jobs" / name, claimed, error);
+                // Another process got it first
+                if (error) continue;
+
+                // The claim's age starts now, not when the job was posted
+                std::filesystem::last_write_time(claimed,
+                        std::filesystem::file_time_type::clock::now(), error);
+                if (read_job(claimed, job)) return true;
+
+                std::cerr << "ERROR: Dropping malformed job file '" << claimed.string() << "'.\n";
+                std::filesystem::remove(claimed, error);
+            }
+            return false;
+        }
+
+        // Gives up the claim on `job`, which goes back in line for another process
+        void release(const render_job& job) {
+            std::error_code error;
+            std::filesystem::rename(root / "claimed" / job.name, root / "jobs" / job.name, error);
+        }
+
+        // Publishes the result of `job` and releases the claim
+        bool complete(const render_job& job, const accumulation_buffer& result) {
+            auto temporary = root / (job.name + ".result.tmp");
+            if (!save_checkpoint(temporary.string(), job.render, result)) return false;
+            if (!move(temporary, root / "results" / job.name)) return false;
+            std::error_code error;
+            std::filesystem::remove(root / "claimed" / job.name, error);
+            return true;
+        }
+
+        // Puts the jobs which have been claimed for more than `timeout` seconds back in line
+        void requeue_stale(double timeout) {
+            auto now = std::filesystem::file_time_type::clock::now();
+            for (const auto& name : list("claimed")) {
+                std::error_code error;
+                auto claimed = root / "claimed" / name;
+                auto time = std::filesystem::last_write_time(claimed, error);
+                if (error) continue;
+                if (std::chrono::duration<double>(now - time).count() < timeout) continue;
+                std::filesystem::rename(claimed, root / "jobs" / name, error);
+            }
+        }
+
+        // Names of the finished jobs
+        std::vector<std::string> results() const { return list("results"); }
+
+        // Returns the jobs of `jobs` which are nowhere in the spool anymore: neither waiting,
+        // claimed nor finished. The directories are listed in the order jobs move through them,
+        // so a job moving on while we look is still found. Only a released job, moving back,
+        // may be reported, and posting it again merely renders it twice.
+        std::vector<render_job> lost(const std::vector<render_job>& jobs) const {
+            std::set<std::string> present;
+            for (auto directory : {"jobs", "claimed", "results"}) {
+                for (const auto& name : list(directory)) present.insert(name);
+            }
+            std::vector<render_job> missing;
+            for (const auto& job : jobs) {
+                if (!present.count(job.name)) missing.push_back(job);
+            }
+            return missing;
+        }
+
+        std::string result_path(const std::string& name) const {
+            return (root / "results" / name).string();
+        }
+
+        // Tells the workers the frame is complete. `done` is written under a temporary name and
+        // renamed, such that workers never read half a token.
+        void finish() {
+            auto temporary = root / "done.tmp";
+            std::ofstream(temporary) << render_token << '\n';
+            move(temporary, root / "done");
+        }
+
+        // Makes `finished` ignore the render currently marked complete. Workers call this when
+        // they start, as a `done` already there is left from a previous render until the
+        // coordinator of the next one empties the spool. A worker started after its render is
+        // complete thus waits for the next render.
+        void ignore_finished_render() {
+            stale_token = done_token();
+        }
+
+        // Whether the coordinator marked a render complete since `ignore_finished_render`
+        bool finished() const {
+            auto token = done_token();
+            return !token.empty() && token != stale_token;
+        }
+
+    private:
+        std::filesystem::path root;
+        // Token of the render this coordinator runs, written to `done` by `finish`
+        std::string render_token;
+        // Token of the `done` a worker found when it started
+        std::string stale_token;
+
+        // Token of the render marked complete, empty if there is none
+        std::string done_token() const {
+            std::ifstream in(root / "done");
+            std::string token;
+            in >> token;
+            return token;
+        }
+
+        // Sorted names of the files in one of the spool's directories
+        std::vector<std::string> list(const char* directory) const {
+            std::vector<std::string> names;
+            std::error_code error;
+            for (std::filesystem::directory_iterator it(root / directory, error), end;
+                    !error && it != end; it.increment(error)) {
+                names.push_back(it->path().filename().string());
+            }
+            std::sort(names.begin(), names.end());
+            return names;
+        }
+
+        static bool move(const std::filesystem::path& from, const std::filesystem::path& to) {
+            std::error_code error;
+            std::filesystem::rename(from, to, error);
+            if (error) {
+                std::cerr << "ERROR: Could not move '" << from.string() << "' to '" << to.string()
+                    << "': " << error.message() << '\n';
+                return false;
+            }
+            return true;
+        }
+
+        static bool read_job(const std::filesystem::path& path, render_job& job) {
+            std::ifstream in(path);
+            std::string magic, key;
+            int version = 0;
+            job.name = path.filename().string();
+            in >> magic >> version
+                >> key >> job.render.width >> job.render.height
+                >> key >> job.render.seed
+                >> key >> job.render.frame
+                >> key >> job.render.sample_pattern >> job.render.sampler_samples
+                >> key >> job.region.x0 >> job.region.y0 >> job.region.x1 >> job.region.y1
+                >> key >> job.s0 >> job.s1;
+            return in && magic == "traceme-job" && version == 1
+                && job.region.x0 < job.region.x1 && job.region.y0 < job.region.y1
+                && job.s0 < job.s1;
+        }
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "traceme.h"
+
+#include <vector>
+
+// Contiguous, in-memory image of linear (not gamma corrected) colors. Pixels are stored as
+// interleaved red, green, blue floats, going left to right for the width of the image, followed by
+// the next row below, for the full height of the image.
+//
+// The renderer only ever writes colors in here. Turning them into an image file is the job of the
+// encoders in `image_writer.h`, which keeps file formatting out of the pixel loop.
+class framebuffer {
+    public:
+        framebuffer() {}
+
+        framebuffer(int width, int height)
+            : image_width(width), image_height(height), pixels(size_t(width) * height * 3, 0.0f)
+        {}
+
+        int width() const { return image_width; }
+        int height() const { return image_height; }
+
+        // Stores the color of pixel (i, j)
+        void set(int i, int j, const color& pixel_color) {
+            float* pixel = &pixels[offset(i, j)];
+            pixel[0] = float(pixel_color.x());
+            pixel[1] = float(pixel_color.y());
+            pixel[2] = float(pixel_color.z());
+        }
+
+        // Returns the color of pixel (i, j)
+        color get(int i, int j) const {
+            const float* pixel = &pixels[offset(i, j)];
+            return color(pixel[0], pixel[1], pixel[2]);
+        }
+
+        // Raw access to the interleaved pixel components
+        const float* data() const { return pixels.data(); }
+
+    private:
+        int image_width = 0;
+        int image_height = 0;
+        std::vector<float> pixels;
+
+        size_t offset(int i, int j) const {
+            return (size_t(j) * image_width + i) * 3;
+        }
+};
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef HEATMAP_H
+#define HEATMAP_H
+
+// Header which defines per-pixel cost heatmaps: how much time (and how many BVH node visits) each
+// pixel of a render took, turned into false colour images. They show which parts of a frame are
+// expensive (glass, fuzzy metal, noise textures, dense geometry), which helps tuning tile sizes,
+// adaptive sampling budgets and the BVH on a given scene.
+
+#include "traceme.h"
+#include "framebuffer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Returns a timestamp in CPU cycles where the CPU has a cycle counter we can read cheaply, in
+// nanoseconds otherwise. Only differences between two timestamps of the same thread mean
+// anything.
+inline uint64_t read_cycle_counter() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+// Cost of every pixel of an image, summed over all the samples it received
+class cost_buffer {
+    public:
+        cost_buffer() {}
+
+        cost_buffer(int width, int height)
+            : image_width(width), image_height(height), cycles(size_t(width) * height, 0),
+              node_visits(size_t(width) * height, 0)
+        {}
+
+        int width() const { return image_width; }
+        int height() const { return image_height; }
+
+        // Adds the cost of some samples of pixel (i, j). Each pixel is only ever rendered by one
+        // thread at a time, so threads never write to the same element.
+        void add(int i, int j, uint64_t pixel_cycles, uint64_t pixel_node_visits) {
+            size_t pixel = size_t(j) * image_width + i;
+            cycles[pixel] += pixel_cycles;
+            node_visits[pixel] += pixel_node_visits;
+        }
+
+        const std::vector<uint64_t>& time() const { return cycles; }
+        const std::vector<uint64_t>& visits() const { return node_visits; }
+
+    private:
+        int image_width = 0;
+        int image_height = 0;
+        std::vector<uint64_t> cycles;
+        std::vector<uint64_t> node_visits;
+};
+
+// Maps `x` in [0, 1] to a colour going from black through purple, red and orange to pale yellow,
+// close to the "inferno" colour map. Its brightness increases steadily, so the image still reads
+// correctly in grayscale. The colour is linear, ready for the gamma correction of the encoders.
+inline color heat_color(double x) {
+    static const double stops[][3] = {
+        {0.000, 0.000, 0.016},
+        {0.258, 0.039, 0.408},
+        {0.576, 0.149, 0.404},
+        {0.867, 0.318, 0.227},
+        {0.988, 0.647, 0.039},
+        {0.988, 1.000, 0.643},
+    };
+    const int last = sizeof(stops) / sizeof(stops[0]) - 1;
+
+    x = x < 0 ? 0 : x > 1 ? 1 : x;
+    int n = std::min(int(x * last), last - 1);
+    double f = x * last - n;
+    color c;
+    for (int k = 0; k < 3; k++) {
+        // The stops are gamma corrected values, undo the gamma 2 of our encoders
+        double value = stops[n][k] + f * (stops[n + 1][k] - stops[n][k]);
+        c[k] = value * value;
+    }
+    return c;
+}
+
+// Turns the per-pixel `values` into a false colour image. Values are scaled such that the 99th
+// percentile gets the hottest colour, otherwise a few extreme pixels (a caustic, a grazing hit on
+// glass) would leave the rest of the image black.
+inline framebuffer heatmap_image(const std::vector<uint64_t>& values, int width, int height) {
+    framebuffer image(width, height);
+    if (values.empty()) return image;
+
+    std::vector<uint64_t> sorted(values);
+    auto percentile = sorted.begin() + (sorted.size() - 1) * 99 / 100;
+    std::nth_element(sorted.begin(), percentile, sorted.end());
+    double scale = *percentile > 0 ? 1.0 / double(*percentile) : 0.0;
+
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            image.set(i, j, heat_color(scale * double(values[size_t(j) * width + i])));
+        }
+    }
+    return image;
+}
+
+// The per-pixel `values` as they are, in all 3 channels, for tools which read floating point
+// images (see `image_format::pfm`)
+inline framebuffer raw_cost_image(const std::vector<uint64_t>& values, int width, int height) {
+    framebuffer image(width, height);
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            double value = double(values[size_t(j) * width + i]);
+            image.set(i, j, color(value, value, value));
+        }
+    }
+    return image;
+}
+
+#endif
@@ -4,10 +4,14 @@
 #include "ray.h"
 
 #include "aabb.h"
+#include "packet.h"
+
+#include <cstdint>
 
 // Tell the compiler this is a class that will be defined later (in material.h). This solves a
 // circular reference issue, where hit_record and material need to keep a reference of each other.
 class material;
+class hittable;
 
 // Logs the occurence of a single hit from the intersection of a ray cast and a surface or volume
 // (an object in the scene)
@@ -17,8 +21,10 @@ class hit_record {
         point3 p;
         // Normal at the intersection point
         vec3 normal;
-        // The material of the surface that we hit.
-        shared_ptr<material> mat;
+        // The material of the surface that we hit. Not owned: the objects of the scene (or the BVH
+        // which packed them) keep their materials alive for as long as the scene is traced, and a
+        // `shared_ptr` here cost two atomic reference count updates on every hit.
+        const material* mat = nullptr;
         // Gives the length of the ray that hit
         double t;
 
@@ -30,6 +36,12 @@ class hit_record {
         // (false)
         bool front_face;
 
+        // Set by `hittable::hit_deferred`: the object which still has to fill in the rest of the
+        // record (see `hittable::finish_hit`), or null when the record is complete
+        const hittable* surface = nullptr;
+        // Which of the primitives of `surface` was hit, for objects made of many
+        uint32_t primitive;
+
         void set_face_normal(const ray& r, const vec3& outward_normal) {
             // Parameter `outward_normal` is assumed to have unit length.
             // If the dot product of the 2 is positive, the ray is inside the sphere
@@ -53,9 +65,84 @@ class hittable {
         virtual ~hittable() = default;
 
         // A hit computed for a casted ray `r`, which only occurs if the result `t` is in between the
-        // given interval `tmin` < t < `tmax`
+        // given interval `tmin` < t < `tmax`. `rec` is only written to when there is a hit, so
+        // aggregates can hand the same record to all their children.
         virtual bool hit(const ray& r, const interval& ray_t_interval, hit_record& rec) const = 0;
 
+        // First half of `hit`, for aggregates looking for the closest hit among their children.
+        // A traversal finds many hits which a closer one then replaces, and the hit point, normal
+        // and texture coordinates (an `acos` and an `atan2` for a sphere) are only worth
+        // computing for the last one. So only `rec.t` is set here, along with whatever the object
+        // needs to complete the record later, and `rec.surface` points to the object which will
+        // do it in `finish_hit`.
+        //
+        // The default does the whole of `hit` at once and leaves nothing to finish.
+        virtual bool hit_deferred(const ray& r, const interval& ray_t_interval,
+                hit_record& rec) const {
+            if (!hit(r, ray_t_interval, rec)) return false;
+            rec.surface = nullptr;
+            return true;
+        }
+
+        // Second half of `hit`: fills in the rest of `rec`, a hit of the ray `r` which
+        // `hit_deferred` left to this object
+        virtual void finish_hit(const ray&, hit_record&) const {}
+
+        // Whether the ray `r` hits anything at all within `ray_t_interval`, for visibility queries
+        // such as shadow rays. Which surface it hits does not matter, so the search stops at the
+        // first one found, and nothing is computed about it.
+        //
+        // The default goes through `hit_deferred`. Shapes and aggregates override it to skip the
+        // record altogether and stop early.
+        virtual bool occluded(const ray& r, const interval& ray_t_interval) const {
+            hit_record rec;
+            return hit_deferred(r, ray_t_interval, rec);
+        }
+
+        // `hit` in terms of `hit_deferred`, for the objects which implement the latter
+        bool hit_and_finish(const ray& r, const interval& ray_t_interval, hit_record& rec) const {
+            if (!hit_deferred(r, ray_t_interval, rec)) return false;
+            if (rec.surface) rec.surface->finish_hit(r, rec);
+            return true;
+        }
+
+        // Batched version of `hit`, used to intersect many rays against the same object in one
+        // call. Only the rays `rays[indices[0]]` ... `rays[indices[count - 1]]` are traced. For
+        // each such ray `k`, we look for a hit with t in (`t_min`, closest), where closest is
+        // `recs[k].t` if `hits[k]` is already set and infinity otherwise. When a closer hit is
+        // found, `recs[k]` is updated and `hits[k]` is set. This lets aggregates pass the same
+        // batch to all their children, with each ray's search interval shrinking as we go.
+        //
+        // The default just loops over the rays. Aggregates override it to walk their children
+        // once for the whole batch, instead of once per ray.
+        virtual void hit_batch(const ray* rays, const uint32_t* indices, size_t count,
+                double t_min, hit_record* recs, bool* hits) const {
+            for (size_t n = 0; n < count; n++) {
+                auto k = indices[n];
+                interval ray_t(t_min, hits[k] ? recs[k].t : infinity);
+                if (hit(rays[k], ray_t, recs[k])) {
+                    hits[k] = true;
+                }
+            }
+        }
+
+        // Packet version of `hit`. Traces the lanes of `packet` which are set in `active`. For each
+        // lane k which hits something closer than `packet.t_max[k]`, the hit is stored in
+        // `recs[k]`, `packet.t_max[k]` shrinks to it and bit k is set in `hit_mask`.
+        //
+        // The default unpacks the lanes and calls `hit` for each one of them. Shapes and
+        // aggregates with a SIMD kernel override it.
+        virtual void hit_packet(ray_packet& packet, uint32_t active, hit_record* recs,
+                uint32_t& hit_mask) const {
+            for (int k = 0; k < packet.size; k++) {
+                if (!(active & (1u << k))) continue;
+                if (hit(packet.get(k), interval(packet.t_min, packet.t_max[k]), recs[k])) {
+                    packet.t_max[k] = recs[k].t;
+                    hit_mask |= 1u << k;
+                }
+            }
+        }
+
         // Returns the bounding box of this current surface / 3D object
         virtual aabb bounding_box() const = 0;
 };
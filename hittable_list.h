@@ -34,30 +34,63 @@ class hittable_list : public hittable {
         // Additionally, it updates the `rec` object with the closest record hit from all the
         // objects in the list.
         bool hit(const ray& r, const interval& ray_t_interval, hit_record& rec) const override {
-            // Temporary storeage for the hit record
-            hit_record temp_rec;
+            return hit_and_finish(r, ray_t_interval, rec);
+        }
+
+        // The objects only record where they were hit, and the closest of them fills in the rest
+        // of the record once all of them have been tried
+        bool hit_deferred(const ray& r, const interval& ray_t_interval,
+                hit_record& rec) const override {
             // Records whether the ray hit at least 1 object
             bool hit_anything = false;
             // Keep track of the closes object we have hit so far with the ray
             auto closest_so_far = ray_t_interval.max;
+            stats::count(stats::list_visits);
+            stats::count(stats::list_objects, objects.size());
 
             // For each object in the list
             for (const auto& object : objects) {
-                // If we hit wit the ray an the object is closer than the previous recorded
-                if (object->hit(r, interval(ray_t_interval.min, closest_so_far), temp_rec)) {
+                // If we hit wit the ray an the object is closer than the previous recorded. Objects
+                // only write to the record when they are hit, so each closer hit overwrites the
+                // previous one in place, without going through a temporary record.
+                if (object->hit_deferred(r, interval(ray_t_interval.min, closest_so_far), rec)) {
                     // We hit something, so we log that
                     hit_anything = true;
                     // Because we hit with the previous interval, this means we now have a closer
                     // object
-                    closest_so_far = temp_rec.t;
-                    // We update the hit record with the new record
-                    rec = temp_rec;
+                    closest_so_far = rec.t;
                 }
             }
             // Return whether or not we hit something
             return hit_anything;
         }
 
+        // Stops at the first object in the way
+        bool occluded(const ray& r, const interval& ray_t_interval) const override {
+            stats::count(stats::list_visits);
+            for (const auto& object : objects) {
+                stats::count(stats::list_objects);
+                if (object->occluded(r, ray_t_interval)) return true;
+            }
+            return false;
+        }
+
+        // Traces the whole batch against one object at a time, rather than each ray against all
+        // the objects
+        void hit_batch(const ray* rays, const uint32_t* indices, size_t count, double t_min,
+                hit_record* recs, bool* hits) const override {
+            for (const auto& object : objects) {
+                object->hit_batch(rays, indices, count, t_min, recs, hits);
+            }
+        }
+
+        void hit_packet(ray_packet& packet, uint32_t active, hit_record* recs,
+                uint32_t& hit_mask) const override {
+            for (const auto& object : objects) {
+                object->hit_packet(packet, active, recs, hit_mask);
+            }
+        }
+
         aabb bounding_box() const override { return bbox; }
 
     private:
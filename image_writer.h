@@ -0,0 +1,159 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+// Encoders which turn a rendered `framebuffer` into an image file. Every encoder builds the whole
+// file in memory first and then hands it to the output stream in a single bulk write.
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+
+#include "stb/stb_image_write.h"
+
+#include "framebuffer.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Image file formats the camera can produce
+enum class image_format {
+    // Plain text PPM (P3). Human readable, but very slow and large. Kept for compatibility.
+    ppm_ascii,
+    // Binary PPM (P6). 8-bit gamma corrected.
+    ppm,
+    // Portable Float Map. 32-bit linear floats, no clamping, for post-processing and diffing.
+    pfm,
+    // PNG. 8-bit gamma corrected and compressed.
+    png,
+};
+
+// Returns the gamma corrected 8-bit components of the whole image, as 3 bytes per pixel
+inline std::vector<unsigned char> framebuffer_to_bytes(const framebuffer& image) {
+    std::vector<unsigned char> bytes(size_t(image.width()) * image.height() * 3);
+
+    for (int j = 0; j < image.height(); j++) {
+        for (int i = 0; i < image.width(); i++) {
+            color_to_bytes(image.get(i, j), &bytes[(size_t(j) * image.width() + i) * 3]);
+        }
+    }
+
+    return bytes;
+}
+
+// Encodes the image as a plain text PPM (P3)
+inline std::string encode_ppm_ascii(const framebuffer& image) {
+    // Write the header: Magic Width Height and on the next line we have the maximum value
+    // for each color: 255
+    std::string file = "P3\n" + std::to_string(image.width()) + " "
+        + std::to_string(image.height()) + "\n255\n";
+
+    auto bytes = framebuffer_to_bytes(image);
+    // Longest pixel line is "255 255 255\n"
+    file.reserve(file.size() + bytes.size() / 3 * 12);
+
+    char line[16];
+    for (size_t i = 0; i < bytes.size(); i += 3) {
+        int length = snprintf(line, sizeof(line), "%d %d %d\n", bytes[i], bytes[i+1], bytes[i+2]);
+        file.append(line, length);
+    }
+
+    return file;
+}
+
+// Encodes the image as a binary PPM (P6). Same header as P3, followed by the raw bytes.
+inline std::string encode_ppm(const framebuffer& image) {
+    std::string file = "P6\n" + std::to_string(image.width()) + " "
+        + std::to_string(image.height()) + "\n255\n";
+
+    auto bytes = framebuffer_to_bytes(image);
+    file.append(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+
+    return file;
+}
+
+// Encodes the image as a Portable Float Map. The pixels are the linear colors, stored as 32-bit
+// floats in the machine's byte order, which the header advertises through the sign of the scale
+// (negative means little endian). PFM stores scanlines from the bottom of the image to the top.
+inline std::string encode_pfm(const framebuffer& image) {
+    const uint16_t endian_probe = 1;
+    bool little_endian = *reinterpret_cast<const unsigned char*>(&endian_probe) == 1;
+
+    std::string file = "PF\n" + std::to_string(image.width()) + " "
+        + std::to_string(image.height()) + "\n" + (little_endian ? "-1.0" : "1.0") + "\n";
+
+    size_t row_bytes = size_t(image.width()) * 3 * sizeof(float);
+    size_t header_size = file.size();
+    file.resize(header_size + row_bytes * image.height());
+
+    const float* pixels = image.data();
+    for (int j = 0; j < image.height(); j++) {
+        const float* row = pixels + size_t(image.height() - 1 - j) * image.width() * 3;
+        std::memcpy(&file[header_size + j * row_bytes], row, row_bytes);
+    }
+
+    return file;
+}
+
+// Encodes the image as a PNG, using stb's writer to do the compression
+inline std::string encode_png(const framebuffer& image) {
+    std::string file;
+    auto bytes = framebuffer_to_bytes(image);
+
+    // stb hands the encoded file back in chunks through this callback
+    auto append = [](void* context, void* data, int size) {
+        static_cast<std::string*>(context)->append(static_cast<const char*>(data), size);
+    };
+
+    stbi_write_png_to_func(append, &file, image.width(), image.height(), 3, bytes.data(),
+            image.width() * 3);
+
+    return file;
+}
+
+// Returns the usual file name extension of `format`, dot included
+inline const char* image_extension(image_format format) {
+    switch (format) {
+        case image_format::ppm_ascii: return ".ppm";
+        case image_format::ppm: return ".ppm";
+        case image_format::pfm: return ".pfm";
+        case image_format::png: return ".png";
+    }
+    return "";
+}
+
+// Encodes the image in the requested `format`
+inline std::string encode_image(const framebuffer& image, image_format format) {
+    switch (format) {
+        case image_format::ppm_ascii: return encode_ppm_ascii(image);
+        case image_format::ppm: return encode_ppm(image);
+        case image_format::pfm: return encode_pfm(image);
+        case image_format::png: return encode_png(image);
+    }
+    return std::string();
+}
+
+// Encodes the image and writes it to `out` in one go. Returns false if `out` failed to take it.
+inline bool write_image(std::ostream& out, const framebuffer& image, image_format format) {
+    auto file = encode_image(image, format);
+    out.write(file.data(), file.size());
+    out.flush();
+    return bool(out);
+}
+
+// Encodes the image and writes it to the file at `path`. Returns true on success.
+inline bool write_image(const std::string& path, const framebuffer& image, image_format format) {
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+        std::cerr << "ERROR: Could not open image file '" << path << "' for writing.\n";
+        return false;
+    }
+    if (!write_image(out, image, format)) {
+        std::cerr << "ERROR: Could not write image file '" << path << "'.\n";
+        return false;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,362 @@
+#ifndef LINEAR_BVH_H
+#define LINEAR_BVH_H
+
+// Header which defines the linear BVH: a bounding volume hierarchy compiled into a single array of
+// small nodes, for tracing rather than for building.
+//
+// `bvh_node` is a tree of objects, each child a `shared_ptr<hittable>` somewhere on the heap, so
+// walking it is a chain of virtual calls which jump all over memory. Here the nodes are laid out
+// one after the other in depth first order, so the first child of a node is always the next node,
+// and only the offset of the second child needs to be stored. Leaves store a range of the
+// primitive array instead of a pointer to a list. Traversal is a loop with an explicit stack, and
+// each node takes 32 bytes, so two of them share a cache line.
+
+#include "traceme.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "packet.h"
+#include "primitives.h"
+
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+// A node of the linear BVH. The bounds are floats to fit the node in 32 bytes, rounded outwards so
+// the box always contains the double precision box it came from.
+struct alignas(32) linear_bvh_node {
+    // Minimum (row 0) and maximum (row 1) of the box, along x, y and z
+    float bounds[2][3];
+    // Index of the first primitive for a leaf, index of the second child for an interior node
+    uint32_t offset;
+    // Number of primitives of a leaf, zero for an interior node
+    uint16_t count;
+    // Axis the children of an interior node were split along
+    uint8_t axis;
+    // Whether the second child of an interior node has the bigger box, which occlusion queries
+    // visit first
+    uint8_t second_bigger;
+
+    bool is_leaf() const { return count > 0; }
+
+    aabb box() const {
+        return aabb(point3(bounds[0][0], bounds[0][1], bounds[0][2]),
+                point3(bounds[1][0], bounds[1][1], bounds[1][2]));
+    }
+};
+
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node should fill half a cache line");
+
+class linear_bvh : public hittable {
+    public:
+        linear_bvh(const hittable_list& list,
+                const bvh_build_options& options = bvh_build_options()) {
+            auto build = make_bvh_build_objects(list.objects, 0, list.objects.size(), options);
+            if (build.empty()) return;
+
+            nodes.reserve(2 * build.size());
+            build_node(nodes, build, 0, build.size(), options, 0,
+                    resolve_thread_count(options.threads));
+
+            // The leaves point into the objects as the builder sorted them
+            primitives.add_all(build, [](const bvh_build_object& o) -> const shared_ptr<hittable>& {
+                return o.object;
+            });
+            bbox = bvh_bounds(build, 0, build.size());
+        }
+
+        bool hit(const ray& r, const interval& ray_t, hit_record& rec) const override {
+            return hit_and_finish(r, ray_t, rec);
+        }
+
+        // Only the closest of the hits found in the leaves gets its surface attributes, once the
+        // traversal is over
+        bool hit_deferred(const ray& r, const interval& ray_t, hit_record& rec) const override {
+            if (nodes.empty()) return false;
+
+            traversal_ray tr(r);
+
+            uint32_t stack[stack_size];
+            int stack_top = 0;
+            uint32_t index = 0;
+            bool hit_anything = false;
+            double closest = ray_t.max;
+
+            while (true) {
+                const auto& node = nodes[index];
+                stats::count(stats::bvh_node_visits);
+
+                if (hit_box(node, tr, ray_t.min, closest)) {
+                    if (!node.is_leaf()) {
+                        // Visit the child on the side the ray comes from first, so a hit found
+                        // there can cut the search in the other one short
+                        if (tr.sign[node.axis]) {
+                            stack[stack_top++] = index + 1;
+                            index = node.offset;
+                        } else {
+                            stack[stack_top++] = node.offset;
+                            index = index + 1;
+                        }
+                        continue;
+                    }
+
+                    if (primitives.hit(node.offset, node.offset + node.count, r,
+                                interval(ray_t.min, closest), this, rec)) {
+                        hit_anything = true;
+                        closest = rec.t;
+                    }
+                }
+
+                if (stack_top == 0) break;
+                index = stack[--stack_top];
+            }
+
+            return hit_anything;
+        }
+
+        void finish_hit(const ray& r, hit_record& rec) const override {
+            primitives.finish(r, rec);
+        }
+
+        // Any hit ends the traversal. The interval never shrinks, so the order of the children
+        // only decides how soon a blocker is found: the child with the bigger box goes first, as
+        // the likelier to be hit. This is two to three times faster than the near child first on
+        // the sphere scenes.
+        bool occluded(const ray& r, const interval& ray_t) const override {
+            if (nodes.empty()) return false;
+
+            traversal_ray tr(r);
+
+            uint32_t stack[stack_size];
+            int stack_top = 0;
+            uint32_t index = 0;
+
+            while (true) {
+                const auto& node = nodes[index];
+                stats::count(stats::bvh_node_visits);
+
+                if (hit_box(node, tr, ray_t.min, ray_t.max)) {
+                    if (!node.is_leaf()) {
+                        if (node.second_bigger) {
+                            stack[stack_top++] = index + 1;
+                            index = node.offset;
+                        } else {
+                            stack[stack_top++] = node.offset;
+                            index = index + 1;
+                        }
+                        continue;
+                    }
+
+                    if (primitives.occluded(node.offset, node.offset + node.count, r, ray_t)) {
+                        return true;
+                    }
+                }
+
+                if (stack_top == 0) return false;
+                index = stack[--stack_top];
+            }
+        }
+
+        // Packet traversal. The lanes of the packet go down the tree together, each stack entry
+        // remembering which of them reached the node.
+        void hit_packet(ray_packet& packet, uint32_t active, hit_record* recs,
+                uint32_t& hit_mask) const override {
+            if (nodes.empty() || !active) return;
+
+            // The packet holds coherent rays, so the direction of its first lane picks the order
+            // of the children for all of them
+            int first = __builtin_ctz(active);
+            bool negative[3] = {
+                packet.ix[first] < 0, packet.iy[first] < 0, packet.iz[first] < 0
+            };
+
+            struct entry {
+                uint32_t index;
+                uint32_t active;
+            };
+            entry stack[stack_size];
+            int stack_top = 0;
+            entry current = {0, active};
+
+            while (true) {
+                const auto& node = nodes[current.index];
+                stats::count(stats::bvh_node_visits, __builtin_popcount(current.active));
+                stats::count(stats::box_tests, __builtin_popcount(current.active));
+                uint32_t lanes = packet_kernels().hit_aabb(packet, current.active, node.box());
+                stats::count(stats::box_hits, __builtin_popcount(lanes));
+
+                if (lanes) {
+                    if (!node.is_leaf()) {
+                        if (negative[node.axis]) {
+                            stack[stack_top++] = {current.index + 1, lanes};
+                            current = {node.offset, lanes};
+                        } else {
+                            stack[stack_top++] = {node.offset, lanes};
+                            current = {current.index + 1, lanes};
+                        }
+                        continue;
+                    }
+
+                    primitives.hit_packet(node.offset, node.offset + node.count, packet, lanes,
+                            recs, hit_mask);
+                }
+
+                if (stack_top == 0) break;
+                current = stack[--stack_top];
+            }
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        // Number of nodes, for reporting the size of the tree
+        size_t node_count() const { return nodes.size(); }
+
+        // The nodes in depth first order, and the objects in the order of the leaves, for turning
+        // the tree into other layouts (see `wide_bvh.h`)
+        const std::vector<linear_bvh_node>& node_array() const { return nodes; }
+        const primitive_store& primitive_array() const { return primitives; }
+
+        // Moves the objects out, for a layout which replaces this tree and takes them over
+        primitive_store take_primitives() { return std::move(primitives); }
+
+        // Expected cost of tracing a ray which goes through the root box, as the surface area
+        // heuristic counts it: every box is tested, and every primitive of every leaf intersected,
+        // with the chance that the ray crosses the box, which is the ratio of its area to the
+        // area of the root. Measures the quality of a tree, whichever way it was built.
+        double expected_cost(double traversal_cost = 1.0, double intersection_cost = 1.0) const {
+            if (nodes.empty()) return 0;
+
+            double root_area = nodes[0].box().surface_area();
+            if (!(root_area > 0)) return traversal_cost + intersection_cost * primitives.size();
+
+            double cost = 0;
+            for (const auto& node : nodes) {
+                double chance = node.box().surface_area() / root_area;
+                cost += chance * (traversal_cost + intersection_cost * node.count);
+            }
+            return cost;
+        }
+
+    private:
+        // Deepest path of the tree the traversal stack can hold
+        static const int stack_size = 64;
+
+        std::vector<linear_bvh_node> nodes;
+        // The objects, packed in the order of the leaves
+        primitive_store primitives;
+        aabb bbox;
+
+        // Slab test of the ray against the box of `node`, within (`t_min`, `t_max`), as in
+        // `aabb::hit`
+        static bool hit_box(const linear_bvh_node& node, const traversal_ray& r, double t_min,
+                double t_max) {
+            stats::count(stats::box_tests);
+            for (int axis = 0; axis < 3; axis++) {
+                double t0 = (double(node.bounds[r.sign[axis]][axis]) - r.origin[axis])
+                    * r.inv_direction[axis];
+                double t1 = (double(node.bounds[1 - r.sign[axis]][axis]) - r.origin[axis])
+                    * r.inv_direction[axis];
+                t_min = t0 > t_min ? t0 : t_min;
+                t_max = t1 < t_max ? t1 : t_max;
+            }
+            bool overlap = t_min < t_max;
+            stats::count(stats::box_hits, overlap);
+            return overlap;
+        }
+
+        // Appends the nodes of the subtree over objects [start, end) of `build`, at `depth` in the
+        // tree, to `out`, using up to `threads` threads. Returns the index of its root in `out`.
+        static uint32_t build_node(std::vector<linear_bvh_node>& out,
+                std::vector<bvh_build_object>& build, size_t start, size_t end,
+                const bvh_build_options& options, int depth, unsigned int threads) {
+            uint32_t index = uint32_t(out.size());
+            out.emplace_back();
+            aabb bounds = bvh_bounds(build, start, end, threads);
+            set_bounds(out[index], bounds);
+
+            auto object_span = end - start;
+            int axis = 0;
+            size_t mid = start;
+            if (object_span > 1) {
+                // The median split halves the objects at every level, so the subtree below fits
+                // in the stack whatever the SAH would have done with it
+                mid = depth + ceil_log2(object_span) < stack_size - 1
+                    ? bvh_partition(build, start, end, bounds, options, axis, threads)
+                    : bvh_median_split(build, start, end, bounds, axis);
+            }
+
+            // `count` has 16 bits, bigger leaves have to be split
+            if (mid == start && object_span > UINT16_MAX) {
+                mid = bvh_median_split(build, start, end, bounds, axis);
+            }
+
+            if (mid == start) {
+                out[index].offset = uint32_t(start);
+                out[index].count = uint16_t(object_span);
+                return index;
+            }
+
+            uint32_t second;
+            if (threads > 1 && object_span >= bvh_parallel_span) {
+                // The two halves are independent. Each is built into its own array, one of them
+                // by another thread, and the arrays are then appended in depth first order.
+                unsigned int left_threads = threads / 2;
+                std::vector<linear_bvh_node> left_nodes, right_nodes;
+                std::thread worker([&]() {
+                    build_node(left_nodes, build, start, mid, options, depth + 1, left_threads);
+                });
+                build_node(right_nodes, build, mid, end, options, depth + 1,
+                        threads - left_threads);
+                worker.join();
+
+                append_nodes(out, left_nodes);
+                second = uint32_t(out.size());
+                append_nodes(out, right_nodes);
+            } else {
+                build_node(out, build, start, mid, options, depth + 1, 1);
+                second = build_node(out, build, mid, end, options, depth + 1, 1);
+            }
+
+            // `out` may have been reallocated by the children
+            out[index].offset = second;
+            out[index].count = 0;
+            out[index].axis = uint8_t(axis);
+            out[index].second_bigger =
+                out[second].box().surface_area() > out[index + 1].box().surface_area();
+            return index;
+        }
+
+        // Appends `nodes`, whose child offsets are indices into `nodes`, to `out`
+        static void append_nodes(std::vector<linear_bvh_node>& out,
+                const std::vector<linear_bvh_node>& nodes) {
+            uint32_t base = uint32_t(out.size());
+            for (auto node : nodes) {
+                if (!node.is_leaf()) node.offset += base;
+                out.push_back(node);
+            }
+        }
+
+        // Stores `box` in `node`, rounded outwards to floats. A box with no thickness along an axis
+        // (a planar object whose box was not padded) is padded as `aabb` pads its own, as the slab
+        // test never reports a flat box as hit and its primitives would never be tested.
+        static void set_bounds(linear_bvh_node& node, const aabb& box) {
+            for (int axis = 0; axis < 3; axis++) {
+                auto extent = box.axis_interval(axis);
+                if (extent.min == extent.max) extent = extent.expand(0.0001);
+                float min = float(extent.min);
+                float max = float(extent.max);
+                if (double(min) > extent.min) min = std::nextafter(min, -INFINITY);
+                if (double(max) < extent.max) max = std::nextafter(max, INFINITY);
+                node.bounds[0][axis] = min;
+                node.bounds[1][axis] = max;
+            }
+        }
+
+        static int ceil_log2(size_t n) {
+            int log = 0;
+            while ((size_t(1) << log) < n) log++;
+            return log;
+        }
+};
+
+#endif
@@ -8,6 +8,7 @@
 #include "bvh.h"
 #include "texture.h"
 #include "quad.h"
+#include "scenes.h"
 
 
 void world_with_spheres(hittable_list& world) {
@@ -76,240 +77,28 @@ void defocus_my_cam(camera& cam) {
 }
 
 void random_sphere_cover() {
-    // World / Scene configuration
-    hittable_list world;
-
-    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-    auto ground_sphere = make_shared<sphere>(point3(0, -1000, 0), 1000, ground_material);
-
-    // Add it to the world
-    world.add(ground_sphere);
-
-    // Generate a bunch of random spheres, use `a` as `x` coordinate base and `b` as `z` coordinate
-    // base
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
-            // Stored the likelihood of choosing different materials and and reflection and
-            // refraction properties
-            auto choose_mat = random_double();
-
-            while (choose_mat * 0.9 < 0.2) {
-                choose_mat = random_double();
-            }
-
-            point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
-
-            // Only generate the surfaces if we go beyond this random point
-            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
-                shared_ptr<material> sphere_material;
-
-                if (choose_mat < 0.8) {
-                    // Diffuse, most likely to be chosen
-                    auto albedo = color::random() * color::random();
-                    sphere_material = make_shared<lambertian>(albedo);
-
-                    // Define a new center for the spheres to move to
-                    auto center2 = center + vec3(0, random_double(0, .5), 0);
-                    // Define a moving sphere
-                    world.add(make_shared<sphere>(center, center2, 0.2, sphere_material));
-                } else if (choose_mat < 0.95) {
-                    // metal, less likely
-                    auto albedo = color::random(0.5, 1);
-                    // How much we reflect
-                    auto fuzz = random_double(0, 0.5);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                } else {
-                    // Glass, very less likely since is computationally  expensive
-                    sphere_material = make_shared<dielectric>(1.5);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                }
-            }
-        }
-    }
-
-    // Add some big spheres
-
-    // Center sphere
-    auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
-
-    // Left sphere
-    auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
-
-    // Right sphere
-    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
-
-    world = hittable_list(make_shared<bvh_node>(world));
-
-    // SetV up the camera through which we view the world
-    camera cam;
-
-    // Setup camera
-    // Change the aspect ratio to something more popular
-    cam.aspect_ratio = 16.0 / 9.0;
-    // Change image's width. This will automatically also change the images height as well.
-    cam.image_width = 400;
-    // Set the number of ray samples we want to cast for each pixel to do anti-aliasing
-    cam.samples_per_pixel = 100;
-    // Set the number of times we want the casted rays to reflect on surfaces of the world
-    cam.max_depth = 50;
-
-    cam.vfov = 20;
-
-    // Move camera to the right, a bit upwards and a bit backwards
-    cam.lookfrom = point3(13, 2, 3);
-    cam.lookat = point3(0, 0, 0);
-    cam.vup = vec3(0, 1, 0);
-
-    cam.defocus_angle = 0.6;
-    cam.focus_dist = 10.0;
-
-    // Change the aspect ratio to something more popular
-    cam.aspect_ratio = 16.0 / 9.0;
-    // Change image's width. This will automatically also change the images height as well.
-    cam.image_width = 400;
-    // Set the number of ray samples we want to cast for each pixel to do anti-aliasing
-    cam.samples_per_pixel = 100;
-    // Set the number of times we want the casted rays to reflect on surfaces of the world
-    cam.max_depth = 50;
-
-    cam.vfov = 90;
-
-
-    cam.render(world);
+    auto s = random_sphere_cover_scene();
+    s.cam.render(s.world);
 }
 
 void checkered_spheres() {
-    hittable_list world;
-
-    auto checker = make_shared<checker_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
-
-    world.add(make_shared<sphere>(point3(0, -10, 0), 10, make_shared<lambertian>(checker)));
-    world.add(make_shared<sphere>(point3(0, 10, 0), 10, make_shared<lambertian>(checker)));
-
-    // SetV up the camera through which we view the world
-    camera cam;
-
-    // Setup camera
-    // Change the aspect ratio to something more popular
-    cam.aspect_ratio = 16.0 / 9.0;
-    // Change image's width. This will automatically also change the images height as well.
-    cam.image_width = 400;
-    // Set the number of ray samples we want to cast for each pixel to do anti-aliasing
-    cam.samples_per_pixel = 100;
-    // Set the number of times we want the casted rays to reflect on surfaces of the world
-    cam.max_depth = 50;
-
-    cam.vfov = 20;
-
-    // Move camera to the right, a bit upwards and a bit backwards
-    cam.lookfrom = point3(13, 2, 3);
-    cam.lookat = point3(0, 0, 0);
-    cam.vup = vec3(0, 1, 0);
-
-    cam.defocus_angle = 0.6;
-
-    cam.render(world);
+    auto s = checkered_spheres_scene();
+    s.cam.render(s.world);
 }
 
 void perlin_spheres() {
-    hittable_list world;
-
-    auto perlin_texture = make_shared<noise_texture>(4);
-    auto perlin_material = make_shared<lambertian>(perlin_texture);
-    auto giant_floor = make_shared<sphere>(point3(0, -1000, 0), 1000, perlin_material);
-    auto big_sphere = make_shared<sphere>(point3(0, 2, 0), 2, perlin_material);
-
-    world.add(giant_floor);
-    world.add(big_sphere);
-
-    // SetV up the camera through which we view the world
-    camera cam;
-
-    // Setup camera
-    // Change the aspect ratio to something more popular
-    cam.aspect_ratio = 16.0 / 9.0;
-    // Change image's width. This will automatically also change the images height as well.
-    cam.image_width = 400;
-    // Set the number of ray samples we want to cast for each pixel to do anti-aliasing
-    cam.samples_per_pixel = 100;
-    // Set the number of times we want the casted rays to reflect on surfaces of the world
-    cam.max_depth = 50;
-
-    cam.vfov = 20;
-    // Move camera to the right, a bit upwards and a bit backwards
-    cam.lookfrom = point3(13, 2, 3);
-    cam.lookat = point3(0, 0, 0);
-    cam.vup = vec3(0, 1, 0);
-
-    cam.defocus_angle = 0;
-
-    cam.render(world);
-
+    auto s = perlin_spheres_scene();
+    s.cam.render(s.world);
 }
 
 void earth() {
-    hittable_list world;
-    auto earth_texture = make_shared<image_texture>("earthmap.jpg");
-    auto earth_surface = make_shared<lambertian>(earth_texture);
-    auto globe = make_shared<sphere>(point3(0, 0, 4), 1, earth_surface);
-    world.add(globe);
-
-    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(2, 0, 3), 1.0, material3));
-
-    camera cam;
-
-    cam.aspect_ratio = 16.0 / 9.0;
-    cam.image_width = 400;
-    cam.samples_per_pixel = 100;
-    cam.max_depth = 50;
-
-    cam.vfov = 20;
-    cam.lookfrom = point3(0, 0, 12);
-    cam.lookat = point3(0, 0, 0);
-    cam.vup = vec3(0, 1, 0);
-
-    cam.defocus_angle = 0;
-
-    cam.render(world);
+    auto s = earth_scene();
+    s.cam.render(s.world);
 }
 
 void quads() {
-    hittable_list world;
-
-    // Materials
-    auto left_red = make_shared<lambertian>(color(1.0, 0.2, 0.2));
-    auto back_green = make_shared<lambertian>(color(0.2, 1.0, 0.2));
-    auto right_blue = make_shared<lambertian>(color(0.2, 0.2, 1.0));
-    auto upper_orange = make_shared<lambertian>(color(1.0, 0.5, 0.0));
-    auto lower_teal = make_shared<lambertian>(color(0.2, 0.8, 0.8));
-
-    // Quads
-    world.add(make_shared<quad>(point3(-3, -2, 5), vec3(0, 0, -4), vec3(0, 4, 0), left_red));
-    world.add(make_shared<quad>(point3(-2, -2, 0), vec3(4, 0, 0), vec3(0, 4, 0), back_green));
-    world.add(make_shared<quad>(point3(3, -2, 1), vec3(0, 0, 4), vec3(0, 4, 0), right_blue));
-    world.add(make_shared<quad>(point3(-2, 3, 1), vec3(4, 0, 0), vec3(0, 0, 4), upper_orange));
-    world.add(make_shared<quad>(point3(-2, -3, 5), vec3(4, 0, 0), vec3(0, 0, -4), lower_teal));
-
-    camera cam;
-
-    cam.aspect_ratio = 1;
-    cam.image_width = 400;
-    cam.samples_per_pixel = 100;
-    cam.max_depth = 50;
-
-    cam.vfov = 80;
-    cam.lookfrom = point3(0, 0, 9);
-    cam.lookat = point3(0, 0, 0);
-    cam.vup = vec3(0, 1, 0);
-
-    cam.defocus_angle = 0;
-
-    cam.render(world);
+    auto s = quads_scene();
+    s.cam.render(s.world);
 }
 
 int main() {
@@ -6,6 +6,18 @@
 
 class hit_record;
 
+// Identifies the concrete type of a material. Used to group hits by material type, such that a
+// whole group can be shaded with the same `scatter` code back to back.
+enum class material_kind {
+    generic,
+    lambertian,
+    metal,
+    dielectric,
+};
+
+// Number of values in `material_kind`
+const int material_kind_count = 4;
+
 // Abstract class that encapsulates what behaviour a material is expected to have. A material needs
 // to be able to do the following things:
 // 1. Produce a scattered ray (or say it absorved the incident ray).
@@ -20,6 +32,8 @@ class material {
         ) const {
             return false;
         }
+
+        virtual material_kind kind() const { return material_kind::generic; }
 };
 
 // Modeling light Scatter and Reflectance
@@ -38,6 +52,7 @@ class lambertian: public material {
         bool scatter(
             const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
         ) const override {
+            stats::count(stats::lambertian_scatters);
             // Direction of the scattered / reflected ray
             auto scatter_direction = rec.normal + random_unit_vector();
 
@@ -58,6 +73,8 @@ class lambertian: public material {
             return true;
         }
 
+        material_kind kind() const override { return material_kind::lambertian; }
+
     private:
         // Texture for the object
         shared_ptr<texture> tex;
@@ -74,6 +91,7 @@ class metal: public material {
         // scattered -> the reflected, scattered ray from the hit point
         bool scatter(const ray& r_in, const hit_record& hit, color& attenuation, ray& scattered)
         const override {
+            stats::count(stats::metal_scatters);
             // Compute the reflected vector
             vec3 reflected = reflect(r_in.direction(), hit.normal);
             // Normalize the reflected ray
@@ -89,8 +107,13 @@ class metal: public material {
 
             // If the length of the vector is negative, we are scaterring below the surface, and 
             // we just absord that
-            return (dot(scattered.direction(), hit.normal) > 0);
+            bool above = dot(scattered.direction(), hit.normal) > 0;
+            if (!above) stats::count(stats::absorbed_scatters);
+            return above;
         }
+
+        material_kind kind() const override { return material_kind::metal; }
+
     private:
         // See description in `material.h:lambertian` class under the same name
         color albedo;
@@ -108,6 +131,7 @@ class dielectric : public material {
 
         bool scatter(const ray& r_in, const hit_record& hit, color& attenuation, ray& scattered)
         const override {
+            stats::count(stats::dielectric_scatters);
             // We make refraction, by refracting the exact same color of light
             attenuation = color(1.0, 1.0, 1.0);
 
@@ -143,6 +167,8 @@ class dielectric : public material {
             return true;
         }
 
+        material_kind kind() const override { return material_kind::dielectric; }
+
     private:
         // Refractiove index in vacuum or air, or the ratio of the material's refractive index
         // overt the refractive index of the enclosing media (e.g. crystal ball in a glass of water)
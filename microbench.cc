@@ -0,0 +1,443 @@
+// Kernel microbenchmarks: times the small functions which dominate the profiles of our renders,
+// each one in isolation, such that a change to one of them can be measured without the noise of a
+// whole scene.
+//
+//     microbench [--filter TEXT] [--min-time SECONDS] [--hit-rate FRACTION] [--json]
+//
+// Every kernel runs over a fixed set of inputs generated up front from a fixed seed: rays against
+// boxes, spheres or quads, points for the noise, texture coordinates, vectors. Intersection inputs
+// mix hits and misses, aiming the requested fraction of the rays (`--hit-rate`, half by default)
+// at the object and the rest beside it. The measured hit rate is reported along with the timings.
+//
+// A kernel is run over all its inputs repeatedly, until the run takes at least `--min-time`. The
+// best of several such runs is reported as nanoseconds per call and millions of calls per second.
+// Inputs are small enough to stay in cache, so these are the costs of the computation itself.
+
+#include "scenes.h"
+#include "perlin.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Keeps the compiler from optimizing away a value we compute but never use
+template <typename T>
+inline void keep(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct microbench_options {
+    std::string filter;
+    double min_time = 0.2;
+    double hit_rate = 0.5;
+    bool json = false;
+};
+
+struct measurement {
+    std::string name;
+    double ns_per_op = 0;
+    // Fraction of the calls which reported a hit, negative for kernels which are not intersections
+    double hit_rate = -1;
+};
+
+// Number of inputs of every kernel
+const size_t input_count = 1024;
+
+// Times `body`, which makes `input_count` calls to the kernel per run
+measurement measure(const std::string& name, const microbench_options& options,
+        const std::function<void()>& body) {
+    using clock = std::chrono::steady_clock;
+    auto time_runs = [&](size_t runs) {
+        auto start = clock::now();
+        for (size_t n = 0; n < runs; n++) body();
+        return std::chrono::duration<double>(clock::now() - start).count();
+    };
+
+    // Find how many runs take a fifth of the minimum time, then keep the best of 5 attempts
+    size_t runs = 1;
+    while (time_runs(runs) < options.min_time / 5) runs *= 2;
+    double best = time_runs(runs);
+    for (int attempt = 1; attempt < 5; attempt++) best = std::min(best, time_runs(runs));
+
+    measurement result;
+    result.name = name;
+    result.ns_per_op = best * 1e9 / (double(runs) * input_count);
+    return result;
+}
+
+// Random inputs, generated from a fixed seed such that every run times the same work
+class input_generator {
+    public:
+        input_generator(uint64_t stream) { random.seed(0x6d6963726f, stream); }
+
+        double next() { return random.next_double(); }
+        double next(double min, double max) { return min + (max - min) * next(); }
+        vec3 next_vec3(double min, double max) {
+            auto x = next(min, max), y = next(min, max), z = next(min, max);
+            return vec3(x, y, z);
+        }
+        vec3 next_direction() {
+            auto u = next(), v = next();
+            return sample_unit_sphere(u, v);
+        }
+
+        // A ray starting a few radii away from a shape centered at `center`, of size `radius`. With
+        // probability `hit_rate` it is aimed at `target` (a point on or inside the shape), and
+        // otherwise at a point beside the shape.
+        ray next_ray(const point3& center, double radius, const point3& target, double hit_rate) {
+            auto origin = center + next(2, 6) * radius * next_direction();
+            auto aim = target;
+            if (next() >= hit_rate) {
+                auto side = cross(center - origin, next_direction());
+                aim = center + next(1.5, 3) * radius * unit_vector(side);
+            }
+            return ray(origin, aim - origin, next());
+        }
+
+    private:
+        rng random;
+};
+
+// Runs an intersection kernel over `rays[i]` against `shapes[i]`, counting the hits
+template <typename Shape, typename Ray, typename Hit>
+measurement measure_hits(const std::string& name, const microbench_options& options,
+        const std::vector<Shape>& shapes, const std::vector<Ray>& rays, Hit hit) {
+    size_t hits = 0;
+    for (size_t i = 0; i < input_count; i++) hits += hit(shapes[i], rays[i]);
+
+    auto result = measure(name, options, [&]() {
+        for (size_t i = 0; i < input_count; i++) keep(hit(shapes[i], rays[i]));
+    });
+    result.hit_rate = double(hits) / input_count;
+    return result;
+}
+
+std::vector<measurement> run_intersection_kernels(const microbench_options& options) {
+    std::vector<measurement> results;
+    auto wanted = [&](const char* name) {
+        return std::string(name).find(options.filter) != std::string::npos;
+    };
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    const interval ray_t(0.001, infinity);
+
+    if (wanted("aabb::hit")) {
+        input_generator in(1);
+        std::vector<aabb> boxes;
+        std::vector<ray> rays;
+        for (size_t i = 0; i < input_count; i++) {
+            auto center = in.next_vec3(-10, 10);
+            auto half = in.next_vec3(0.1, 1);
+            boxes.push_back(aabb(center - half, center + half));
+            auto target = center + half * in.next_vec3(-1, 1);
+            rays.push_back(in.next_ray(center, half.length(), target, options.hit_rate));
+        }
+        results.push_back(measure_hits("aabb::hit", options, boxes, rays,
+                    [&](const aabb& box, const ray& r) { return box.hit(r, ray_t); }));
+
+        // The same boxes and rays, with the inverse directions computed up front as the BVHs do
+        std::vector<traversal_ray> prepared(rays.begin(), rays.end());
+        results.push_back(measure_hits("aabb::hit traversal_ray", options, boxes, prepared,
+                    [&](const aabb& box, const traversal_ray& r) { return box.hit(r, ray_t); }));
+    }
+
+    if (wanted("sphere::hit")) {
+        input_generator in(2);
+        std::vector<sphere> spheres;
+        std::vector<ray> rays;
+        for (size_t i = 0; i < input_count; i++) {
+            auto center = in.next_vec3(-10, 10);
+            auto radius = in.next(0.1, 1);
+            spheres.push_back(sphere(center, radius, mat));
+            auto target = center + in.next(0, 0.99) * radius * in.next_direction();
+            rays.push_back(in.next_ray(center, radius, target, options.hit_rate));
+        }
+        results.push_back(measure_hits("sphere::hit", options, spheres, rays,
+                    [&](const sphere& s, const ray& r) {
+                        hit_record rec;
+                        return s.hit(r, ray_t, rec);
+                    }));
+    }
+
+    if (wanted("quad::hit")) {
+        input_generator in(3);
+        std::vector<quad> quads;
+        std::vector<ray> rays;
+        for (size_t i = 0; i < input_count; i++) {
+            auto corner = in.next_vec3(-10, 10);
+            auto u = in.next(0.2, 2) * in.next_direction();
+            auto v = in.next(0.2, 2) * unit_vector(cross(u, in.next_direction()));
+            quads.push_back(quad(corner, u, v, mat));
+            auto center = corner + 0.5 * u + 0.5 * v;
+            auto target = corner + in.next() * u + in.next() * v;
+            rays.push_back(in.next_ray(center, (u + v).length() / 2, target, options.hit_rate));
+        }
+        results.push_back(measure_hits("quad::hit", options, quads, rays,
+                    [&](const quad& q, const ray& r) {
+                        hit_record rec;
+                        return q.hit(r, ray_t, rec);
+                    }));
+    }
+
+    // BVH leaves of 4 spheres or 4 quads: each one tested in turn through its `hit`, as leaves
+    // of objects do, and all together by the leaf kernels of `primitive_store`
+    if (wanted("leaf::")) {
+        input_generator in(7);
+        std::vector<shared_ptr<hittable>> objects;
+        std::vector<ray> sphere_rays, quad_rays;
+        for (size_t i = 0; i < input_count; i++) {
+            auto center = in.next_vec3(-10, 10);
+            for (int n = 0; n < 4; n++) {
+                objects.push_back(make_shared<sphere>(center + in.next_vec3(-1, 1),
+                            in.next(0.1, 0.5), mat));
+            }
+            auto target = center + in.next_vec3(-1, 1);
+            sphere_rays.push_back(in.next_ray(center, 1.5, target, options.hit_rate));
+        }
+        for (size_t i = 0; i < input_count; i++) {
+            auto corner = in.next_vec3(-10, 10);
+            for (int n = 0; n < 4; n++) {
+                auto u = in.next(0.2, 2) * in.next_direction();
+                auto v = in.next(0.2, 2) * unit_vector(cross(u, in.next_direction()));
+                objects.push_back(make_shared<quad>(corner + in.next_vec3(-1, 1), u, v, mat));
+            }
+            auto target = corner + in.next_vec3(-1, 1);
+            quad_rays.push_back(in.next_ray(corner, 2, target, options.hit_rate));
+        }
+
+        primitive_store store;
+        store.add_all(objects, [](const shared_ptr<hittable>& o) -> const shared_ptr<hittable>& {
+            return o;
+        });
+        std::vector<uint32_t> sphere_leaves, quad_leaves;
+        for (size_t i = 0; i < input_count; i++) {
+            sphere_leaves.push_back(uint32_t(4 * i));
+            quad_leaves.push_back(uint32_t(4 * (input_count + i)));
+        }
+
+        auto run = [&](const char* name, const std::vector<uint32_t>& leaves,
+                const std::vector<ray>& rays) {
+            if (wanted((std::string(name) + " scalar").c_str())) {
+                results.push_back(measure_hits(std::string(name) + " scalar", options, leaves,
+                            rays, [&](uint32_t leaf, const ray& r) {
+                                hit_record rec;
+                                bool hit = false;
+                                double closest = ray_t.max;
+                                for (uint32_t n = leaf; n < leaf + 4; n++) {
+                                    if (objects[n]->hit(r, interval(ray_t.min, closest), rec)) {
+                                        hit = true;
+                                        closest = rec.t;
+                                    }
+                                }
+                                return hit;
+                            }));
+            }
+            if (wanted(name)) {
+                results.push_back(measure_hits(name, options, leaves, rays,
+                            [&](uint32_t leaf, const ray& r) {
+                                hit_record rec;
+                                if (!store.hit(leaf, leaf + 4, r, ray_t, nullptr, rec)) {
+                                    return false;
+                                }
+                                store.finish(r, rec);
+                                return true;
+                            }));
+            }
+        };
+        run("leaf::spheres4", sphere_leaves, sphere_rays);
+        run("leaf::quads4", quad_leaves, quad_rays);
+    }
+
+    // The same tree, as `bvh_node`s, compiled into a `linear_bvh`, and collapsed into wide trees,
+    // for closest hits and for occlusion queries
+    struct layout_entry {
+        const char* hit;
+        const char* occluded;
+        bvh_layout layout;
+    };
+    const layout_entry layouts[] = {
+        {"bvh_node::hit", "bvh_node::occluded", bvh_layout::tree},
+        {"linear_bvh::hit", "linear_bvh::occluded", bvh_layout::linear},
+        {"bvh4::hit", "bvh4::occluded", bvh_layout::bvh4},
+        {"bvh8::hit", "bvh8::occluded", bvh_layout::bvh8},
+    };
+    for (const auto& layout : layouts) {
+        if (!wanted(layout.hit) && !wanted(layout.occluded)) continue;
+
+        // The 10k sphere field of the scene benchmarks. Rays leave from just above the ground in
+        // random upward directions, like the bounces of a path, or come from the camera's spot
+        // towards the field. Whether they hit depends on the scene alone.
+        bvh_settings bvh;
+        bvh.layout = layout.layout;
+        auto field = sphere_field_scene(10000, 0, bvh);
+        input_generator in(4);
+        std::vector<ray> rays;
+        for (size_t i = 0; i < input_count; i++) {
+            auto ground = point3(in.next(-50, 50), 0.01, in.next(-50, 50));
+            if (i % 2 == 0) {
+                auto direction = in.next_direction();
+                direction[1] = std::fabs(direction[1]);
+                rays.push_back(ray(ground, direction, in.next()));
+            } else {
+                auto eye = point3(13, 2, 3) + in.next_vec3(-1, 1);
+                rays.push_back(ray(eye, ground - eye, in.next()));
+            }
+        }
+        std::vector<const hittable*> world(input_count, &field.world);
+        if (wanted(layout.hit)) {
+            results.push_back(measure_hits(layout.hit, options, world, rays,
+                        [&](const hittable* w, const ray& r) {
+                            hit_record rec;
+                            return w->hit(r, ray_t, rec);
+                        }));
+        }
+        if (wanted(layout.occluded)) {
+            results.push_back(measure_hits(layout.occluded, options, world, rays,
+                        [&](const hittable* w, const ray& r) {
+                            return w->occluded(r, ray_t);
+                        }));
+        }
+    }
+
+    return results;
+}
+
+std::vector<measurement> run_shading_kernels(const microbench_options& options) {
+    std::vector<measurement> results;
+    auto wanted = [&](const char* name) {
+        return std::string(name).find(options.filter) != std::string::npos;
+    };
+
+    std::vector<point3> points;
+    std::vector<double> us, vs;
+    input_generator in(5);
+    for (size_t i = 0; i < input_count; i++) {
+        points.push_back(in.next_vec3(-10, 10));
+        us.push_back(in.next());
+        vs.push_back(in.next());
+    }
+
+    if (wanted("perlin::noise") || wanted("perlin::turb")) {
+        perlin noise;
+        if (wanted("perlin::noise")) {
+            results.push_back(measure("perlin::noise", options, [&]() {
+                for (size_t i = 0; i < input_count; i++) keep(noise.noise(points[i]));
+            }));
+        }
+        if (wanted("perlin::turb")) {
+            results.push_back(measure("perlin::turb", options, [&]() {
+                for (size_t i = 0; i < input_count; i++) keep(noise.turb(points[i], 7));
+            }));
+        }
+    }
+
+    if (wanted("image_texture::value")) {
+        image_texture earth("earthmap.jpg");
+        results.push_back(measure("image_texture::value", options, [&]() {
+            for (size_t i = 0; i < input_count; i++) keep(earth.value(us[i], vs[i], points[i]));
+        }));
+    }
+
+    if (wanted("random_unit_vector")) {
+        thread_rng().seed(0, 0);
+        results.push_back(measure("random_unit_vector", options, [&]() {
+            for (size_t i = 0; i < input_count; i++) keep(random_unit_vector());
+        }));
+    }
+
+    return results;
+}
+
+std::vector<measurement> run_vec3_kernels(const microbench_options& options) {
+    std::vector<measurement> results;
+    auto wanted = [&](const char* name) {
+        return std::string(name).find(options.filter) != std::string::npos;
+    };
+
+    std::vector<vec3> a, b;
+    std::vector<double> s;
+    input_generator in(6);
+    for (size_t i = 0; i < input_count; i++) {
+        a.push_back(in.next_vec3(-10, 10));
+        b.push_back(in.next_vec3(-10, 10));
+        s.push_back(in.next(-2, 2));
+    }
+
+    auto run = [&](const char* name, auto kernel) {
+        if (!wanted(name)) return;
+        results.push_back(measure(name, options, [&]() {
+            for (size_t i = 0; i < input_count; i++) keep(kernel(a[i], b[i], s[i]));
+        }));
+    };
+
+    run("vec3::add", [](const vec3& x, const vec3& y, double) { return x + y; });
+    run("vec3::multiply", [](const vec3& x, const vec3& y, double) { return x * y; });
+    run("vec3::scale", [](const vec3& x, const vec3&, double t) { return t * x; });
+    run("vec3::dot", [](const vec3& x, const vec3& y, double) { return dot(x, y); });
+    run("vec3::cross", [](const vec3& x, const vec3& y, double) { return cross(x, y); });
+    run("vec3::unit_vector", [](const vec3& x, const vec3&, double) { return unit_vector(x); });
+    // The shape of `ray::at` and of most of the shading code
+    run("vec3::multiply_add", [](const vec3& x, const vec3& y, double t) { return x + t * y; });
+
+    return results;
+}
+
+void report(const std::vector<measurement>& results, const microbench_options& options) {
+    if (options.json) {
+        std::cout << std::setprecision(6) << "{\n"
+            << "  \"benchmark\": \"traceme-kernels\",\n"
+            << "  \"version\": 1,\n"
+            << "  \"kernels\": [";
+        for (size_t n = 0; n < results.size(); n++) {
+            const auto& r = results[n];
+            std::cout << (n ? ",\n" : "\n")
+                << "    {\"name\": \"" << r.name << "\", \"ns_per_op\": " << r.ns_per_op
+                << ", \"ops_per_second\": " << 1e9 / r.ns_per_op;
+            if (r.hit_rate >= 0) std::cout << ", \"hit_rate\": " << r.hit_rate;
+            std::cout << '}';
+        }
+        std::cout << "\n  ]\n}\n";
+        return;
+    }
+
+    std::cout << std::left << std::setw(24) << "kernel" << std::right << std::setw(12) << "ns/op"
+        << std::setw(12) << "Mops/s" << std::setw(10) << "hits" << '\n';
+    for (const auto& r : results) {
+        std::cout << std::left << std::setw(24) << r.name << std::right << std::fixed
+            << std::setprecision(2) << std::setw(12) << r.ns_per_op << std::setw(12)
+            << 1e3 / r.ns_per_op;
+        if (r.hit_rate >= 0) {
+            std::cout << std::setw(9) << std::setprecision(0) << 100 * r.hit_rate << '%';
+        }
+        std::cout << '\n';
+    }
+}
+
+int main(int argc, char** argv) {
+    microbench_options options;
+    for (int n = 1; n < argc; n++) {
+        std::string arg = argv[n];
+        bool has_value = n + 1 < argc;
+        if (arg == "--filter" && has_value) options.filter = argv[++n];
+        else if (arg == "--min-time" && has_value) options.min_time = std::atof(argv[++n]);
+        else if (arg == "--hit-rate" && has_value) options.hit_rate = std::atof(argv[++n]);
+        else if (arg == "--json") options.json = true;
+        else {
+            std::cerr << "usage: microbench [--filter TEXT] [--min-time SECONDS]"
+                << " [--hit-rate FRACTION] [--json]\n";
+            return 2;
+        }
+    }
+
+    std::vector<measurement> results;
+    for (auto run : {run_intersection_kernels, run_shading_kernels, run_vec3_kernels}) {
+        auto kernels = run(options);
+        results.insert(results.end(), kernels.begin(), kernels.end());
+    }
+    report(results, options);
+    return 0;
+}
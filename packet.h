@@ -0,0 +1,432 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+// Header which defines ray packets: small bundles of coherent rays (typically the camera rays of
+// neighbouring pixels) which are traced through the scene together, with the box, sphere and quad
+// tests running over all the rays of the packet at once in SIMD lanes.
+//
+// The lane kernels are written once, as plain loops over a fixed packet width, and compiled for
+// several instruction sets:
+// - 16 rays on AVX-512
+// - 8 rays on AVX2
+// - 4 rays on anything else (SSE2 on x86-64)
+// The best one the CPU supports is picked at runtime. The environment variable
+// `TRACEME_PACKET_ISA` (`avx512`, `avx2` or `generic`) forces a specific one, which is handy for
+// comparing them.
+//
+// The leaf kernels turn this around: a single ray against the spheres or the quads of a BVH leaf,
+// one primitive per lane, 8 at a time on AVX-512 and 4 on AVX2. Without wide vectors, testing the
+// primitives one by one is faster, and the leaves do that instead.
+//
+// Every kernel does exactly the same floating point operations, in the same order, as the scalar
+// code in `aabb.h`, `sphere.h` and `quad.h`. Fused multiply-adds are disabled for them, such that
+// packet tracing produces bit-identical images to the scalar path on every instruction set.
+
+#include "traceme.h"
+#include "aabb.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+// Largest number of rays in a packet
+const int max_packet_size = 16;
+
+// Largest number of primitives the leaf kernels test at once. Arrays passed to them must be
+// readable this many entries past the last primitive.
+const int max_leaf_lanes = 8;
+
+// Structure-of-arrays bundle of rays, which is the layout the SIMD lanes want
+struct ray_packet {
+    // Number of lanes in use
+    int size = 0;
+
+    alignas(64) double ox[max_packet_size];
+    alignas(64) double oy[max_packet_size];
+    alignas(64) double oz[max_packet_size];
+    alignas(64) double dx[max_packet_size];
+    alignas(64) double dy[max_packet_size];
+    alignas(64) double dz[max_packet_size];
+    alignas(64) double time[max_packet_size];
+    // Inverse of the direction, for the box tests (see `traversal_ray`)
+    alignas(64) double ix[max_packet_size];
+    alignas(64) double iy[max_packet_size];
+    alignas(64) double iz[max_packet_size];
+
+    // All the lanes look for hits after `t_min`, and before their own `t_max`, which shrinks to
+    // the closest hit found so far
+    double t_min = 0;
+    alignas(64) double t_max[max_packet_size];
+
+    // Stores ray `r` in `lane`
+    void set(int lane, const ray& r) {
+        ox[lane] = r.origin().x();
+        oy[lane] = r.origin().y();
+        oz[lane] = r.origin().z();
+        dx[lane] = r.direction().x();
+        dy[lane] = r.direction().y();
+        dz[lane] = r.direction().z();
+        time[lane] = r.time();
+        ix[lane] = 1.0 / dx[lane];
+        iy[lane] = 1.0 / dy[lane];
+        iz[lane] = 1.0 / dz[lane];
+    }
+
+    // Returns the ray in `lane`
+    ray get(int lane) const {
+        return ray(point3(ox[lane], oy[lane], oz[lane]), vec3(dx[lane], dy[lane], dz[lane]),
+                time[lane]);
+    }
+};
+
+#if defined(__GNUC__)
+#define TRACEME_ALWAYS_INLINE inline __attribute__((always_inline))
+// Options for the functions holding the lane kernels: vectorize them, keep the scalar rounding
+// (no fused multiply-add) and let `sqrt` map to the SIMD instruction.
+#define TRACEME_PACKET_OPTIONS optimize("O3", "fp-contract=off", "no-math-errno")
+#else
+#define TRACEME_ALWAYS_INLINE inline
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TRACEME_PACKET_X86
+#endif
+
+// The lane kernels, generic over the packet width `W`. Each one returns the mask of lanes (bit k
+// for lane k) out of `active` which hit.
+namespace packet_kernel {
+
+// Narrows the [lo, hi] intervals of every lane to the overlap with one slab of a bounding box.
+// Mirrors the selects of `aabb::hit`.
+template <int W>
+TRACEME_ALWAYS_INLINE void slab(const double* __restrict origin,
+        const double* __restrict inv_direction, double slab_min, double slab_max,
+        double* __restrict lo, double* __restrict hi) {
+    for (int k = 0; k < W; k++) {
+        bool negative = inv_direction[k] < 0;
+        double enter = negative ? slab_max : slab_min;
+        double leave = negative ? slab_min : slab_max;
+        double t0 = (enter - origin[k]) * inv_direction[k];
+        double t1 = (leave - origin[k]) * inv_direction[k];
+
+        lo[k] = t0 > lo[k] ? t0 : lo[k];
+        hi[k] = t1 < hi[k] ? t1 : hi[k];
+    }
+}
+
+// Turns per lane flags into a lane mask
+template <int W>
+TRACEME_ALWAYS_INLINE uint32_t to_mask(const bool* flags) {
+    uint32_t mask = 0;
+    for (int k = 0; k < W; k++) {
+        mask |= uint32_t(flags[k]) << k;
+    }
+    return mask;
+}
+
+template <int W>
+TRACEME_ALWAYS_INLINE uint32_t hit_aabb(const ray_packet& p, uint32_t active, const aabb& box) {
+    double lo[W];
+    double hi[W];
+    for (int k = 0; k < W; k++) {
+        lo[k] = p.t_min;
+        hi[k] = p.t_max[k];
+    }
+
+    slab<W>(p.ox, p.ix, box.x.min, box.x.max, lo, hi);
+    slab<W>(p.oy, p.iy, box.y.min, box.y.max, lo, hi);
+    slab<W>(p.oz, p.iz, box.z.min, box.z.max, lo, hi);
+
+    bool overlap[W];
+    for (int k = 0; k < W; k++) {
+        overlap[k] = hi[k] > lo[k];
+    }
+    return to_mask<W>(overlap) & active;
+}
+
+// Sphere with center `center + time * motion` (motion is zero for stationary spheres). Writes the
+// nearest root inside the lane's interval to `root`.
+template <int W>
+TRACEME_ALWAYS_INLINE uint32_t hit_sphere(const ray_packet& p, uint32_t active,
+        const double* center, const double* motion, double radius, double* root) {
+    bool found[W];
+    for (int k = 0; k < W; k++) {
+        double ocx = (center[0] + p.time[k] * motion[0]) - p.ox[k];
+        double ocy = (center[1] + p.time[k] * motion[1]) - p.oy[k];
+        double ocz = (center[2] + p.time[k] * motion[2]) - p.oz[k];
+
+        double a = p.dx[k] * p.dx[k] + p.dy[k] * p.dy[k] + p.dz[k] * p.dz[k];
+        double h = p.dx[k] * ocx + p.dy[k] * ocy + p.dz[k] * ocz;
+        double c = (ocx * ocx + ocy * ocy + ocz * ocz) - radius * radius;
+        double discriminant = h * h - a * c;
+
+        // Negative discriminants have no real root, they are masked out below
+        double sqrt_d = sqrt(discriminant >= 0 ? discriminant : 0);
+        double near = (h - sqrt_d) / a;
+        double far = (h + sqrt_d) / a;
+
+        bool near_inside = p.t_min < near && near < p.t_max[k];
+        bool far_inside = p.t_min < far && far < p.t_max[k];
+
+        root[k] = near_inside ? near : far;
+        found[k] = discriminant >= 0 && (near_inside || far_inside);
+    }
+    return to_mask<W>(found) & active;
+}
+
+// Plane of a quad, given by its `normal` and offset `D`. Writes the lane's `t` along with the
+// planar coordinates `alpha` and `beta` of the hit point, which decide whether the point lies
+// inside the shape.
+template <int W>
+TRACEME_ALWAYS_INLINE uint32_t hit_quad(const ray_packet& p, uint32_t active,
+        const double* normal, double D, const double* Q, const double* u, const double* v,
+        const double* w, double* t, double* alpha, double* beta) {
+    bool found[W];
+    for (int k = 0; k < W; k++) {
+        double denom = normal[0] * p.dx[k] + normal[1] * p.dy[k] + normal[2] * p.dz[k];
+        double distance = D - (normal[0] * p.ox[k] + normal[1] * p.oy[k] + normal[2] * p.oz[k]);
+        t[k] = distance / denom;
+
+        // Hit point relative to the corner of the quad
+        double qx = (p.ox[k] + t[k] * p.dx[k]) - Q[0];
+        double qy = (p.oy[k] + t[k] * p.dy[k]) - Q[1];
+        double qz = (p.oz[k] + t[k] * p.dz[k]) - Q[2];
+
+        // alpha = dot(w, cross(q, v)) and beta = dot(w, cross(u, q))
+        alpha[k] = w[0] * (qy * v[2] - qz * v[1])
+            + w[1] * (qz * v[0] - qx * v[2])
+            + w[2] * (qx * v[1] - qy * v[0]);
+        beta[k] = w[0] * (u[1] * qz - u[2] * qy)
+            + w[1] * (u[2] * qx - u[0] * qz)
+            + w[2] * (u[0] * qy - u[1] * qx);
+
+        bool parallel = (denom < 0 ? -denom : denom) < 1e-8;
+        found[k] = !parallel && p.t_min <= t[k] && t[k] <= p.t_max[k];
+    }
+    return to_mask<W>(found) & active;
+}
+
+// One ray against the spheres [0, `count`) of the arrays: centers (`x`, `y`, `z`), moving by
+// (`dx`, `dy`, `dz`) per unit of time when `Moving`, and `radius`. Returns the sphere with the
+// nearest root inside (`t_min`, `t_max`), and writes that root to `root`, or returns -1 when none
+// is hit.
+//
+// The discriminants of `W` spheres are computed at once, one per lane. Most of them are negative
+// in a leaf, so the square roots and the divisions are left to the few lanes which cross their
+// sphere, in order, as if the spheres were tested one after the other.
+template <int W, bool Moving>
+TRACEME_ALWAYS_INLINE int leaf_spheres(const double* origin, const double* direction,
+        double time, const double* x, const double* y, const double* z, const double* dx,
+        const double* dy, const double* dz, const double* radius, int count, double t_min,
+        double t_max, double& root) {
+    int nearest = -1;
+    double closest = t_max;
+    double a = direction[0] * direction[0] + direction[1] * direction[1]
+        + direction[2] * direction[2];
+
+    for (int base = 0; base < count; base += W) {
+        double h[W];
+        double discriminant[W];
+        for (int k = 0; k < W; k++) {
+            int n = base + k;
+            double ocx = (Moving ? x[n] + time * dx[n] : x[n]) - origin[0];
+            double ocy = (Moving ? y[n] + time * dy[n] : y[n]) - origin[1];
+            double ocz = (Moving ? z[n] + time * dz[n] : z[n]) - origin[2];
+
+            h[k] = direction[0] * ocx + direction[1] * ocy + direction[2] * ocz;
+            double c = (ocx * ocx + ocy * ocy + ocz * ocz) - radius[n] * radius[n];
+            discriminant[k] = h[k] * h[k] - a * c;
+        }
+
+        int lanes = count - base < W ? count - base : W;
+        for (int k = 0; k < lanes; k++) {
+            if (discriminant[k] < 0) continue;
+
+            double sqrt_d = sqrt(discriminant[k]);
+            double lane_root = (h[k] - sqrt_d) / a;
+            if (!(t_min < lane_root && lane_root < closest)) {
+                lane_root = (h[k] + sqrt_d) / a;
+                if (!(t_min < lane_root && lane_root < closest)) continue;
+            }
+            nearest = base + k;
+            closest = lane_root;
+        }
+    }
+
+    root = closest;
+    return nearest;
+}
+
+// One ray against the quads [0, `count`) of the arrays: corner `q`, sides `u` and `v`, plane
+// `normal` and offset `d`, and `w` (see `quad`), each given as its x, y and z arrays. Returns the
+// quad with the nearest hit inside [`t_min`, `t_max`] which lies inside the shape, and writes its
+// distance and planar coordinates to `t`, `alpha` and `beta`, or returns -1 when none is hit.
+// The plane hits of `W` quads are computed at once, one per lane, and then checked in order, as if
+// the quads were tested one after the other.
+template <int W>
+TRACEME_ALWAYS_INLINE int leaf_quads(const double* origin, const double* direction,
+        const double* const* q, const double* const* u, const double* const* v,
+        const double* const* normal, const double* d, const double* const* w, int count,
+        double t_min, double t_max, double& t, double& alpha, double& beta) {
+    int nearest = -1;
+    double closest = t_max;
+
+    for (int base = 0; base < count; base += W) {
+        double denom[W];
+        double lane_t[W];
+        double lane_alpha[W];
+        double lane_beta[W];
+        for (int k = 0; k < W; k++) {
+            int n = base + k;
+            denom[k] = normal[0][n] * direction[0] + normal[1][n] * direction[1]
+                + normal[2][n] * direction[2];
+            double distance = d[n]
+                - (normal[0][n] * origin[0] + normal[1][n] * origin[1] + normal[2][n] * origin[2]);
+            lane_t[k] = distance / denom[k];
+
+            double qx = (origin[0] + lane_t[k] * direction[0]) - q[0][n];
+            double qy = (origin[1] + lane_t[k] * direction[1]) - q[1][n];
+            double qz = (origin[2] + lane_t[k] * direction[2]) - q[2][n];
+
+            lane_alpha[k] = w[0][n] * (qy * v[2][n] - qz * v[1][n])
+                + w[1][n] * (qz * v[0][n] - qx * v[2][n])
+                + w[2][n] * (qx * v[1][n] - qy * v[0][n]);
+            lane_beta[k] = w[0][n] * (u[1][n] * qz - u[2][n] * qy)
+                + w[1][n] * (u[2][n] * qx - u[0][n] * qz)
+                + w[2][n] * (u[0][n] * qy - u[1][n] * qx);
+        }
+
+        int lanes = count - base < W ? count - base : W;
+        for (int k = 0; k < lanes; k++) {
+            bool parallel = (denom[k] < 0 ? -denom[k] : denom[k]) < 1e-8;
+            if (parallel || !(t_min <= lane_t[k] && lane_t[k] <= closest)) continue;
+            if (!(0 <= lane_alpha[k] && lane_alpha[k] <= 1 && 0 <= lane_beta[k]
+                        && lane_beta[k] <= 1)) {
+                continue;
+            }
+            nearest = base + k;
+            closest = lane_t[k];
+            alpha = lane_alpha[k];
+            beta = lane_beta[k];
+        }
+    }
+
+    t = closest;
+    return nearest;
+}
+
+}
+
+// The set of kernels compiled for one instruction set
+struct packet_isa {
+    const char* name;
+    // Number of rays per packet
+    int width;
+
+    uint32_t (*hit_aabb)(const ray_packet& p, uint32_t active, const aabb& box);
+    uint32_t (*hit_sphere)(const ray_packet& p, uint32_t active, const double* center,
+            const double* motion, double radius, double* root);
+    uint32_t (*hit_quad)(const ray_packet& p, uint32_t active, const double* normal, double D,
+            const double* Q, const double* u, const double* v, const double* w, double* t,
+            double* alpha, double* beta);
+
+    // Leaf kernels, one ray against several primitives. `dx` is null for stationary spheres.
+    // Null when the instruction set gains nothing from them.
+    int (*leaf_spheres)(const double* origin, const double* direction, double time,
+            const double* x, const double* y, const double* z, const double* dx,
+            const double* dy, const double* dz, const double* radius, int count, double t_min,
+            double t_max, double& root);
+    int (*leaf_quads)(const double* origin, const double* direction, const double* const* q,
+            const double* const* u, const double* const* v, const double* const* normal,
+            const double* d, const double* const* w, int count, double t_min, double t_max,
+            double& t, double& alpha, double& beta);
+};
+
+// Instantiates the kernels of width `W` as functions named `<kernel>_<suffix>`, compiled with the
+// given function attributes
+#define TRACEME_PACKET_KERNELS(suffix, W, ...) \
+    __VA_ARGS__ inline uint32_t hit_aabb_##suffix(const ray_packet& p, uint32_t active, \
+            const aabb& box) { \
+        return packet_kernel::hit_aabb<W>(p, active, box); \
+    } \
+    __VA_ARGS__ inline uint32_t hit_sphere_##suffix(const ray_packet& p, uint32_t active, \
+            const double* center, const double* motion, double radius, double* root) { \
+        return packet_kernel::hit_sphere<W>(p, active, center, motion, radius, root); \
+    } \
+    __VA_ARGS__ inline uint32_t hit_quad_##suffix(const ray_packet& p, uint32_t active, \
+            const double* normal, double D, const double* Q, const double* u, const double* v, \
+            const double* w, double* t, double* alpha, double* beta) { \
+        return packet_kernel::hit_quad<W>(p, active, normal, D, Q, u, v, w, t, alpha, beta); \
+    }
+
+// Instantiates the leaf kernels of width `L` as functions named `<kernel>_<suffix>`, compiled with
+// the given function attributes
+#define TRACEME_LEAF_KERNELS(suffix, L, ...) \
+    __VA_ARGS__ inline int leaf_spheres_##suffix(const double* origin, const double* direction, \
+            double time, const double* x, const double* y, const double* z, const double* dx, \
+            const double* dy, const double* dz, const double* radius, int count, double t_min, \
+            double t_max, double& root) { \
+        if (dx) { \
+            return packet_kernel::leaf_spheres<L, true>(origin, direction, time, x, y, z, dx, dy, \
+                    dz, radius, count, t_min, t_max, root); \
+        } \
+        return packet_kernel::leaf_spheres<L, false>(origin, direction, time, x, y, z, dx, dy, \
+                dz, radius, count, t_min, t_max, root); \
+    } \
+    __VA_ARGS__ inline int leaf_quads_##suffix(const double* origin, const double* direction, \
+            const double* const* q, const double* const* u, const double* const* v, \
+            const double* const* normal, const double* d, const double* const* w, int count, \
+            double t_min, double t_max, double& t, double& alpha, double& beta) { \
+        return packet_kernel::leaf_quads<L>(origin, direction, q, u, v, normal, d, w, count, \
+                t_min, t_max, t, alpha, beta); \
+    }
+
+#if defined(__GNUC__)
+TRACEME_PACKET_KERNELS(generic, 4, __attribute__((TRACEME_PACKET_OPTIONS)))
+#else
+TRACEME_PACKET_KERNELS(generic, 4, )
+#endif
+
+#ifdef TRACEME_PACKET_X86
+TRACEME_PACKET_KERNELS(avx2, 8, __attribute__((target("avx2"), TRACEME_PACKET_OPTIONS)))
+TRACEME_PACKET_KERNELS(avx512, 16, __attribute__((target("avx512f"), TRACEME_PACKET_OPTIONS)))
+TRACEME_LEAF_KERNELS(avx2, 4, __attribute__((target("avx2"), TRACEME_PACKET_OPTIONS)))
+TRACEME_LEAF_KERNELS(avx512, 8, __attribute__((target("avx512f"), TRACEME_PACKET_OPTIONS)))
+#endif
+
+// Picks the widest kernels the CPU can run, unless `TRACEME_PACKET_ISA` asks for specific ones
+inline packet_isa select_packet_isa() {
+    packet_isa generic = {"generic", 4, hit_aabb_generic, hit_sphere_generic, hit_quad_generic,
+        nullptr, nullptr};
+
+#ifdef TRACEME_PACKET_X86
+    packet_isa avx2 = {"avx2", 8, hit_aabb_avx2, hit_sphere_avx2, hit_quad_avx2,
+        leaf_spheres_avx2, leaf_quads_avx2};
+    packet_isa avx512 = {"avx512", 16, hit_aabb_avx512, hit_sphere_avx512, hit_quad_avx512,
+        leaf_spheres_avx512, leaf_quads_avx512};
+
+    __builtin_cpu_init();
+    bool has_avx2 = __builtin_cpu_supports("avx2");
+    bool has_avx512 = __builtin_cpu_supports("avx512f");
+
+    auto requested = getenv("TRACEME_PACKET_ISA");
+    if (requested) {
+        if (std::strcmp(requested, "generic") == 0) return generic;
+        if (std::strcmp(requested, "avx2") == 0 && has_avx2) return avx2;
+        if (std::strcmp(requested, "avx512") == 0 && has_avx512) return avx512;
+    }
+
+    if (has_avx512) return avx512;
+    if (has_avx2) return avx2;
+#endif
+
+    return generic;
+}
+
+// Returns the kernels selected for this machine. The selection happens once.
+inline const packet_isa& packet_kernels() {
+    static const packet_isa isa = select_packet_isa();
+    return isa;
+}
+
+#endif
@@ -25,7 +25,6 @@ class perlin {
 
         // Make sure we deallocate and clean everything in the destructor
         ~perlin() {
-            delete[] randfloat;
             delete[] randvec;
             delete[] perm_x;
             delete[] perm_y;
@@ -85,7 +84,6 @@ class perlin {
         // Perlin noise is repeatable
         static const int point_count = 256;
         vec3* randvec;
-        double* randfloat;
         int* perm_x;
         int* perm_y;
         int* perm_z;
@@ -0,0 +1,480 @@
+#ifndef PRIMITIVES_H
+#define PRIMITIVES_H
+
+// Header which defines the primitive store: the objects of a scene compiled into flat arrays, for
+// the leaves of the BVHs.
+//
+// In a `hittable_list`, every sphere and quad is its own object on the heap, behind a
+// `shared_ptr` and a virtual `hit`. A leaf then costs a pointer chase, a reference counted handle
+// and an indirect call per object, and a sphere takes well over a hundred bytes for the few
+// numbers its intersection reads. The store keeps spheres, moving spheres and quads in one
+// structure of arrays per type instead, and the BVH refers to them by index. A leaf is a range of
+// slots, each with a small type tag, so its intersection is a switch over contiguous data rather
+// than a virtual call per object.
+//
+// Objects the store does not know how to pack (aggregates, or shapes derived from `quad` with
+// their own interior test) keep their `shared_ptr` and are called through `hit` as before.
+
+#include "traceme.h"
+#include "hittable.h"
+#include "packet.h"
+#include "quad.h"
+#include "sphere.h"
+
+#include <cstdint>
+#include <initializer_list>
+#include <typeinfo>
+#include <unordered_map>
+#include <vector>
+
+// What a slot of the store holds
+enum class primitive_type : uint8_t {
+    sphere,
+    moving_sphere,
+    quad,
+    // Any other `hittable`, called through its virtual `hit`
+    object,
+};
+
+class primitive_store {
+    public:
+        // Appends `get(item)` for every item of `items`, in order. The arrays are sized up front,
+        // which matters for scenes of millions of objects. Each call ends the arrays with padding
+        // lanes, so a store filled over several calls has padding between the items of each.
+        template <typename Items, typename Get>
+        void add_all(const Items& items, const Get& get) {
+            size_t counts[4] = {};
+            for (const auto& item : items) counts[size_t(type_of(*get(item)))]++;
+
+            types.reserve(types.size() + items.size());
+            indices.reserve(indices.size() + items.size());
+            spheres.reserve(counts[size_t(primitive_type::sphere)] + max_leaf_lanes, false);
+            moving_spheres.reserve(counts[size_t(primitive_type::moving_sphere)] + max_leaf_lanes,
+                    true);
+            quads.reserve(counts[size_t(primitive_type::quad)] + max_leaf_lanes);
+            objects.reserve(objects.size() + counts[size_t(primitive_type::object)]);
+
+            for (const auto& item : items) add(get(item));
+
+            // The leaf kernels read whole groups of lanes, possibly past the last primitive
+            spheres.pad(false);
+            moving_spheres.pad(true);
+            quads.pad();
+        }
+
+        // Number of slots
+        size_t size() const { return types.size(); }
+
+        // Closest hit of the ray with the objects of slots [`begin`, `end`), within `ray_t`, as
+        // `hittable::hit_deferred`. A packed primitive leaves its slot in `rec.primitive`, and
+        // `owner`, the object holding the store, in `rec.surface`, which hands the record back to
+        // `finish_hit`.
+        bool hit(uint32_t begin, uint32_t end, const ray& r, const interval& ray_t,
+                const hittable* owner, hit_record& rec) const {
+            bool hit_anything = false;
+            double closest = ray_t.max;
+
+            for (uint32_t n = begin; n < end;) {
+                auto type = primitive_type(types[n]);
+                uint32_t i = indices[n];
+                uint32_t run = run_length(n, end);
+
+                interval slot_t(ray_t.min, closest);
+                bool hit_slot = false;
+                switch (type) {
+                    case primitive_type::sphere:
+                        hit_slot = hit_spheres(spheres, false, n, i, run, r, slot_t, rec);
+                        break;
+                    case primitive_type::moving_sphere:
+                        hit_slot = hit_spheres(moving_spheres, true, n, i, run, r, slot_t, rec);
+                        break;
+                    case primitive_type::quad:
+                        hit_slot = hit_quads(n, i, run, r, slot_t, rec);
+                        break;
+                    case primitive_type::object:
+                        hit_slot = objects[i]->hit_deferred(r, slot_t, rec);
+                        break;
+                }
+                if (hit_slot && type != primitive_type::object) rec.surface = owner;
+
+                if (hit_slot) {
+                    hit_anything = true;
+                    closest = rec.t;
+                }
+                n += run;
+            }
+
+            return hit_anything;
+        }
+
+        // Whether the ray hits any of the objects of slots [`begin`, `end`) within `ray_t`, as
+        // `hittable::occluded`. Runs of primitives go through the leaf kernels whole, as in
+        // `hit`, and the search stops after the first run with a hit.
+        bool occluded(uint32_t begin, uint32_t end, const ray& r, const interval& ray_t) const {
+            hit_record rec;
+            for (uint32_t n = begin; n < end;) {
+                uint32_t i = indices[n];
+                uint32_t run = run_length(n, end);
+                bool blocked = false;
+                switch (primitive_type(types[n])) {
+                    case primitive_type::sphere:
+                        blocked = hit_spheres(spheres, false, n, i, run, r, ray_t, rec);
+                        break;
+                    case primitive_type::moving_sphere:
+                        blocked = hit_spheres(moving_spheres, true, n, i, run, r, ray_t, rec);
+                        break;
+                    case primitive_type::quad:
+                        blocked = hit_quads(n, i, run, r, ray_t, rec);
+                        break;
+                    case primitive_type::object:
+                        blocked = objects[i]->occluded(r, ray_t);
+                        break;
+                }
+                if (blocked) return true;
+                n += run;
+            }
+            return false;
+        }
+
+        // Fills in the rest of `rec`, the hit of the ray `r` with the packed primitive of slot
+        // `rec.primitive`, which `hit` found
+        void finish(const ray& r, hit_record& rec) const {
+            uint32_t i = indices[rec.primitive];
+            switch (primitive_type(types[rec.primitive])) {
+                case primitive_type::sphere:
+                    sphere::set_hit_record(r, rec.t, spheres.center(i), spheres.radius[i],
+                            materials[spheres.material[i]].get(), rec);
+                    break;
+                case primitive_type::moving_sphere:
+                    sphere::set_hit_record(r, rec.t,
+                            moving_spheres.center(i) + r.time() * moving_spheres.motion(i),
+                            moving_spheres.radius[i], materials[moving_spheres.material[i]].get(),
+                            rec);
+                    break;
+                case primitive_type::quad:
+                    quad::set_hit_record(r, rec.t, r.at(rec.t), quads.normal(i),
+                            materials[quads.material[i]].get(), rec);
+                    break;
+                case primitive_type::object:
+                    // Objects point `rec.surface` at themselves
+                    break;
+            }
+        }
+
+        // Packet version of `hit` over slots [`begin`, `end`), with the contract of
+        // `hittable::hit_packet`
+        void hit_packet(uint32_t begin, uint32_t end, ray_packet& packet, uint32_t active,
+                hit_record* recs, uint32_t& hit_mask) const {
+            for (uint32_t n = begin; n < end; n++) {
+                uint32_t i = indices[n];
+                switch (primitive_type(types[n])) {
+                    case primitive_type::sphere:
+                        sphere::intersect_packet(packet, active, spheres.center(i), vec3(), false,
+                                spheres.radius[i], materials[spheres.material[i]].get(), recs,
+                                hit_mask);
+                        break;
+                    case primitive_type::moving_sphere:
+                        sphere::intersect_packet(packet, active, moving_spheres.center(i),
+                                moving_spheres.motion(i), true, moving_spheres.radius[i],
+                                materials[moving_spheres.material[i]].get(), recs, hit_mask);
+                        break;
+                    case primitive_type::quad:
+                        quad::intersect_packet(packet, active, quads.corner(i), quads.side_u(i),
+                                quads.side_v(i), quads.normal(i), quads.d[i], quads.w(i),
+                                materials[quads.material[i]].get(), recs, hit_mask,
+                                quad::in_unit_square);
+                        break;
+                    case primitive_type::object:
+                        objects[i]->hit_packet(packet, active, recs, hit_mask);
+                        break;
+                }
+            }
+        }
+
+        // Bytes taken by the store, for reporting. Objects kept whole count for their handle only.
+        size_t memory_bytes() const {
+            return types.capacity() * sizeof(uint8_t) + indices.capacity() * sizeof(uint32_t)
+                + spheres.memory_bytes() + moving_spheres.memory_bytes() + quads.memory_bytes()
+                + objects.capacity() * sizeof(shared_ptr<hittable>)
+                + materials.capacity() * sizeof(shared_ptr<material>);
+        }
+
+    private:
+        // Appends `object` as the next slot, packed into the arrays of its type when it has one
+        void add(const shared_ptr<hittable>& object) {
+            const hittable& shape = *object;
+            switch (type_of(shape)) {
+                case primitive_type::sphere: {
+                    const auto& s = static_cast<const sphere&>(shape);
+                    add_slot(primitive_type::sphere, spheres.add(s, material_id(s.mat)));
+                    break;
+                }
+                case primitive_type::moving_sphere: {
+                    const auto& s = static_cast<const sphere&>(shape);
+                    add_slot(primitive_type::moving_sphere,
+                            moving_spheres.add(s, material_id(s.mat)));
+                    break;
+                }
+                case primitive_type::quad: {
+                    const auto& q = static_cast<const quad&>(shape);
+                    add_slot(primitive_type::quad, quads.add(q, material_id(q.mat)));
+                    break;
+                }
+                case primitive_type::object:
+                    add_slot(primitive_type::object, uint32_t(objects.size()));
+                    objects.push_back(object);
+                    break;
+            }
+        }
+
+        // Spheres, one array per field. The motion arrays are only filled for moving spheres.
+        struct sphere_arrays {
+            std::vector<double> x, y, z;
+            std::vector<double> dx, dy, dz;
+            std::vector<double> radius;
+            std::vector<uint32_t> material;
+
+            uint32_t add(const sphere& s, uint32_t material_id) {
+                x.push_back(s.center1.x());
+                y.push_back(s.center1.y());
+                z.push_back(s.center1.z());
+                if (s.is_moving) {
+                    dx.push_back(s.center_vec.x());
+                    dy.push_back(s.center_vec.y());
+                    dz.push_back(s.center_vec.z());
+                }
+                radius.push_back(s.radius);
+                material.push_back(material_id);
+                return uint32_t(radius.size() - 1);
+            }
+
+            void reserve(size_t count, bool moving) {
+                for (auto* a : {&x, &y, &z, &radius}) a->reserve(a->size() + count);
+                if (moving) for (auto* a : {&dx, &dy, &dz}) a->reserve(a->size() + count);
+                material.reserve(material.size() + count);
+            }
+
+            // Appends `max_leaf_lanes` zeroed entries, which are never hit. The materials are
+            // padded too, such that every array keeps the same index for the same sphere.
+            void pad(bool moving) {
+                for (int n = 0; n < max_leaf_lanes; n++) {
+                    for (auto* a : {&x, &y, &z, &radius}) a->push_back(0);
+                    if (moving) for (auto* a : {&dx, &dy, &dz}) a->push_back(0);
+                    material.push_back(0);
+                }
+            }
+
+            point3 center(uint32_t i) const { return point3(x[i], y[i], z[i]); }
+            vec3 motion(uint32_t i) const { return vec3(dx[i], dy[i], dz[i]); }
+
+            size_t memory_bytes() const {
+                return (x.capacity() + y.capacity() + z.capacity() + dx.capacity() + dy.capacity()
+                        + dz.capacity() + radius.capacity()) * sizeof(double)
+                    + material.capacity() * sizeof(uint32_t);
+            }
+        };
+
+        // Quads, one array per coordinate of the corner, the sides, and the plane they lie in
+        struct quad_arrays {
+            std::vector<double> qx, qy, qz;
+            std::vector<double> ux, uy, uz;
+            std::vector<double> vx, vy, vz;
+            std::vector<double> nx, ny, nz;
+            std::vector<double> d;
+            std::vector<double> wx, wy, wz;
+            std::vector<uint32_t> material;
+
+            uint32_t add(const quad& q, uint32_t material_id) {
+                push(qx, qy, qz, q.Q);
+                push(ux, uy, uz, q.u);
+                push(vx, vy, vz, q.v);
+                push(nx, ny, nz, q.normal);
+                d.push_back(q.D);
+                push(wx, wy, wz, q.w);
+                material.push_back(material_id);
+                return uint32_t(d.size() - 1);
+            }
+
+            void reserve(size_t count) {
+                for (auto* a : {&qx, &qy, &qz, &ux, &uy, &uz, &vx, &vy, &vz, &nx, &ny, &nz, &d,
+                        &wx, &wy, &wz}) {
+                    a->reserve(a->size() + count);
+                }
+                material.reserve(material.size() + count);
+            }
+
+            void pad() {
+                for (int n = 0; n < max_leaf_lanes; n++) {
+                    for (auto* a : {&qx, &qy, &qz, &ux, &uy, &uz, &vx, &vy, &vz, &nx, &ny, &nz, &d,
+                            &wx, &wy, &wz}) {
+                        a->push_back(0);
+                    }
+                    material.push_back(0);
+                }
+            }
+
+            point3 corner(uint32_t i) const { return point3(qx[i], qy[i], qz[i]); }
+            vec3 side_u(uint32_t i) const { return vec3(ux[i], uy[i], uz[i]); }
+            vec3 side_v(uint32_t i) const { return vec3(vx[i], vy[i], vz[i]); }
+            vec3 normal(uint32_t i) const { return vec3(nx[i], ny[i], nz[i]); }
+            vec3 w(uint32_t i) const { return vec3(wx[i], wy[i], wz[i]); }
+
+            size_t memory_bytes() const {
+                return 16 * d.capacity() * sizeof(double) + material.capacity() * sizeof(uint32_t);
+            }
+
+            static void push(std::vector<double>& x, std::vector<double>& y,
+                    std::vector<double>& z, const vec3& value) {
+                x.push_back(value.x());
+                y.push_back(value.y());
+                z.push_back(value.z());
+            }
+        };
+
+        // Type and index into the arrays of that type, for every slot
+        std::vector<uint8_t> types;
+        std::vector<uint32_t> indices;
+
+        sphere_arrays spheres;
+        sphere_arrays moving_spheres;
+        quad_arrays quads;
+        std::vector<shared_ptr<hittable>> objects;
+
+        // Every distinct material, referred to by index from the arrays
+        std::vector<shared_ptr<material>> materials;
+        std::unordered_map<const material*, uint32_t> material_ids;
+
+        // Which arrays `object` goes into. Only the exact types are packed: a class derived from
+        // them may change how they are hit.
+        static primitive_type type_of(const hittable& object) {
+            if (typeid(object) == typeid(sphere)) {
+                return static_cast<const sphere&>(object).is_moving ? primitive_type::moving_sphere
+                    : primitive_type::sphere;
+            }
+            if (typeid(object) == typeid(quad)) return primitive_type::quad;
+            return primitive_type::object;
+        }
+
+        void add_slot(primitive_type type, uint32_t index) {
+            types.push_back(uint8_t(type));
+            indices.push_back(index);
+        }
+
+        uint32_t material_id(const shared_ptr<material>& mat) {
+            auto found = material_ids.find(mat.get());
+            if (found != material_ids.end()) return found->second;
+
+            uint32_t id = uint32_t(materials.size());
+            materials.push_back(mat);
+            material_ids.emplace(mat.get(), id);
+            return id;
+        }
+
+        // Number of slots from `n` on, up to `end`, which can be tested together. The primitives of
+        // a leaf were added one after the other, so a run of slots of the same type is a range of
+        // the arrays, which the leaf kernels take in one go.
+        uint32_t run_length(uint32_t n, uint32_t end) const {
+            if (primitive_type(types[n]) == primitive_type::object) return 1;
+            uint32_t run = 1;
+            while (n + run < end && types[n + run] == types[n]
+                    && indices[n + run] == indices[n] + run) {
+                run++;
+            }
+            return run;
+        }
+
+        // Closest hit of the ray with the `count` spheres of `s` from `i` on, which fill the slots
+        // from `slot` on. Several spheres go through the leaf kernel, when the instruction set has
+        // one.
+        bool hit_spheres(const sphere_arrays& s, bool moving, uint32_t slot, uint32_t i,
+                uint32_t count, const ray& r, const interval& ray_t, hit_record& rec) const {
+            double root;
+            uint32_t hit;
+            if (count == 1 || !packet_kernels().leaf_spheres) {
+                bool found = false;
+                double closest = ray_t.max;
+                for (uint32_t n = i; n < i + count; n++) {
+                    point3 center = moving ? s.center(n) + r.time() * s.motion(n) : s.center(n);
+                    if (sphere::intersect(r, center, s.radius[n], interval(ray_t.min, closest),
+                                root)) {
+                        found = true;
+                        closest = root;
+                        hit = n;
+                    }
+                }
+                if (!found) return false;
+                root = closest;
+            } else {
+                const double origin[3] = {r.origin()[0], r.origin()[1], r.origin()[2]};
+                const double direction[3] = {r.direction()[0], r.direction()[1],
+                    r.direction()[2]};
+                int lane = packet_kernels().leaf_spheres(origin, direction, r.time(),
+                        s.x.data() + i, s.y.data() + i, s.z.data() + i,
+                        moving ? s.dx.data() + i : nullptr, moving ? s.dy.data() + i : nullptr,
+                        moving ? s.dz.data() + i : nullptr, s.radius.data() + i, int(count),
+                        ray_t.min, ray_t.max, root);
+                stats::count(stats::sphere_tests, count);
+                if (lane < 0) return false;
+                stats::count(stats::sphere_hits);
+                hit = i + uint32_t(lane);
+            }
+
+            rec.t = root;
+            rec.primitive = slot + (hit - i);
+            return true;
+        }
+
+        // Closest hit of the ray with the `count` quads from `i` on, as `hit_spheres`
+        bool hit_quads(uint32_t slot, uint32_t i, uint32_t count, const ray& r,
+                const interval& ray_t, hit_record& rec) const {
+            double t;
+            uint32_t hit;
+            if (count == 1 || !packet_kernels().leaf_quads) {
+                bool found = false;
+                double closest = ray_t.max;
+                for (uint32_t n = i; n < i + count; n++) {
+                    double plane_t, alpha, beta;
+                    point3 intersection;
+                    if (quad::hit_plane(r, interval(ray_t.min, closest), quads.corner(n),
+                                quads.side_u(n), quads.side_v(n), quads.normal(n), quads.d[n],
+                                quads.w(n), plane_t, intersection, alpha, beta)
+                            && quad::in_unit_square(alpha, beta, rec)) {
+                        found = true;
+                        closest = plane_t;
+                        hit = n;
+                    }
+                }
+                if (!found) return false;
+                t = closest;
+            } else {
+                double alpha, beta;
+                const double origin[3] = {r.origin()[0], r.origin()[1], r.origin()[2]};
+                const double direction[3] = {r.direction()[0], r.direction()[1],
+                    r.direction()[2]};
+                const double* q[3] = {quads.qx.data() + i, quads.qy.data() + i,
+                    quads.qz.data() + i};
+                const double* u[3] = {quads.ux.data() + i, quads.uy.data() + i,
+                    quads.uz.data() + i};
+                const double* v[3] = {quads.vx.data() + i, quads.vy.data() + i,
+                    quads.vz.data() + i};
+                const double* n[3] = {quads.nx.data() + i, quads.ny.data() + i,
+                    quads.nz.data() + i};
+                const double* w[3] = {quads.wx.data() + i, quads.wy.data() + i,
+                    quads.wz.data() + i};
+                int lane = packet_kernels().leaf_quads(origin, direction, q, u, v, n,
+                        quads.d.data() + i, w, int(count), ray_t.min, ray_t.max, t, alpha, beta);
+                stats::count(stats::quad_tests, count);
+                if (lane < 0) return false;
+                hit = i + uint32_t(lane);
+                rec.u = alpha;
+                rec.v = beta;
+            }
+
+            stats::count(stats::quad_hits);
+            rec.t = t;
+            rec.primitive = slot + (hit - i);
+            return true;
+        }
+};
+
+#endif
@@ -27,47 +27,87 @@ class quad: public hittable {
             // Compute the bounding box of all four vertices;
             auto bbox_diagonal1 = aabb(Q, Q + u + v);
             auto bbox_diagonal2 = aabb(Q + u, Q + v);
+            auto box = aabb(bbox_diagonal1, bbox_diagonal2);
 
-            bbox = aabb(bbox_diagonal1, bbox_diagonal2);
+            // A quad lying in an axis plane has a flat box, which the slab test never reports as
+            // hit. The interval constructor pads it.
+            bbox = aabb(box.x, box.y, box.z);
         }
 
         aabb bounding_box() const override { return bbox; }
 
         bool hit(const ray& r, const interval& ray_t_interval, hit_record& rec) const override {
-            // Compute denominator
-            auto denom = dot(normal, r.direction());
-
-            // No hit is the ray is parallel to the plane
-            if (fabs(denom) < 1e-8) {
+            double t, alpha, beta;
+            point3 intersection;
+            if (!hit_plane(r, ray_t_interval, Q, u, v, normal, D, w, t, intersection, alpha, beta))
                 return false;
-            }
 
-            // Return false if the hit point parameter t is outside the ray interval.
-            auto t = (D - dot(normal, r.origin())) / denom;
-            if (!ray_t_interval.contains(t)) return false;
+            if (!is_interior(alpha, beta, rec))
+                return false;
 
-            // Determine if the hit point lies withing the planar shape using its plane coordinates.
-            auto intersection = r.at(t);
+            // Ray hits the 2D shape; set the rest of the hit record and return true.
+            stats::count(stats::quad_hits);
+            set_hit_record(r, t, intersection, normal, mat.get(), rec);
+            return true;
+        }
 
-            vec3 planar_hitpt_vector = intersection - Q;
-            auto alpha = dot(w, cross(planar_hitpt_vector, v));
-            auto beta = dot(w, cross(u, planar_hitpt_vector));
+        // The texture coordinates come with the interior test, only the hit point and the normal
+        // are left to `finish_hit`
+        bool hit_deferred(const ray& r, const interval& ray_t_interval,
+                hit_record& rec) const override {
+            double t, alpha, beta;
+            point3 intersection;
+            if (!hit_plane(r, ray_t_interval, Q, u, v, normal, D, w, t, intersection, alpha, beta))
+                return false;
 
             if (!is_interior(alpha, beta, rec))
                 return false;
 
-            // Ray hits the 2D shape; set the rest of the hit record and return true.
+            stats::count(stats::quad_hits);
             rec.t = t;
-            rec.p = intersection;
-            rec.mat = mat;
-            rec.set_face_normal(r, normal);
+            rec.surface = this;
+            return true;
+        }
 
+        bool occluded(const ray& r, const interval& ray_t_interval) const override {
+            double t, alpha, beta;
+            point3 intersection;
+            if (!hit_plane(r, ray_t_interval, Q, u, v, normal, D, w, t, intersection, alpha, beta))
+                return false;
+
+            // Derived shapes may only tell their interior apart through a record
+            hit_record rec;
+            if (!is_interior(alpha, beta, rec))
+                return false;
+
+            stats::count(stats::quad_hits);
             return true;
         }
 
+        void finish_hit(const ray& r, hit_record& rec) const override {
+            set_hit_record(r, rec.t, r.at(rec.t), normal, mat.get(), rec);
+        }
+
+        // Tests all the active lanes of the packet against the plane of the quad at once. Whether a
+        // plane hit lies inside the shape is then left to `is_interior`, lane by lane, such that
+        // derived shapes keep working unchanged.
+        void hit_packet(ray_packet& packet, uint32_t active, hit_record* recs,
+                uint32_t& hit_mask) const override {
+            intersect_packet(packet, active, Q, u, v, normal, D, w, mat.get(), recs, hit_mask,
+                    [this](double a, double b, hit_record& rec) {
+                        return is_interior(a, b, rec);
+                    });
+        }
+
         // Computes whether or not the point defined by `a` and `b` on the plane is contained
         // inside the unit interval
         virtual bool is_interior(double a, double b, hit_record& rec) const {
+            return in_unit_square(a, b, rec);
+        }
+
+        // Interior test of the quad itself: the point lies within the parallelogram spanned by
+        // `u` and `v` when both of its plane coordinates are within [0, 1]
+        static bool in_unit_square(double a, double b, hit_record& rec) {
             interval unit_interval = interval(0, 1);
 
             if (!unit_interval.contains(a) || !unit_interval.contains(b))
@@ -79,7 +119,81 @@ class quad: public hittable {
             return true;
         }
 
+        // Finds where the ray `r` crosses the plane of the quad with corner `Q` and sides `u` and
+        // `v`, within `ray_t_interval`: at distance `t`, at point `intersection`, with plane
+        // coordinates `alpha` and `beta`. Shared with the packed quads of `primitive_store`.
+        static bool hit_plane(const ray& r, const interval& ray_t_interval, const point3& Q,
+                const vec3& u, const vec3& v, const vec3& normal, double D, const vec3& w,
+                double& t, point3& intersection, double& alpha, double& beta) {
+            stats::count(stats::quad_tests);
+            // Compute denominator
+            auto denom = dot(normal, r.direction());
+
+            // No hit is the ray is parallel to the plane
+            if (fabs(denom) < 1e-8) {
+                return false;
+            }
+
+            // Return false if the hit point parameter t is outside the ray interval.
+            t = (D - dot(normal, r.origin())) / denom;
+            if (!ray_t_interval.contains(t)) return false;
+
+            // Determine if the hit point lies withing the planar shape using its plane coordinates.
+            intersection = r.at(t);
+
+            vec3 planar_hitpt_vector = intersection - Q;
+            alpha = dot(w, cross(planar_hitpt_vector, v));
+            beta = dot(w, cross(u, planar_hitpt_vector));
+            return true;
+        }
+
+        // Fills in the hit record for the ray `r` hitting the quad at `t`, once `is_interior` set
+        // the texture coordinates
+        static void set_hit_record(const ray& r, double t, const point3& intersection,
+                const vec3& normal, const material* mat, hit_record& rec) {
+            rec.t = t;
+            rec.p = intersection;
+            rec.mat = mat;
+            rec.set_face_normal(r, normal);
+        }
+
+        // Packet version of `hit_plane` and `set_hit_record`, with `is_interior(a, b, rec)`
+        // deciding which plane hits lie inside the shape
+        template <typename Interior>
+        static void intersect_packet(ray_packet& packet, uint32_t active, const point3& Q,
+                const vec3& u, const vec3& v, const vec3& normal, double D, const vec3& w,
+                const material* mat, hit_record* recs, uint32_t& hit_mask,
+                const Interior& is_interior) {
+            const double n[3] = {normal[0], normal[1], normal[2]};
+            const double q[3] = {Q[0], Q[1], Q[2]};
+            const double du[3] = {u[0], u[1], u[2]};
+            const double dv[3] = {v[0], v[1], v[2]};
+            const double dw[3] = {w[0], w[1], w[2]};
+            double t[max_packet_size];
+            double alpha[max_packet_size];
+            double beta[max_packet_size];
+
+            uint32_t candidates = packet_kernels().hit_quad(packet, active, n, D, q, du, dv, dw,
+                    t, alpha, beta);
+            stats::count(stats::quad_tests, __builtin_popcount(active));
+
+            for (int k = 0; k < packet.size; k++) {
+                if (!(candidates & (1u << k))) continue;
+                if (!is_interior(alpha[k], beta[k], recs[k])) continue;
+                stats::count(stats::quad_hits);
+
+                ray r = packet.get(k);
+                set_hit_record(r, t[k], r.at(t[k]), normal, mat, recs[k]);
+
+                packet.t_max[k] = t[k];
+                hit_mask |= 1u << k;
+            }
+        }
+
     private:
+        // Packs the quad into its arrays
+        friend class primitive_store;
+
         // Original edge / corner
         point3 Q;
         // Vectors for the 2 sides starting from the origin
@@ -0,0 +1,124 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+// Header which defines the pseudo random number generators used across the ray tracer.
+//
+// Every thread owns its own generator, so threads never share (or fight over) random state. The
+// camera re-seeds the generator of the rendering thread before every sample with a stream derived
+// from (seed, frame, pixel, sample). This makes the random numbers a sample sees depend only on
+// which sample it is, and not on which thread renders it or in what order, such that the output
+// is bit-identical for a given seed, regardless of the thread count.
+//
+// The generator is chosen at compile time. xoshiro256+ is the default, defining
+// `TRACEME_RNG_PCG32` switches to PCG32.
+
+#include <cstdint>
+
+// SplitMix64 step. Advances `state` and returns a well mixed 64 bit value. Mostly used to expand
+// a single seed into the larger state of other generators.
+inline uint64_t splitmix64(uint64_t& state) {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Hashes 2 values into one, such that nearby inputs produce unrelated outputs
+inline uint64_t hash_combine(uint64_t a, uint64_t b) {
+    uint64_t state = a ^ (b * 0xff51afd7ed558ccdull);
+    return splitmix64(state);
+}
+
+// xoshiro256+ by Blackman and Vigna. Very fast, with 256 bits of state. Its lowest bits are weak,
+// which does not matter to us since we only use the upper 53 bits to build doubles.
+class xoshiro256plus {
+    public:
+        xoshiro256plus() { seed(0, 0); }
+
+        // Initializes the generator to the sequence identified by `seed` and `stream`
+        void seed(uint64_t seed, uint64_t stream) {
+            uint64_t state = hash_combine(seed, stream);
+            for (int i = 0; i < 4; i++) {
+                s[i] = splitmix64(state);
+            }
+        }
+
+        uint64_t next_u64() {
+            const uint64_t result = s[0] + s[3];
+            const uint64_t t = s[1] << 17;
+
+            s[2] ^= s[0];
+            s[3] ^= s[1];
+            s[1] ^= s[2];
+            s[0] ^= s[3];
+            s[2] ^= t;
+            s[3] = rotl(s[3], 45);
+
+            return result;
+        }
+
+        // Returns a double in [0, 1) with the full 53 bits of mantissa randomized
+        double next_double() {
+            return (next_u64() >> 11) * 0x1.0p-53;
+        }
+
+    private:
+        uint64_t s[4];
+
+        static uint64_t rotl(uint64_t x, int k) {
+            return (x << k) | (x >> (64 - k));
+        }
+};
+
+// PCG32 (XSH RR variant) by O'Neill. Smaller state than xoshiro and supports 2^63 distinct
+// streams natively, but yields only 32 random bits per step.
+class pcg32 {
+    public:
+        pcg32() { seed(0, 0); }
+
+        // Initializes the generator to the sequence identified by `seed` and `stream`
+        void seed(uint64_t seed, uint64_t stream) {
+            state = 0;
+            inc = (stream << 1) | 1;
+            next_u32();
+            state += seed;
+            next_u32();
+        }
+
+        uint32_t next_u32() {
+            uint64_t old_state = state;
+            state = old_state * 6364136223846793005ull + inc;
+            uint32_t xor_shifted = uint32_t(((old_state >> 18) ^ old_state) >> 27);
+            uint32_t rot = uint32_t(old_state >> 59);
+            return (xor_shifted >> rot) | (xor_shifted << ((-rot) & 31));
+        }
+
+        // Returns a double in [0, 1) with 32 random bits
+        double next_double() {
+            return next_u32() * 0x1.0p-32;
+        }
+
+    private:
+        uint64_t state;
+        uint64_t inc;
+};
+
+#ifdef TRACEME_RNG_PCG32
+using rng = pcg32;
+#else
+using rng = xoshiro256plus;
+#endif
+
+// Returns the generator owned by the calling thread
+inline rng& thread_rng() {
+    thread_local rng generator;
+    return generator;
+}
+
+// Seeds the calling thread's generator with the stream of a single camera sample. The stream only
+// depends on its arguments, which is what makes renders reproducible across thread counts.
+inline void seed_sample_stream(uint64_t seed, uint64_t frame, uint64_t pixel, uint64_t sample) {
+    thread_rng().seed(hash_combine(seed, frame), hash_combine(pixel, sample));
+}
+
+#endif
@@ -46,4 +46,28 @@ class ray {
         double tm;
 };
 
+// A ray made ready to be tested against many boxes, as the BVHs do. The inverse of the direction,
+// and the side of each slab the ray enters a box through, only depend on the ray, so they are
+// computed once per traversal rather than once per box.
+class traversal_ray {
+    public:
+        // Origin of the ray
+        double origin[3];
+        // Inverse of the direction. A zero component becomes an infinity, with the sign of the
+        // zero.
+        double inv_direction[3];
+        // 1 along the axes the ray goes towards decreasing coordinates, 0 otherwise. A box is
+        // entered through its maximum plane along those axes, through its minimum plane along the
+        // others. Taken from the sign of the inverse, such that -0 counts as negative.
+        int sign[3];
+
+        traversal_ray(const ray& r) {
+            for (int axis = 0; axis < 3; axis++) {
+                origin[axis] = r.origin()[axis];
+                inv_direction[axis] = 1.0 / r.direction()[axis];
+                sign[axis] = inv_direction[axis] < 0;
+            }
+        }
+};
+
 #endif
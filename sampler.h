@@ -0,0 +1,428 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+// Header which defines the samplers: the source of the numbers the camera uses to place its
+// samples inside a pixel, on the lens and in time.
+//
+// Independent random numbers clump together and leave gaps, so a pixel needs many samples before
+// its estimate settles. The other samplers spread the samples of a pixel evenly over each
+// dimension, which gets to the same error with a fraction of the samples:
+// - `stratified` splits each dimension into one cell per sample and jitters a sample inside each
+//   cell.
+// - `sobol` uses the Sobol sequence, with Owen scrambling, which stays well distributed for any
+//   number of samples (stratified needs to know the count up front), and in 2D at once.
+// - `blue_noise` gives every pixel the same low discrepancy sequence, shifted by a blue noise
+//   mask. The error left in the image then looks like fine grained, high frequency noise rather
+//   than blotches, which the eye barely notices at a given error.
+//
+// Samplers do not keep any state between calls: a value only depends on the pixel, the sample
+// index and the dimension. The same sampler is shared by all the rendering threads, and images
+// stay reproducible no matter which thread renders which sample.
+
+#include "traceme.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// The samplers the camera can use
+enum class sampler_type {
+    // Independent random numbers, from the thread's generator
+    independent,
+    stratified,
+    sobol,
+    blue_noise,
+};
+
+// Helpers shared by the samplers
+namespace sampling {
+
+// Hashes the coordinates of a value into a 64 bit seed
+inline uint64_t hash(uint64_t a, uint64_t b, uint64_t c) {
+    return hash_combine(hash_combine(a, b), c);
+}
+
+// Maps a hash to a double in [0, 1)
+inline double to_unit(uint64_t h) {
+    return (h >> 11) * 0x1.0p-53;
+}
+
+// Maps 32 bits of fixed point fraction to a double in [0, 1)
+inline double to_unit(uint32_t x) {
+    return x * 0x1.0p-32;
+}
+
+inline uint32_t reverse_bits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// Shuffles the numbers [0, count) with the permutation picked by `seed`, and returns where `i`
+// ends up. Hash based (Kensler, "Correlated Multi-Jittered Sampling"), so there is no table to
+// build: values outside of [0, count) are hashed again until they fall inside.
+inline uint32_t permute(uint32_t i, uint32_t count, uint32_t seed) {
+    uint32_t w = count - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= seed;
+        i *= 0xe170893du;
+        i ^= seed >> 16;
+        i ^= (i & w) >> 4;
+        i ^= seed >> 8;
+        i *= 0x0929eb3fu;
+        i ^= seed >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | seed >> 27;
+        i *= 0x6935fa69u;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303u;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3u;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3dfu;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= count);
+    return (i + seed) % count;
+}
+
+// First two dimensions of the Sobol sequence, as 32 bit fractions. The first one is the van der
+// Corput sequence (the bits of the index mirrored around the binary point).
+inline uint32_t sobol_0(uint32_t index) {
+    return reverse_bits(index);
+}
+
+inline uint32_t sobol_1(uint32_t index) {
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+        if (index & 1) result ^= v;
+    }
+    return result;
+}
+
+// Owen scrambling of a 32 bit fraction: every bit gets flipped depending on the bits above it.
+// The scrambled points keep the stratification of the Sobol points, but different seeds give
+// independent, decorrelated sets of points. Hash based, after Burley, "Practical Hash-based Owen
+// Scrambling".
+inline uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    // Laine-Karras permutation, where each bit only affects the bits above it
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+// Blue noise mask: a `size` x `size` tile of values in (0, 1), uniformly distributed, where
+// nearby pixels have values as different as possible. It tiles seamlessly.
+class blue_noise_mask {
+    public:
+        static const int size = 64;
+
+        // Returns the value of pixel (x, y), wrapping around the tile
+        double get(int x, int y) const {
+            x &= size - 1;
+            y &= size - 1;
+            return values[y * size + x];
+        }
+
+        // Returns the mask, which is built on first use
+        static const blue_noise_mask& instance() {
+            static const blue_noise_mask mask;
+            return mask;
+        }
+
+    private:
+        std::vector<double> values;
+
+        // Builds the mask with Ulichney's void-and-cluster method. Each pixel of a binary pattern
+        // gets an energy, which is the Gaussian weighted count of the set pixels around it. The
+        // set pixel with the highest energy sits in the tightest cluster, the empty one with the
+        // lowest energy in the largest void. Pixels get their rank in the order they are added to
+        // the pattern by always filling the largest void, such that every prefix of the ranks is
+        // an evenly spread pattern. The value of a pixel is its rank.
+        blue_noise_mask() : values(size * size) {
+            const int count = size * size;
+            const double sigma = 1.5;
+
+            // Gaussian weight of every (wrapped) offset
+            std::vector<double> weight(count);
+            for (int dy = 0; dy < size; dy++) {
+                for (int dx = 0; dx < size; dx++) {
+                    int wx = dx < size / 2 ? dx : size - dx;
+                    int wy = dy < size / 2 ? dy : size - dy;
+                    weight[dy * size + dx] = std::exp(-(wx * wx + wy * wy) / (2 * sigma * sigma));
+                }
+            }
+
+            std::vector<char> pattern(count, 0);
+            std::vector<double> energy(count, 0.0);
+
+            auto update = [&](int p, double sign) {
+                int px = p % size;
+                int py = p / size;
+                for (int y = 0; y < size; y++) {
+                    for (int x = 0; x < size; x++) {
+                        int dx = (x - px) & (size - 1);
+                        int dy = (y - py) & (size - 1);
+                        energy[y * size + x] += sign * weight[dy * size + dx];
+                    }
+                }
+            };
+            auto tightest_cluster = [&]() {
+                int best = -1;
+                for (int p = 0; p < count; p++) {
+                    if (pattern[p] && (best < 0 || energy[p] > energy[best])) best = p;
+                }
+                return best;
+            };
+            auto largest_void = [&]() {
+                int best = -1;
+                for (int p = 0; p < count; p++) {
+                    if (!pattern[p] && (best < 0 || energy[p] < energy[best])) best = p;
+                }
+                return best;
+            };
+
+            // Start with a tenth of the pixels set at random, with a fixed seed such that the
+            // mask is the same on every run
+            rng random;
+            random.seed(0x626c7565, 0);
+            int initial = count / 10;
+            for (int placed = 0; placed < initial;) {
+                int p = int(random.next_double() * count);
+                if (pattern[p]) continue;
+                pattern[p] = 1;
+                update(p, 1);
+                placed++;
+            }
+
+            // Spread the initial pattern out, by moving the pixel of the tightest cluster to the
+            // largest void, until that would put it back where it was
+            while (true) {
+                int cluster = tightest_cluster();
+                pattern[cluster] = 0;
+                update(cluster, -1);
+                int hole = largest_void();
+                if (hole == cluster) {
+                    pattern[cluster] = 1;
+                    update(cluster, 1);
+                    break;
+                }
+                pattern[hole] = 1;
+                update(hole, 1);
+            }
+
+            // The pixels of the initial pattern are ranked by removing them, tightest cluster
+            // first, from a copy of the pattern
+            std::vector<int> rank(count, 0);
+            auto initial_pattern = pattern;
+            auto initial_energy = energy;
+            for (int r = initial - 1; r >= 0; r--) {
+                int cluster = tightest_cluster();
+                pattern[cluster] = 0;
+                update(cluster, -1);
+                rank[cluster] = r;
+            }
+
+            // The remaining pixels are ranked in the order they fill the largest void
+            pattern = initial_pattern;
+            energy = initial_energy;
+            for (int r = initial; r < count; r++) {
+                int hole = largest_void();
+                pattern[hole] = 1;
+                update(hole, 1);
+                rank[hole] = r;
+            }
+
+            for (int p = 0; p < count; p++) {
+                values[p] = (rank[p] + 0.5) / count;
+            }
+        }
+};
+
+}
+
+// Source of the sample positions in the pixel, lens and time dimensions. Samples are identified
+// by the pixel (x, y) they belong to, and their `index` among the samples of that pixel. Every
+// sample has several dimensions, each one an independent number in [0, 1), or pair of numbers
+// for the 2D dimensions.
+class sampler {
+    public:
+        virtual ~sampler() = default;
+
+        // Returns the 1D `dimension` of the sample
+        virtual double get_1d(int x, int y, int index, int dimension) const = 0;
+
+        // Returns the 2D `dimension` of the sample, as the x and y components of the vector
+        virtual vec3 get_2d(int x, int y, int index, int dimension) const = 0;
+};
+
+// Independent uniform random numbers, drawn from the calling thread's generator
+class independent_sampler: public sampler {
+    public:
+        double get_1d(int, int, int, int) const override {
+            return random_double();
+        }
+
+        vec3 get_2d(int, int, int, int) const override {
+            auto x = random_double();
+            auto y = random_double();
+            return vec3(x, y, 0);
+        }
+};
+
+// Jittered strata. Each dimension of a pixel is split in `samples_per_pixel` cells (a grid of
+// about sqrt(samples_per_pixel) x sqrt(samples_per_pixel) cells in 2D), and every sample lands
+// at a random spot in its own cell. Which sample gets which cell is shuffled differently for
+// every pixel and dimension, otherwise the dimensions would be correlated (e.g. the samples at the
+// left of the pixel would all go through the left of the lens). Samples past
+// `samples_per_pixel` (adaptive sampling asks for more) start another round of cells.
+class stratified_sampler: public sampler {
+    public:
+        stratified_sampler(int samples_per_pixel, uint64_t seed)
+            : cells(samples_per_pixel < 1 ? 1 : uint32_t(samples_per_pixel)), seed(seed)
+        {
+            grid_x = uint32_t(sqrt(double(cells)));
+            grid_x = grid_x < 1 ? 1 : grid_x;
+            grid_y = cells / grid_x;
+        }
+
+        double get_1d(int x, int y, int index, int dimension) const override {
+            uint64_t h = pixel_hash(x, y, index / cells, dimension);
+            uint32_t cell = sampling::permute(uint32_t(index) % cells, cells, uint32_t(h));
+            return (cell + sampling::to_unit(hash_combine(h, index))) / cells;
+        }
+
+        vec3 get_2d(int x, int y, int index, int dimension) const override {
+            uint32_t grid_cells = grid_x * grid_y;
+            uint64_t h = pixel_hash(x, y, index / grid_cells, dimension);
+            uint32_t cell = sampling::permute(uint32_t(index) % grid_cells, grid_cells,
+                    uint32_t(h));
+            uint64_t jitter = hash_combine(h, index);
+            return vec3(
+                (cell % grid_x + sampling::to_unit(jitter)) / grid_x,
+                (cell / grid_x + sampling::to_unit(hash_combine(jitter, 1))) / grid_y,
+                0);
+        }
+
+    private:
+        uint32_t cells;
+        uint32_t grid_x, grid_y;
+        uint64_t seed;
+
+        uint64_t pixel_hash(int x, int y, int round, int dimension) const {
+            return sampling::hash(seed, (uint64_t(uint32_t(y)) << 32) | uint32_t(x),
+                    (uint64_t(uint32_t(round)) << 32) | uint32_t(dimension));
+        }
+};
+
+// Owen scrambled Sobol points. Every dimension of every pixel uses its own scrambling of the
+// first 2 dimensions of the Sobol sequence (the higher dimensions of Sobol are of much lower
+// quality), and the order of the samples is shuffled as well (with another Owen scrambling of the
+// index), such that the dimensions do not correlate with each other.
+class sobol_sampler: public sampler {
+    public:
+        sobol_sampler(uint64_t seed) : seed(seed) {}
+
+        double get_1d(int x, int y, int index, int dimension) const override {
+            uint64_t h = pixel_hash(x, y, dimension);
+            uint32_t i = shuffle(index, h);
+            return sampling::to_unit(sampling::owen_scramble(sampling::sobol_0(i),
+                        uint32_t(h >> 32)));
+        }
+
+        vec3 get_2d(int x, int y, int index, int dimension) const override {
+            uint64_t h = pixel_hash(x, y, dimension);
+            uint32_t i = shuffle(index, h);
+            uint64_t scramble = hash_combine(h, 1);
+            return vec3(
+                sampling::to_unit(sampling::owen_scramble(sampling::sobol_0(i),
+                        uint32_t(scramble))),
+                sampling::to_unit(sampling::owen_scramble(sampling::sobol_1(i),
+                        uint32_t(scramble >> 32))),
+                0);
+        }
+
+    private:
+        uint64_t seed;
+
+        uint64_t pixel_hash(int x, int y, int dimension) const {
+            return sampling::hash(seed, (uint64_t(uint32_t(y)) << 32) | uint32_t(x),
+                    uint64_t(dimension));
+        }
+
+        // Owen scrambling the bits of the index permutes the samples while keeping any power of 2
+        // prefix of them a valid Sobol point set
+        static uint32_t shuffle(int index, uint64_t h) {
+            return sampling::owen_scramble(uint32_t(index), uint32_t(h));
+        }
+};
+
+// Blue noise dithered samples. All the pixels use the same (unscrambled) Sobol points, each one
+// shifted (modulo 1) by the blue noise mask value of the pixel, with the mask offset differently
+// for every dimension. Neighbouring pixels end up with shifts far apart, which turns the error
+// of neighbouring pixels from correlated blotches into a fine, high frequency pattern.
+class blue_noise_sampler: public sampler {
+    public:
+        blue_noise_sampler(uint64_t seed)
+            : seed(seed), mask(sampling::blue_noise_mask::instance())
+        {}
+
+        double get_1d(int x, int y, int index, int dimension) const override {
+            return shift(sampling::to_unit(sampling::sobol_0(uint32_t(index))),
+                    mask_value(x, y, dimension, 0));
+        }
+
+        vec3 get_2d(int x, int y, int index, int dimension) const override {
+            return vec3(
+                shift(sampling::to_unit(sampling::sobol_0(uint32_t(index))),
+                    mask_value(x, y, dimension, 0)),
+                shift(sampling::to_unit(sampling::sobol_1(uint32_t(index))),
+                    mask_value(x, y, dimension, 1)),
+                0);
+        }
+
+    private:
+        uint64_t seed;
+        const sampling::blue_noise_mask& mask;
+
+        // Looks the pixel up in the mask, at an offset picked by the dimension (and component),
+        // such that the shifts of different dimensions are unrelated
+        double mask_value(int x, int y, int dimension, int component) const {
+            uint64_t h = sampling::hash(seed, uint64_t(dimension), uint64_t(component));
+            return mask.get(x + int(h & 0xffff), y + int((h >> 16) & 0xffff));
+        }
+
+        // Cranley-Patterson rotation: adds the shift and wraps around into [0, 1)
+        static double shift(double value, double offset) {
+            value += offset;
+            return value < 1 ? value : value - 1;
+        }
+};
+
+// Creates a sampler of the given type. `samples_per_pixel` is the expected number of samples of
+// each pixel. The `seed` picks the scrambling, shuffles and offsets, such that different seeds
+// (or frames) give independent noise.
+inline shared_ptr<sampler> make_sampler(sampler_type type, int samples_per_pixel, uint64_t seed) {
+    switch (type) {
+        case sampler_type::independent: return make_shared<independent_sampler>();
+        case sampler_type::stratified:
+            return make_shared<stratified_sampler>(samples_per_pixel, seed);
+        case sampler_type::sobol: return make_shared<sobol_sampler>(seed);
+        case sampler_type::blue_noise: return make_shared<blue_noise_sampler>(seed);
+    }
+    return make_shared<independent_sampler>();
+}
+
+#endif
@@ -0,0 +1,432 @@
+#ifndef SCENES_H
+#define SCENES_H
+
+// Header which defines the scenes we render: the objects of the world, together with the camera
+// set up to look at them. They are shared by the renderer (`main.cc`) and the benchmarks
+// (`bench.cc`).
+
+#include "traceme.h"
+#include "camera.h"
+#include "sphere.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "bvh.h"
+#include "linear_bvh.h"
+#include "wide_bvh.h"
+#include "texture.h"
+#include "quad.h"
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+// How the BVH of a scene is laid out: a tree of `bvh_node`s, a `linear_bvh`, or a `bvh4` or
+// `bvh8` collapsed from it. `none` leaves the world a plain list of its objects, which is slow but
+// is what every layout has to render exactly like.
+enum class bvh_layout {
+    tree,
+    linear,
+    bvh4,
+    bvh8,
+    none,
+};
+
+// How the BVH of a scene is built
+struct bvh_settings {
+    bvh_layout layout = bvh_layout::linear;
+    bvh_build_options build;
+};
+
+// Expected cost of tracing a ray through `tree`, for the layouts which can tell
+template <typename bvh_type>
+double bvh_expected_cost(const bvh_type& tree, const bvh_build_options& options) {
+    return tree.expected_cost(options.traversal_cost, options.intersection_cost);
+}
+
+inline double bvh_expected_cost(const bvh_node&, const bvh_build_options&) { return 0; }
+
+// A world and the camera looking at it
+struct scene {
+    hittable_list world;
+    camera cam;
+    // Number of objects in the world, before any BVH groups them
+    size_t object_count = 0;
+    // Time it took to build the world's BVH, zero for worlds without one
+    double bvh_build_seconds = 0;
+    // Expected cost of tracing a ray through the world's BVH (see `linear_bvh::expected_cost`),
+    // zero for worlds without one and for BVHs laid out as trees of `bvh_node`s
+    double bvh_cost = 0;
+
+    // Replaces the objects of the world by a BVH over them, and times how long that takes
+    void build_bvh(const bvh_settings& bvh = bvh_settings()) {
+        switch (bvh.layout) {
+            case bvh_layout::tree:
+                build_bvh_as<bvh_node>(bvh.build);
+                break;
+            case bvh_layout::linear:
+                build_bvh_as<linear_bvh>(bvh.build);
+                break;
+            case bvh_layout::bvh4:
+                build_bvh_as<bvh4>(bvh.build);
+                break;
+            case bvh_layout::bvh8:
+                build_bvh_as<bvh8>(bvh.build);
+                break;
+            case bvh_layout::none:
+                break;
+        }
+    }
+
+    // Replaces the objects of the world by a BVH of type `bvh_type` over them, and times how long
+    // that takes
+    template <typename bvh_type>
+    void build_bvh_as(const bvh_build_options& options) {
+        auto start = std::chrono::steady_clock::now();
+        auto tree = make_shared<bvh_type>(world, options);
+        bvh_build_seconds = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+        bvh_cost = bvh_expected_cost(*tree, options);
+        world = hittable_list(tree);
+    }
+};
+
+inline scene random_sphere_cover_scene(const bvh_settings& bvh = bvh_settings()) {
+    // World / Scene configuration
+    scene s;
+    auto& world = s.world;
+
+    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    auto ground_sphere = make_shared<sphere>(point3(0, -1000, 0), 1000, ground_material);
+
+    // Add it to the world
+    world.add(ground_sphere);
+
+    // Generate a bunch of random spheres, use `a` as `x` coordinate base and `b` as `z` coordinate
+    // base
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            // Stored the likelihood of choosing different materials and and reflection and
+            // refraction properties
+            auto choose_mat = random_double();
+
+            while (choose_mat * 0.9 < 0.2) {
+                choose_mat = random_double();
+            }
+
+            point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
+
+            // Only generate the surfaces if we go beyond this random point
+            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
+                shared_ptr<material> sphere_material;
+
+                if (choose_mat < 0.8) {
+                    // Diffuse, most likely to be chosen
+                    auto albedo = color::random() * color::random();
+                    sphere_material = make_shared<lambertian>(albedo);
+
+                    // Define a new center for the spheres to move to
+                    auto center2 = center + vec3(0, random_double(0, .5), 0);
+                    // Define a moving sphere
+                    world.add(make_shared<sphere>(center, center2, 0.2, sphere_material));
+                } else if (choose_mat < 0.95) {
+                    // metal, less likely
+                    auto albedo = color::random(0.5, 1);
+                    // How much we reflect
+                    auto fuzz = random_double(0, 0.5);
+                    sphere_material = make_shared<metal>(albedo, fuzz);
+                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                } else {
+                    // Glass, very less likely since is computationally  expensive
+                    sphere_material = make_shared<dielectric>(1.5);
+                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                }
+            }
+        }
+    }
+
+    // Add some big spheres
+
+    // Center sphere
+    auto material1 = make_shared<dielectric>(1.5);
+    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
+
+    // Left sphere
+    auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
+    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
+
+    // Right sphere
+    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
+    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+
+    s.object_count = world.objects.size();
+    s.build_bvh(bvh);
+
+    // SetV up the camera through which we view the world
+    auto& cam = s.cam;
+
+    // Setup camera
+    // Change the aspect ratio to something more popular
+    cam.aspect_ratio = 16.0 / 9.0;
+    // Change image's width. This will automatically also change the images height as well.
+    cam.image_width = 400;
+    // Set the number of ray samples we want to cast for each pixel to do anti-aliasing
+    cam.samples_per_pixel = 100;
+    // Set the number of times we want the casted rays to reflect on surfaces of the world
+    cam.max_depth = 50;
+
+    cam.vfov = 20;
+
+    // Move camera to the right, a bit upwards and a bit backwards
+    cam.lookfrom = point3(13, 2, 3);
+    cam.lookat = point3(0, 0, 0);
+    cam.vup = vec3(0, 1, 0);
+
+    cam.defocus_angle = 0.6;
+    cam.focus_dist = 10.0;
+
+    // Change the aspect ratio to something more popular
+    cam.aspect_ratio = 16.0 / 9.0;
+    // Change image's width. This will automatically also change the images height as well.
+    cam.image_width = 400;
+    // Set the number of ray samples we want to cast for each pixel to do anti-aliasing
+    cam.samples_per_pixel = 100;
+    // Set the number of times we want the casted rays to reflect on surfaces of the world
+    cam.max_depth = 50;
+
+    cam.vfov = 90;
+
+    return s;
+}
+
+// A large version of `random_sphere_cover`: `count` small spheres scattered over a square grid on
+// the ground, seen from the same spot. Mostly exercises the BVH. The spheres are placed with their
+// own generator seeded with `seed`, so a given count always gives the same world.
+inline scene sphere_field_scene(size_t count, uint64_t seed = 0,
+        const bvh_settings& bvh = bvh_settings()) {
+    scene s;
+    auto& world = s.world;
+
+    rng random;
+    random.seed(seed, count);
+
+    // A small palette of materials is shared by all the spheres, which keeps the memory of the
+    // world down to the spheres themselves
+    std::vector<shared_ptr<material>> palette;
+    for (int i = 0; i < 48; i++) {
+        auto r = random.next_double(), g = random.next_double(), b = random.next_double();
+        palette.push_back(make_shared<lambertian>(color(r * r, g * g, b * b)));
+    }
+    for (int i = 0; i < 12; i++) {
+        auto shade = 0.5 + 0.5 * random.next_double();
+        auto fuzz = 0.3 * random.next_double();
+        palette.push_back(make_shared<metal>(color(shade, shade, shade), fuzz));
+    }
+    palette.push_back(make_shared<dielectric>(1.5));
+
+    // Spheres sit on a grid of side x side cells, one sphere per cell, like the small spheres of
+    // `random_sphere_cover`
+    int side = int(std::ceil(std::sqrt(double(count))));
+    double ground_radius = 1000.0 * (side > 22 ? side / 22.0 : 1.0);
+    world.add(make_shared<sphere>(point3(0, -ground_radius, 0), ground_radius,
+                make_shared<lambertian>(color(0.5, 0.5, 0.5))));
+
+    for (size_t n = 0; n < count; n++) {
+        double a = double(n % side) - side / 2;
+        double b = double(n / side) - side / 2;
+        point3 center(a + 0.9 * random.next_double(), 0.2, b + 0.9 * random.next_double());
+        auto index = size_t(random.next_double() * palette.size());
+        world.add(make_shared<sphere>(center, 0.2, palette[index]));
+    }
+
+    s.object_count = world.objects.size();
+    s.build_bvh(bvh);
+
+    auto& cam = s.cam;
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 400;
+    cam.samples_per_pixel = 100;
+    cam.max_depth = 50;
+
+    cam.vfov = 20;
+    cam.lookfrom = point3(13, 2, 3);
+    cam.lookat = point3(0, 0, 0);
+    cam.vup = vec3(0, 1, 0);
+
+    cam.defocus_angle = 0.6;
+    cam.focus_dist = 10.0;
+
+    return s;
+}
+
+inline scene checkered_spheres_scene(const bvh_settings& bvh = bvh_settings()) {
+    scene s;
+    auto& world = s.world;
+
+    auto checker = make_shared<checker_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
+
+    world.add(make_shared<sphere>(point3(0, -10, 0), 10, make_shared<lambertian>(checker)));
+    world.add(make_shared<sphere>(point3(0, 10, 0), 10, make_shared<lambertian>(checker)));
+    s.object_count = world.objects.size();
+    s.build_bvh(bvh);
+
+    // SetV up the camera through which we view the world
+    auto& cam = s.cam;
+
+    // Setup camera
+    // Change the aspect ratio to something more popular
+    cam.aspect_ratio = 16.0 / 9.0;
+    // Change image's width. This will automatically also change the images height as well.
+    cam.image_width = 400;
+    // Set the number of ray samples we want to cast for each pixel to do anti-aliasing
+    cam.samples_per_pixel = 100;
+    // Set the number of times we want the casted rays to reflect on surfaces of the world
+    cam.max_depth = 50;
+
+    cam.vfov = 20;
+
+    // Move camera to the right, a bit upwards and a bit backwards
+    cam.lookfrom = point3(13, 2, 3);
+    cam.lookat = point3(0, 0, 0);
+    cam.vup = vec3(0, 1, 0);
+
+    cam.defocus_angle = 0.6;
+
+    return s;
+}
+
+inline scene perlin_spheres_scene(const bvh_settings& bvh = bvh_settings()) {
+    scene s;
+    auto& world = s.world;
+
+    auto perlin_texture = make_shared<noise_texture>(4);
+    auto perlin_material = make_shared<lambertian>(perlin_texture);
+    auto giant_floor = make_shared<sphere>(point3(0, -1000, 0), 1000, perlin_material);
+    auto big_sphere = make_shared<sphere>(point3(0, 2, 0), 2, perlin_material);
+
+    world.add(giant_floor);
+    world.add(big_sphere);
+    s.object_count = world.objects.size();
+    s.build_bvh(bvh);
+
+    // SetV up the camera through which we view the world
+    auto& cam = s.cam;
+
+    // Setup camera
+    // Change the aspect ratio to something more popular
+    cam.aspect_ratio = 16.0 / 9.0;
+    // Change image's width. This will automatically also change the images height as well.
+    cam.image_width = 400;
+    // Set the number of ray samples we want to cast for each pixel to do anti-aliasing
+    cam.samples_per_pixel = 100;
+    // Set the number of times we want the casted rays to reflect on surfaces of the world
+    cam.max_depth = 50;
+
+    cam.vfov = 20;
+    // Move camera to the right, a bit upwards and a bit backwards
+    cam.lookfrom = point3(13, 2, 3);
+    cam.lookat = point3(0, 0, 0);
+    cam.vup = vec3(0, 1, 0);
+
+    cam.defocus_angle = 0;
+
+    return s;
+}
+
+inline scene earth_scene(const bvh_settings& bvh = bvh_settings()) {
+    scene s;
+    auto& world = s.world;
+
+    auto earth_texture = make_shared<image_texture>("earthmap.jpg");
+    auto earth_surface = make_shared<lambertian>(earth_texture);
+    auto globe = make_shared<sphere>(point3(0, 0, 4), 1, earth_surface);
+    world.add(globe);
+
+    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
+    world.add(make_shared<sphere>(point3(2, 0, 3), 1.0, material3));
+    s.object_count = world.objects.size();
+    s.build_bvh(bvh);
+
+    auto& cam = s.cam;
+
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 400;
+    cam.samples_per_pixel = 100;
+    cam.max_depth = 50;
+
+    cam.vfov = 20;
+    cam.lookfrom = point3(0, 0, 12);
+    cam.lookat = point3(0, 0, 0);
+    cam.vup = vec3(0, 1, 0);
+
+    cam.defocus_angle = 0;
+
+    return s;
+}
+
+inline scene quads_scene(const bvh_settings& bvh = bvh_settings()) {
+    scene s;
+    auto& world = s.world;
+
+    // Materials
+    auto left_red = make_shared<lambertian>(color(1.0, 0.2, 0.2));
+    auto back_green = make_shared<lambertian>(color(0.2, 1.0, 0.2));
+    auto right_blue = make_shared<lambertian>(color(0.2, 0.2, 1.0));
+    auto upper_orange = make_shared<lambertian>(color(1.0, 0.5, 0.0));
+    auto lower_teal = make_shared<lambertian>(color(0.2, 0.8, 0.8));
+
+    // Quads
+    world.add(make_shared<quad>(point3(-3, -2, 5), vec3(0, 0, -4), vec3(0, 4, 0), left_red));
+    world.add(make_shared<quad>(point3(-2, -2, 0), vec3(4, 0, 0), vec3(0, 4, 0), back_green));
+    world.add(make_shared<quad>(point3(3, -2, 1), vec3(0, 0, 4), vec3(0, 4, 0), right_blue));
+    world.add(make_shared<quad>(point3(-2, 3, 1), vec3(4, 0, 0), vec3(0, 0, 4), upper_orange));
+    world.add(make_shared<quad>(point3(-2, -3, 5), vec3(4, 0, 0), vec3(0, 0, -4), lower_teal));
+    s.object_count = world.objects.size();
+    s.build_bvh(bvh);
+
+    auto& cam = s.cam;
+
+    cam.aspect_ratio = 1;
+    cam.image_width = 400;
+    cam.samples_per_pixel = 100;
+    cam.max_depth = 50;
+
+    cam.vfov = 80;
+    cam.lookfrom = point3(0, 0, 9);
+    cam.lookat = point3(0, 0, 0);
+    cam.vup = vec3(0, 1, 0);
+
+    cam.defocus_angle = 0;
+
+    return s;
+}
+
+// A scene, by name
+struct scene_entry {
+    std::string name;
+    std::function<scene()> make;
+};
+
+// Every scene we know of. The scenes built with random numbers are built from the same seed each
+// time, such that every run renders exactly the same world.
+inline std::vector<scene_entry> scene_catalog(const bvh_settings& bvh = bvh_settings()) {
+    auto seeded = [](std::function<scene()> make) {
+        return [make]() {
+            thread_rng().seed(0, 0);
+            return make();
+        };
+    };
+
+    return {
+        {"random_sphere_cover", seeded([bvh]() { return random_sphere_cover_scene(bvh); })},
+        {"checkered_spheres", [bvh]() { return checkered_spheres_scene(bvh); }},
+        {"earth", [bvh]() { return earth_scene(bvh); }},
+        {"perlin_spheres", seeded([bvh]() { return perlin_spheres_scene(bvh); })},
+        {"quads", [bvh]() { return quads_scene(bvh); }},
+        {"sphere_field_10k", [bvh]() { return sphere_field_scene(10000, 0, bvh); }},
+        {"sphere_field_1m", [bvh]() { return sphere_field_scene(1000000, 0, bvh); }},
+    };
+}
+
+#endif
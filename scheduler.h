@@ -0,0 +1,160 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+// Header which defines how the image is split into tiles and how those tiles are handed out to
+// the rendering threads.
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A rectangular region of the image, covering the pixels [x0, x1) horizontally and [y0, y1)
+// vertically. A tile is the smallest unit of work a rendering thread picks up.
+struct tile {
+    int x0, y0;
+    int x1, y1;
+};
+
+// Splits the `region` of an image into square tiles of `tile_size` pixels, starting from its top
+// left corner. Tiles on the right and bottom edges are cropped to the region. Tiles are returned
+// in scanline order.
+inline std::vector<tile> make_tiles(const tile& region, int tile_size) {
+    std::vector<tile> tiles;
+    tile_size = tile_size < 1 ? 1 : tile_size;
+
+    for (int y = region.y0; y < region.y1; y += tile_size) {
+        for (int x = region.x0; x < region.x1; x += tile_size) {
+            int x1 = x + tile_size < region.x1 ? x + tile_size : region.x1;
+            int y1 = y + tile_size < region.y1 ? y + tile_size : region.y1;
+            tiles.push_back(tile{x, y, x1, y1});
+        }
+    }
+
+    return tiles;
+}
+
+// Splits an image of `width` x `height` pixels into square tiles of `tile_size` pixels. Tiles on
+// the right and bottom edges are cropped to the image. Tiles are returned in scanline order, such
+// that neighbouring tiles in the vector are also neighbours in the image.
+inline std::vector<tile> make_tiles(int width, int height, int tile_size) {
+    return make_tiles(tile{0, 0, width, height}, tile_size);
+}
+
+// Returns how many threads to use when the user asked for `requested` threads. Zero means we
+// use every hardware thread the machine reports.
+inline unsigned int resolve_thread_count(unsigned int requested) {
+    if (requested > 0) return requested;
+    unsigned int hardware = std::thread::hardware_concurrency();
+    return hardware > 0 ? hardware : 1;
+}
+
+// Splits [`begin`, `end`) into `chunk_count` contiguous chunks of about the same size, and calls
+// `body(chunk, chunk_begin, chunk_end)` for each one of them on its own thread. The calling thread
+// takes chunk 0. Blocks until every chunk is done. The chunks only depend on the arguments, such
+// that two calls with the same range and count see the same chunks.
+template <typename Body>
+void parallel_chunks(size_t begin, size_t end, unsigned int chunk_count, const Body& body) {
+    chunk_count = chunk_count < 1 ? 1 : chunk_count;
+    size_t size = end - begin;
+    auto chunk_start = [&](unsigned int chunk) { return begin + size * chunk / chunk_count; };
+
+    std::vector<std::thread> threads;
+    for (unsigned int chunk = 1; chunk < chunk_count; chunk++) {
+        threads.emplace_back([&, chunk]() {
+            body(chunk, chunk_start(chunk), chunk_start(chunk + 1));
+        });
+    }
+
+    body(0u, chunk_start(0), chunk_start(1));
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// Work stealing scheduler for a fixed set of tiles.
+//
+// Each worker owns a double ended queue, initially filled with a contiguous run of tiles, such
+// that a worker mostly renders neighbouring parts of the image (which touch similar parts of the
+// scene). A worker pops work from the front of its own queue. Once its queue runs dry, it steals
+// from the back of another worker's queue. Tiles differ wildly in cost (sky vs glass), so this
+// keeps every core busy until the very last tiles, instead of having threads idle while one of
+// them is stuck on an expensive region.
+class tile_scheduler {
+    public:
+        tile_scheduler(const std::vector<tile>& tiles, unsigned int worker_count)
+            : queues(worker_count < 1 ? 1 : worker_count)
+        {
+            // Give each worker a contiguous chunk of the tiles
+            size_t workers = queues.size();
+            for (size_t i = 0; i < tiles.size(); i++) {
+                queues[i * workers / tiles.size()].tiles.push_back(tiles[i]);
+            }
+        }
+
+        // Calls `render_tile` for every tile, spread over all the workers, and blocks until all
+        // of them have been rendered. The calling thread acts as worker 0.
+        void run(const std::function<void(const tile&)>& render_tile) {
+            std::vector<std::thread> threads;
+
+            for (unsigned int worker = 1; worker < queues.size(); worker++) {
+                threads.emplace_back([this, worker, &render_tile]() {
+                    work(worker, render_tile);
+                });
+            }
+
+            work(0, render_tile);
+
+            for (auto& thread : threads) {
+                thread.join();
+            }
+        }
+
+    private:
+        // The queue of tiles belonging to one worker. Access is guarded by `lock` since other
+        // workers can steal from it.
+        struct work_queue {
+            std::mutex lock;
+            std::deque<tile> tiles;
+        };
+
+        std::vector<work_queue> queues;
+
+        // Main loop of a worker: render tiles until no queue has any work left. The set of tiles
+        // is fixed up front, so once a full pass over all the queues finds nothing, we are done.
+        void work(unsigned int worker, const std::function<void(const tile&)>& render_tile) {
+            tile t;
+            while (pop(worker, t) || steal(worker, t)) {
+                render_tile(t);
+            }
+        }
+
+        // Takes the next tile from the front of the worker's own queue
+        bool pop(unsigned int worker, tile& t) {
+            auto& queue = queues[worker];
+            std::lock_guard<std::mutex> guard(queue.lock);
+            if (queue.tiles.empty()) return false;
+            t = queue.tiles.front();
+            queue.tiles.pop_front();
+            return true;
+        }
+
+        // Takes a tile from the back of another worker's queue. Stealing from the back means the
+        // thief takes the work the victim would have reached last, so the two do not fight over
+        // the same end of the queue.
+        bool steal(unsigned int thief, tile& t) {
+            for (size_t offset = 1; offset < queues.size(); offset++) {
+                auto& victim = queues[(thief + offset) % queues.size()];
+                std::lock_guard<std::mutex> guard(victim.lock);
+                if (victim.tiles.empty()) continue;
+                t = victim.tiles.back();
+                victim.tiles.pop_back();
+                return true;
+            }
+            return false;
+        }
+};
+
+#endif
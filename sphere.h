@@ -38,6 +38,38 @@ class sphere: public hittable {
         bool hit(const ray& r, const interval& ray_t_interval, hit_record& rec) const override {
             // Updat the center based on the moving ball
             point3 center = is_moving ? sphere_center(r.time()) : center1;
+            double root;
+            if (!intersect(r, center, radius, ray_t_interval, root)) return false;
+            set_hit_record(r, root, center, radius, mat.get(), rec);
+            return true;
+        }
+
+        bool hit_deferred(const ray& r, const interval& ray_t_interval,
+                hit_record& rec) const override {
+            point3 center = is_moving ? sphere_center(r.time()) : center1;
+            double root;
+            if (!intersect(r, center, radius, ray_t_interval, root)) return false;
+            rec.t = root;
+            rec.surface = this;
+            return true;
+        }
+
+        bool occluded(const ray& r, const interval& ray_t_interval) const override {
+            point3 center = is_moving ? sphere_center(r.time()) : center1;
+            double root;
+            return intersect(r, center, radius, ray_t_interval, root);
+        }
+
+        void finish_hit(const ray& r, hit_record& rec) const override {
+            point3 center = is_moving ? sphere_center(r.time()) : center1;
+            set_hit_record(r, rec.t, center, radius, mat.get(), rec);
+        }
+
+        // Finds the nearest `root` within `ray_t_interval` at which the ray `r` crosses the sphere
+        // of `radius` around `center`. Shared with the packed spheres of `primitive_store`.
+        static bool intersect(const ray& r, const point3& center, double radius,
+                const interval& ray_t_interval, double& root) {
+            stats::count(stats::sphere_tests);
             // We need to solve a*x^2 + b*x + c = 0
             // Vector between the center of the sphere and the origin of the ray cast
             auto ray_to_sphere_center = center - r.origin();
@@ -55,12 +87,12 @@ class sphere: public hittable {
                 return false;
             }
 
-            // If the term is zero or positive , there is at least one solution and thus the ray cast
-            // intersects the sphere one or 2 points.
+            // If the term is zero or positive , there is at least one solution and thus the ray
+            // cast intersects the sphere one or 2 points.
             // We know need to find the nearest root that liest between the given t_min and t_max
             // interval
             double sqrt_d = sqrt(discriminant);
-            double root = (h - sqrt_d)/ a;
+            root = (h - sqrt_d)/ a;
 
             if (!ray_t_interval.surrounds(root)) {
                 // We try with the next root
@@ -70,13 +102,21 @@ class sphere: public hittable {
                 }
             }
 
+            stats::count(stats::sphere_hits);
+            return true;
+        }
+
+        // Fills in the hit record for ray `r` hitting the sphere of `radius`, centered at
+        // `center`, at `root`
+        static void set_hit_record(const ray& r, double root, const point3& center, double radius,
+                const material* mat, hit_record& rec) {
             // Log the hit record
             rec.p = r.at(root);
             rec.t = root;
             // Compute the normal
             // First we compute the ray vector
-            // Then we compute the normal (vec pependicular to the hit point) and normalize it, using
-            // the radius of the sphere.
+            // Then we compute the normal (vec pependicular to the hit point) and normalize it,
+            // using the radius of the sphere.
             vec3 outward_normal = (rec.p - center) / radius;
             // Add surface determination for the object
             rec.set_face_normal(r, outward_normal);
@@ -84,11 +124,43 @@ class sphere: public hittable {
             get_sphere_uv(outward_normal, rec.u, rec.v);
             // Give the hit record information about the material of the surface that was just hit
             rec.mat = mat;
+        }
 
-            return true;
+        // Tests all the active lanes of the packet against the sphere at once
+        void hit_packet(ray_packet& packet, uint32_t active, hit_record* recs,
+                uint32_t& hit_mask) const override {
+            intersect_packet(packet, active, center1, center_vec, is_moving, radius, mat.get(),
+                    recs, hit_mask);
+        }
+
+        // Packet version of `intersect` and `set_hit_record`, for the sphere of `radius` around
+        // `center1` at time 0, moving by `center_vec` per unit of time
+        static void intersect_packet(ray_packet& packet, uint32_t active, const point3& center1,
+                const vec3& center_vec, bool is_moving, double radius,
+                const material* mat, hit_record* recs, uint32_t& hit_mask) {
+            const double center[3] = {center1[0], center1[1], center1[2]};
+            const double motion[3] = {center_vec[0], center_vec[1], center_vec[2]};
+            double root[max_packet_size];
+
+            uint32_t hits = packet_kernels().hit_sphere(packet, active, center, motion, radius,
+                    root);
+            stats::count(stats::sphere_tests, __builtin_popcount(active));
+            stats::count(stats::sphere_hits, __builtin_popcount(hits));
+
+            for (int k = 0; k < packet.size; k++) {
+                if (!(hits & (1u << k))) continue;
+                ray r = packet.get(k);
+                point3 center_k = is_moving ? center1 + r.time() * center_vec : center1;
+                set_hit_record(r, root[k], center_k, radius, mat, recs[k]);
+                packet.t_max[k] = root[k];
+            }
+            hit_mask |= hits;
         }
 
     private:
+        // Packs the sphere into its arrays
+        friend class primitive_store;
+
         // In the case of a moving sphere, we want to move it from center1 at time=0 to center2
         // at time = 1. The sphere continues moving indefinitely outside that time interval, so it
         // really can be sampled at any time.
@@ -98,7 +170,7 @@ class sphere: public hittable {
         // Vector along which the sphere moves from the original point `center1`
         vec3 center_vec;
         // Flag of a moving sphere
-        bool is_moving;
+        bool is_moving = false;
         // Bounding box for the sphere
         aabb bbox;
 
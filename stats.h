@@ -0,0 +1,182 @@
+#ifndef STATS_H
+#define STATS_H
+
+// Header which defines the render statistics: counts of the work done while tracing, such as how
+// many BVH nodes were visited or how many spheres were tested, which tell us why a render is slow
+// and how good the BVH is.
+//
+// Statistics are compiled in only when `TRACEME_STATS` is defined. Otherwise `stats::count` is an
+// empty inline function and costs nothing at all.
+//
+// Every thread counts into its own counters, so counting never needs a lock or an atomic, and
+// threads never share a cache line. A thread's counters are added to the totals when it exits,
+// which is when the rendering threads are joined at the end of each pass.
+
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+namespace stats {
+
+#ifdef TRACEME_STATS
+const bool enabled = true;
+#else
+const bool enabled = false;
+#endif
+
+// Everything we count
+enum counter {
+    // Calls to `bvh_node::hit`, rays reaching a node of the BVH
+    bvh_node_visits,
+    // Ray-box tests, and how many of them hit
+    box_tests,
+    box_hits,
+    // Calls to `hittable_list::hit`, and how many objects they tested in total
+    list_visits,
+    list_objects,
+    // Ray-primitive tests, and how many of them hit, by primitive
+    sphere_tests,
+    sphere_hits,
+    quad_tests,
+    quad_hits,
+    // Calls to `material::scatter`, by material, and how many absorbed the ray instead
+    lambertian_scatters,
+    metal_scatters,
+    dielectric_scatters,
+    absorbed_scatters,
+    counter_count,
+};
+
+const char* const counter_names[counter_count] = {
+    "bvh node visits",
+    "box tests",
+    "box hits",
+    "list visits",
+    "list objects tested",
+    "sphere tests",
+    "sphere hits",
+    "quad tests",
+    "quad hits",
+    "lambertian scatters",
+    "metal scatters",
+    "dielectric scatters",
+    "absorbed scatters",
+};
+
+// A set of counters
+struct counters {
+    uint64_t values[counter_count] = {};
+
+    uint64_t operator[](counter c) const { return values[c]; }
+
+    void add(const counters& other) {
+        for (int c = 0; c < counter_count; c++) values[c] += other.values[c];
+    }
+};
+
+// Totals of the threads which have exited, and the list of the threads still counting
+struct registry {
+    std::mutex lock;
+    counters retired;
+    std::vector<const counters*> live;
+};
+
+inline registry& global_registry() {
+    static registry instance;
+    return instance;
+}
+
+// The counters of one thread, which join the registry for the lifetime of the thread
+struct thread_counters {
+    counters local;
+
+    thread_counters() {
+        auto& r = global_registry();
+        std::lock_guard<std::mutex> guard(r.lock);
+        r.live.push_back(&local);
+    }
+
+    ~thread_counters() {
+        auto& r = global_registry();
+        std::lock_guard<std::mutex> guard(r.lock);
+        r.retired.add(local);
+        for (auto& entry : r.live) {
+            if (entry == &local) {
+                entry = r.live.back();
+                r.live.pop_back();
+                break;
+            }
+        }
+    }
+};
+
+inline counters& local_counters() {
+    thread_local thread_counters instance;
+    return instance.local;
+}
+
+// Adds `amount` to counter `c` of the calling thread
+inline void count(counter c, uint64_t amount = 1) {
+    if (enabled) local_counters().values[c] += amount;
+}
+
+// Current value of counter `c` of the calling thread, for measuring the work of a piece of code
+inline uint64_t thread_value(counter c) {
+    return enabled ? local_counters().values[c] : 0;
+}
+
+// Returns the sum of the counters of every thread. Only exact once the threads which counted are
+// done, since the counters of running threads are read without synchronization.
+inline counters total() {
+    counters sum;
+    if (!enabled) return sum;
+
+    auto& r = global_registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+    sum.add(r.retired);
+    for (auto entry : r.live) sum.add(*entry);
+    return sum;
+}
+
+// Sets every counter of every thread back to zero. Must not be called while threads are counting.
+inline void reset() {
+    if (!enabled) return;
+
+    auto& r = global_registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+    r.retired = counters();
+    for (auto entry : r.live) *const_cast<counters*>(entry) = counters();
+}
+
+// Prints the counters, along with the averages per ray of the main ones
+inline void print_summary(std::ostream& out, const counters& c, uint64_t rays) {
+    auto per_ray = [&](uint64_t value) { return rays ? double(value) / rays : 0.0; };
+    auto ratio = [](uint64_t part, uint64_t whole) {
+        return whole ? 100.0 * double(part) / whole : 0.0;
+    };
+    auto flags = out.flags();
+    auto precision = out.precision();
+
+    out << "Statistics:\n" << std::fixed << std::setprecision(2)
+        << "  " << std::left << std::setw(22) << "rays" << std::right << std::setw(16) << rays
+        << '\n';
+    for (int n = 0; n < counter_count; n++) {
+        out << "  " << std::left << std::setw(22) << counter_names[n] << std::right
+            << std::setw(16) << c.values[n] << std::setw(12) << per_ray(c.values[n])
+            << " per ray\n";
+    }
+    out << "  box hit rate         " << std::setw(15) << ratio(c[box_hits], c[box_tests]) << "%\n"
+        << "  sphere hit rate      " << std::setw(15) << ratio(c[sphere_hits], c[sphere_tests])
+        << "%\n"
+        << "  quad hit rate        " << std::setw(15) << ratio(c[quad_hits], c[quad_tests])
+        << "%\n";
+
+    out.flags(flags);
+    out.precision(precision);
+}
+
+}
+
+#endif
@@ -7,6 +7,9 @@
 #include <memory>
 #include <cstdlib>
 
+#include "random.h"
+#include "stats.h"
+
 // C++ std functions we use often
 using std::make_shared;
 using std::shared_ptr;
@@ -30,8 +33,8 @@ inline double degrees_to_radians(double degrees) {
 
 // Generate a random double
 inline double random_double() {
-    // Returns a random double in the interval [0, 1.0]
-    return rand() / (RAND_MAX + 1.0);
+    // Returns a random double in the interval [0, 1.0), drawn from the calling thread's generator
+    return thread_rng().next_double();
 }
 
 // Generate a random double in the interval given by [`min`, `max`)
@@ -155,30 +155,44 @@ inline vec3 unit_vector(const vec3& v) {
     return v / v.length();
 }
 
-// We use the rejection method to generate a random vector inside of the unit sphere.
-// We pick a random point in the unit cube and reject it until is also in the unit sphere.
-inline vec3 random_in_unit_sphere() {
-    // Keep going
-    while (true) {
-        // Pick a random point in the unit cube
-        auto p = vec3::random(-1, 1);
-        // The unit sphere has a radiu of 1
-        auto unit_sphere_radius = 1.0;
-        // We consider the center of the sphere (sx, sy, sz)
-        // A point (x, y, z) is in the unit sphere if it satisfies:
-        // (x - sx)^2 + (y - sy)^2 + (z - sz)^2 < r^2
-        // In our case, the unit sphere center point is (0, 0, 0), so it becomes
-        // x^2 + y^2 + z^2 < r^2. Which is essentially the dot product of p with p < 1
-        if (p.length_squared() < 1.0) {
-            return p;
-        }
-    }
-}
-
-// We normalize the random vector inside a sphere to obtain the point ON the sphere. Which
-// essentially is solving `r` for r = sqrt(dot(p, p))
+// Warps
+//
+// The functions below turn uniform numbers `u` and `v` in [0, 1) into points distributed over
+// various shapes, in closed form. They used to pick points in the surrounding square or cube
+// until one landed inside the shape, which wastes random numbers, branches unpredictably, and
+// above all cannot map a well distributed set of (u, v) points (see `sampler.h`) to a well
+// distributed set of points on the shape, since every rejection shifts the pairing.
+//
+// Each warp preserves area: equal areas of the unit square map to equal areas of the shape.
+
+// Uniform point in the unit disk (z = 0). The radius grows as sqrt(u), since the area of a disk
+// grows with the square of its radius.
+inline vec3 sample_unit_disk(double u, double v) {
+    auto r = sqrt(u);
+    auto phi = 2 * pi * v;
+    return vec3(r * std::cos(phi), r * std::sin(phi), 0);
+}
+
+// Uniform point on the surface of the unit sphere. By Archimedes' hat-box theorem, the height `z`
+// of a uniform point on the sphere is uniform in [-1, 1].
+inline vec3 sample_unit_sphere(double u, double v) {
+    auto z = 1 - 2 * u;
+    auto r = sqrt(fmax(0.0, 1 - z * z));
+    auto phi = 2 * pi * v;
+    return vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+// Point on the hemisphere around +z, with a density proportional to the cosine of its angle with
+// +z. This is a uniform point on the disk, lifted up onto the hemisphere (Malley's method).
+inline vec3 sample_cosine_hemisphere(double u, double v) {
+    auto p = sample_unit_disk(u, v);
+    return vec3(p.x(), p.y(), sqrt(fmax(0.0, 1 - u)));
+}
+
+// Random vector on the unit sphere. Adding it to a surface normal gives a cosine distributed
+// direction around the normal, which is what lambertian surfaces use.
 inline vec3 random_unit_vector() {
-    return unit_vector(random_in_unit_sphere());
+    return sample_unit_sphere(random_double(), random_double());
 }
 
 // Determine if the vector is on the right hemisphere. We can do that by comparing it with the
@@ -229,18 +243,4 @@ inline vec3 refract(const vec3& unit_ray_in, const vec3& normal, double etai_ove
     return refract_ray_out_perp + refract_ray_out_parallel;
 }
 
-// Helper function to choose random points on the camera's defocus disk, which acts similar to a
-// real world physical camera's lens.
-inline vec3 random_in_unit_disk() {
-    while(true) {
-        // Define a circle, z is 0, so it is a 3D shape
-        auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
-
-        // If p is inside the circle, return it
-        if (p.length_squared() < 1) {
-            return p;
-        }
-    }
-}
-
 #endif
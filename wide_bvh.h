@@ -0,0 +1,406 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+// Header which defines wide BVHs: bounding volume hierarchies whose nodes have 4 (`bvh4`) or 8
+// (`bvh8`) children instead of 2.
+//
+// A wide tree is made by collapsing the binary tree of `linear_bvh`: each wide node takes in the
+// children of its binary node, then the children of those, until it holds W of them. The boxes of
+// the W children of a node are stored axis by axis (all the minimums along x, then all the maximums
+// along x, and so on), so a ray tests all of them at once, one child per SIMD lane. A ray visits
+// about half as many nodes (BVH4), or a third (BVH8), as in the binary tree, and each visit reads
+// one block of memory instead of W scattered ones. The children the ray hits are visited nearest
+// first, and the ones whose box starts beyond the closest hit found so far are skipped.
+//
+// Like the packet kernels, the traversal is compiled for several instruction sets, and the one
+// `packet_kernels()` picked for this machine is used.
+
+#include "traceme.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "linear_bvh.h"
+#include "packet.h"
+#include "primitives.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// A node of a wide BVH, with up to `W` children. Unused slots have an empty box, which no ray
+// hits.
+template <int W>
+struct alignas(64) wide_bvh_node {
+    // Boxes of the children, rounded outwards to floats. Row 2 * axis holds their minimums along
+    // the axis, row 2 * axis + 1 their maximums.
+    float bounds[6][W];
+    // For each child, the index of its node, or of its first primitive for a leaf
+    uint32_t child[W];
+    // For each child, the number of primitives of a leaf, zero for a node
+    uint16_t count[W];
+};
+
+namespace wide_bvh_kernel {
+
+// Where the traversal is, or has yet to go: a node, or the primitives of a leaf, along with the
+// distance at which the ray enters its box
+struct entry {
+    uint32_t index;
+    uint32_t count;
+    double t;
+};
+
+// Tests the ray against the boxes of all the children of `node`, within (`t_min`, `t_max`), with
+// the slab test of `aabb::hit` in each lane. Returns the mask of the children hit, and the
+// distance at which the ray enters each of them in `t_near`.
+template <int W>
+TRACEME_ALWAYS_INLINE uint32_t hit_children(const wide_bvh_node<W>& node, const traversal_ray& r,
+        double t_min, double t_max, double* t_near) {
+    double lo[W];
+    double hi[W];
+    for (int k = 0; k < W; k++) {
+        lo[k] = t_min;
+        hi[k] = t_max;
+    }
+
+    for (int axis = 0; axis < 3; axis++) {
+        const float* enter = node.bounds[2 * axis + r.sign[axis]];
+        const float* leave = node.bounds[2 * axis + 1 - r.sign[axis]];
+        for (int k = 0; k < W; k++) {
+            double t0 = (double(enter[k]) - r.origin[axis]) * r.inv_direction[axis];
+            double t1 = (double(leave[k]) - r.origin[axis]) * r.inv_direction[axis];
+            lo[k] = t0 > lo[k] ? t0 : lo[k];
+            hi[k] = t1 < hi[k] ? t1 : hi[k];
+        }
+    }
+
+    bool hit[W];
+    for (int k = 0; k < W; k++) {
+        hit[k] = hi[k] > lo[k];
+        t_near[k] = lo[k];
+    }
+    return packet_kernel::to_mask<W>(hit);
+}
+
+// Closest hit of the ray with the primitives of the tree `nodes`, within `ray_t`, leaving the
+// surface attributes to `owner` (see `primitive_store::hit`)
+template <int W>
+TRACEME_ALWAYS_INLINE bool traverse(const wide_bvh_node<W>* nodes,
+        const primitive_store& primitives, const hittable* owner, const ray& r,
+        const interval& ray_t, hit_record& rec) {
+    traversal_ray tr(r);
+
+    // Every level of the tree pushes at most W - 1 entries, and trees are at most 64 levels deep
+    entry stack[64 * W];
+    int stack_top = 0;
+    entry current = {0, 0, ray_t.min};
+    bool hit_anything = false;
+    double closest = ray_t.max;
+
+    while (true) {
+        if (current.count > 0) {
+            if (primitives.hit(current.index, current.index + current.count, r,
+                        interval(ray_t.min, closest), owner, rec)) {
+                hit_anything = true;
+                closest = rec.t;
+            }
+        } else {
+            const auto& node = nodes[current.index];
+            stats::count(stats::bvh_node_visits);
+            stats::count(stats::box_tests, W);
+
+            double t_near[W];
+            uint32_t mask = hit_children<W>(node, tr, ray_t.min, closest, t_near);
+            stats::count(stats::box_hits, __builtin_popcount(mask));
+
+            if (mask) {
+                // Sort the children hit by distance, nearest first
+                entry hits[W];
+                int hit_count = 0;
+                while (mask) {
+                    int k = __builtin_ctz(mask);
+                    mask &= mask - 1;
+                    entry e = {node.child[k], node.count[k], t_near[k]};
+                    int n = hit_count++;
+                    for (; n > 0 && hits[n - 1].t > e.t; n--) hits[n] = hits[n - 1];
+                    hits[n] = e;
+                }
+
+                // Go on with the nearest, the others wait on the stack, farthest at the bottom
+                for (int n = hit_count - 1; n > 0; n--) stack[stack_top++] = hits[n];
+                current = hits[0];
+                continue;
+            }
+        }
+
+        // Skip the entries whose box starts beyond the closest hit found since they were pushed
+        bool found = false;
+        while (stack_top > 0) {
+            current = stack[--stack_top];
+            if (current.t < closest) {
+                found = true;
+                break;
+            }
+        }
+        if (!found) break;
+    }
+
+    return hit_anything;
+}
+
+// Whether the ray hits any of the primitives of the tree `nodes` within `ray_t`. The first hit
+// ends the search. As the interval never shrinks, there is nothing to gain from sorting the
+// children by distance. They are visited in the order of their slots instead, which holds the
+// biggest box, the likeliest to be hit, first.
+template <int W>
+TRACEME_ALWAYS_INLINE bool occluded(const wide_bvh_node<W>* nodes,
+        const primitive_store& primitives, const ray& r, const interval& ray_t) {
+    traversal_ray tr(r);
+
+    entry stack[64 * W];
+    int stack_top = 0;
+    entry current = {0, 0, ray_t.min};
+
+    while (true) {
+        if (current.count > 0) {
+            if (primitives.occluded(current.index, current.index + current.count, r, ray_t)) {
+                return true;
+            }
+        } else {
+            const auto& node = nodes[current.index];
+            stats::count(stats::bvh_node_visits);
+            stats::count(stats::box_tests, W);
+
+            double t_near[W];
+            uint32_t mask = hit_children<W>(node, tr, ray_t.min, ray_t.max, t_near);
+            stats::count(stats::box_hits, __builtin_popcount(mask));
+
+            if (mask) {
+                // Push the highest slots first, so the lowest ones come off the stack first
+                int first = __builtin_ctz(mask);
+                mask &= ~(1u << first);
+                while (mask) {
+                    int k = 31 - __builtin_clz(mask);
+                    mask &= ~(1u << k);
+                    stack[stack_top++] = {node.child[k], node.count[k], t_near[k]};
+                }
+                current = {node.child[first], node.count[first], t_near[first]};
+                continue;
+            }
+        }
+
+        if (stack_top == 0) return false;
+        current = stack[--stack_top];
+    }
+}
+
+}
+
+// The traversals of trees of width `W` compiled for one instruction set
+template <int W>
+struct wide_bvh_traversal {
+    bool (*hit)(const wide_bvh_node<W>* nodes, const primitive_store& primitives,
+            const hittable* owner, const ray& r, const interval& ray_t, hit_record& rec);
+    bool (*occluded)(const wide_bvh_node<W>* nodes, const primitive_store& primitives,
+            const ray& r, const interval& ray_t);
+};
+
+// Instantiates the traversals of trees of width `W` as functions named
+// `wide_bvh<W>_<traversal>_<suffix>`, compiled with the given function attributes
+#define TRACEME_WIDE_BVH_TRAVERSAL(suffix, W, ...) \
+    __VA_ARGS__ inline bool wide_bvh##W##_hit_##suffix(const wide_bvh_node<W>* nodes, \
+            const primitive_store& primitives, const hittable* owner, const ray& r, \
+            const interval& ray_t, hit_record& rec) { \
+        return wide_bvh_kernel::traverse<W>(nodes, primitives, owner, r, ray_t, rec); \
+    } \
+    __VA_ARGS__ inline bool wide_bvh##W##_occluded_##suffix(const wide_bvh_node<W>* nodes, \
+            const primitive_store& primitives, const ray& r, const interval& ray_t) { \
+        return wide_bvh_kernel::occluded<W>(nodes, primitives, r, ray_t); \
+    }
+
+#if defined(__GNUC__)
+TRACEME_WIDE_BVH_TRAVERSAL(generic, 4, __attribute__((TRACEME_PACKET_OPTIONS)))
+TRACEME_WIDE_BVH_TRAVERSAL(generic, 8, __attribute__((TRACEME_PACKET_OPTIONS)))
+#else
+TRACEME_WIDE_BVH_TRAVERSAL(generic, 4, )
+TRACEME_WIDE_BVH_TRAVERSAL(generic, 8, )
+#endif
+
+#ifdef TRACEME_PACKET_X86
+TRACEME_WIDE_BVH_TRAVERSAL(avx2, 4, __attribute__((target("avx2"), TRACEME_PACKET_OPTIONS)))
+TRACEME_WIDE_BVH_TRAVERSAL(avx2, 8, __attribute__((target("avx2"), TRACEME_PACKET_OPTIONS)))
+TRACEME_WIDE_BVH_TRAVERSAL(avx512, 4, __attribute__((target("avx512f"), TRACEME_PACKET_OPTIONS)))
+TRACEME_WIDE_BVH_TRAVERSAL(avx512, 8, __attribute__((target("avx512f"), TRACEME_PACKET_OPTIONS)))
+#endif
+
+// Picks the traversals for trees of width `W` compiled for the instruction set of the packet
+// kernels
+template <int W>
+wide_bvh_traversal<W> select_wide_bvh_traversal() {
+    static_assert(W == 4 || W == 8, "wide BVHs have 4 or 8 children per node");
+#ifdef TRACEME_PACKET_X86
+    const char* isa = packet_kernels().name;
+    if (std::strcmp(isa, "avx512") == 0) {
+        if constexpr (W == 4) return {wide_bvh4_hit_avx512, wide_bvh4_occluded_avx512};
+        else return {wide_bvh8_hit_avx512, wide_bvh8_occluded_avx512};
+    }
+    if (std::strcmp(isa, "avx2") == 0) {
+        if constexpr (W == 4) return {wide_bvh4_hit_avx2, wide_bvh4_occluded_avx2};
+        else return {wide_bvh8_hit_avx2, wide_bvh8_occluded_avx2};
+    }
+#endif
+    if constexpr (W == 4) return {wide_bvh4_hit_generic, wide_bvh4_occluded_generic};
+    else return {wide_bvh8_hit_generic, wide_bvh8_occluded_generic};
+}
+
+template <int W>
+class wide_bvh : public hittable {
+    public:
+        // Builds the binary tree of `list` as `linear_bvh` does, then collapses it
+        wide_bvh(const hittable_list& list,
+                const bvh_build_options& options = bvh_build_options())
+            : traversal(select_wide_bvh_traversal<W>())
+        {
+            linear_bvh binary(list, options);
+            const auto& binary_nodes = binary.node_array();
+            if (binary_nodes.empty()) return;
+
+            primitives = binary.take_primitives();
+            bbox = binary.bounding_box();
+            nodes.reserve(binary_nodes.size() / (W - 1) + 1);
+            collapse(binary_nodes, 0);
+        }
+
+        bool hit(const ray& r, const interval& ray_t, hit_record& rec) const override {
+            return hit_and_finish(r, ray_t, rec);
+        }
+
+        bool hit_deferred(const ray& r, const interval& ray_t, hit_record& rec) const override {
+            if (nodes.empty()) return false;
+            return traversal.hit(nodes.data(), primitives, this, r, ray_t, rec);
+        }
+
+        bool occluded(const ray& r, const interval& ray_t) const override {
+            if (nodes.empty()) return false;
+            return traversal.occluded(nodes.data(), primitives, r, ray_t);
+        }
+
+        void finish_hit(const ray& r, hit_record& rec) const override {
+            primitives.finish(r, rec);
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        // Number of nodes, for reporting the size of the tree
+        size_t node_count() const { return nodes.size(); }
+
+        // Expected cost of tracing a ray which goes through the root box, as in
+        // `linear_bvh::expected_cost`, where testing all the children of a node at once costs
+        // a single `traversal_cost`
+        double expected_cost(double traversal_cost = 1.0, double intersection_cost = 1.0) const {
+            if (nodes.empty()) return 0;
+
+            double root_area = bbox.surface_area();
+            if (!(root_area > 0)) return traversal_cost + intersection_cost * primitives.size();
+
+            double cost = traversal_cost;
+            for (const auto& node : nodes) {
+                for (int k = 0; k < W; k++) {
+                    aabb box(point3(node.bounds[0][k], node.bounds[2][k], node.bounds[4][k]),
+                            point3(node.bounds[1][k], node.bounds[3][k], node.bounds[5][k]));
+                    // Unused slots
+                    if (node.bounds[0][k] > node.bounds[1][k]) continue;
+
+                    double chance = box.surface_area() / root_area;
+                    cost += chance * (node.count[k] > 0 ? intersection_cost * node.count[k]
+                            : traversal_cost);
+                }
+            }
+            return cost;
+        }
+
+    private:
+        std::vector<wide_bvh_node<W>> nodes;
+        // The objects, packed in the order of the leaves
+        primitive_store primitives;
+        aabb bbox;
+        wide_bvh_traversal<W> traversal;
+
+        // Appends the wide node made of binary node `index` of `binary`, and the nodes below it.
+        // Returns the index of the wide node.
+        uint32_t collapse(const std::vector<linear_bvh_node>& binary, uint32_t index) {
+            uint32_t wide_index = uint32_t(nodes.size());
+            nodes.emplace_back();
+
+            // The binary nodes which become the children of the wide node. A leaf at the root
+            // becomes the only child.
+            uint32_t children[W];
+            int child_count = 0;
+            if (binary[index].is_leaf()) {
+                children[child_count++] = index;
+            } else {
+                children[child_count++] = index + 1;
+                children[child_count++] = binary[index].offset;
+            }
+
+            // Replace the biggest node among them by its two children, until there are W. Big
+            // boxes are the likeliest to be hit, pulling their children up saves the most visits.
+            while (child_count < W) {
+                int biggest = -1;
+                double biggest_area = -1;
+                for (int n = 0; n < child_count; n++) {
+                    const auto& node = binary[children[n]];
+                    if (node.is_leaf()) continue;
+                    double area = node.box().surface_area();
+                    if (area > biggest_area) {
+                        biggest = n;
+                        biggest_area = area;
+                    }
+                }
+                if (biggest < 0) break;
+
+                uint32_t opened = children[biggest];
+                children[biggest] = opened + 1;
+                children[child_count++] = binary[opened].offset;
+            }
+
+            // Biggest box first, for occlusion queries. Closest hits sort the children by
+            // distance anyway.
+            std::stable_sort(children, children + child_count, [&](uint32_t a, uint32_t b) {
+                return binary[a].box().surface_area() > binary[b].box().surface_area();
+            });
+
+            wide_bvh_node<W> wide;
+            for (int k = 0; k < W; k++) {
+                for (int axis = 0; axis < 3; axis++) {
+                    wide.bounds[2 * axis][k] = infinity;
+                    wide.bounds[2 * axis + 1][k] = -infinity;
+                }
+                wide.child[k] = 0;
+                wide.count[k] = 0;
+            }
+
+            for (int k = 0; k < child_count; k++) {
+                const auto& node = binary[children[k]];
+                for (int axis = 0; axis < 3; axis++) {
+                    wide.bounds[2 * axis][k] = node.bounds[0][axis];
+                    wide.bounds[2 * axis + 1][k] = node.bounds[1][axis];
+                }
+                if (node.is_leaf()) {
+                    wide.child[k] = node.offset;
+                    wide.count[k] = node.count;
+                } else {
+                    wide.child[k] = collapse(binary, children[k]);
+                }
+            }
+
+            // `nodes` may have been reallocated by the children
+            nodes[wide_index] = wide;
+            return wide_index;
+        }
+};
+
+using bvh4 = wide_bvh<4>;
+using bvh8 = wide_bvh<8>;
+
+#endif